@@ -0,0 +1,331 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#include "connection.h"
+
+//Size of the chunks that a response file is read in when it cannot be sent with sendfile()
+#define FILE_CHUNK 16384
+
+//Makes sure there is room for at least extra more bytes in the response head
+//Returns 0 on success, -1 if memory could not be allocated
+static int ReserveOutput(connection_t* connection, int extra);
+
+//Grows the request buffer if it is full
+//Returns 0 on success, -1 if the request is too large or memory could not be allocated
+static int ReserveInput(connection_t* connection);
+
+//Called when the client has half-closed the socket.  Whatever it sent is the whole request
+//Returns CONNECTION_DONE, or CONNECTION_ERROR if nothing was sent at all
+static int FinishRequest(connection_t* connection);
+
+//Parses the newly read part of the request buffer
+//Sets request_length and returns true once the request is complete or known to be malformed
+static int ParseRequest(connection_t* connection);
+
+connection_t* connection_create(int fd, struct event_loop_t* loop) {
+    connection_t* connection = (connection_t*)calloc(1, sizeof(connection_t));
+    if(connection == NULL) {
+        return NULL;
+    }
+    connection->fd = fd;
+    connection->loop = loop;
+    connection->file_fd = -1;
+    connection->route = METRICS_ROUTES;
+    http_request_init(&connection->request);
+
+    //The buffers are allocated lazily so that idle connections stay small
+    return connection;
+}
+
+void connection_destroy(connection_t* connection) {
+    close(connection->fd);
+    if(connection->file_fd != -1) {
+        close(connection->file_fd);
+    }
+    if(connection->body_release != NULL) {
+        connection->body_release(connection->body_release_arg);
+    }
+    free(connection->in_buffer);
+    free(connection->out_buffer);
+    free(connection);
+}
+
+int connection_read(connection_t* connection) {
+    while(1) {
+        if(ReserveInput(connection) < 0) {
+            return CONNECTION_ERROR;
+        }
+
+        int numRead = read(connection->fd, connection->in_buffer + connection->in_length,
+                connection->in_capacity - connection->in_length);
+
+        if(numRead > 0) {
+            connection->in_length += numRead;
+            connection->in_buffer[connection->in_length] = '\0';
+            if(ParseRequest(connection)) {
+                return CONNECTION_DONE;
+            }
+        } else if(numRead == 0) {
+            return FinishRequest(connection);
+        } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+            return CONNECTION_AGAIN;
+        } else if(errno != EINTR) {
+            return CONNECTION_ERROR;
+        }
+    }
+}
+
+int connection_receive(connection_t* connection, const char* data, int length) {
+    if(length == 0) {
+        return FinishRequest(connection);
+    }
+
+    while(length > 0) {
+        if(ReserveInput(connection) < 0) {
+            return CONNECTION_ERROR;
+        }
+        int toCopy = connection->in_capacity - connection->in_length;
+        if(toCopy > length) {
+            toCopy = length;
+        }
+        memcpy(connection->in_buffer + connection->in_length, data, toCopy);
+        connection->in_length += toCopy;
+        connection->in_buffer[connection->in_length] = '\0';
+        data += toCopy;
+        length -= toCopy;
+    }
+
+    //Bytes after a complete request are kept for the next one, just as if read() had returned them together
+    return ParseRequest(connection) ? CONNECTION_DONE : CONNECTION_AGAIN;
+}
+
+int connection_append(connection_t* connection, const char* data, int length) {
+    if(ReserveOutput(connection, length) < 0) {
+        return -1;
+    }
+    memcpy(connection->out_buffer + connection->out_length, data, length);
+    connection->out_length += length;
+    return 0;
+}
+
+void connection_set_body(connection_t* connection, const char* body, int length, void (*release)(void*),
+        void* releaseArg) {
+    connection->body = body;
+    connection->body_length = length;
+    connection->body_sent = 0;
+    connection->body_release = release;
+    connection->body_release_arg = releaseArg;
+}
+
+void connection_set_file(connection_t* connection, int fileDescriptor, off_t length) {
+    connection->file_fd = fileDescriptor;
+    connection->file_offset = 0;
+    connection->file_remaining = length;
+    connection->file_copy = 0;
+}
+
+int connection_next_request(connection_t* connection) {
+    //Shift any pipelined bytes to the front of the request buffer
+    int remaining = connection->in_length - connection->request_length;
+    if(remaining > 0) {
+        memmove(connection->in_buffer, connection->in_buffer + connection->request_length, remaining);
+        connection->in_buffer[remaining] = '\0';
+    } else {
+        //Nothing else is buffered, so give the memory back while the connection waits for its next request
+        free(connection->in_buffer);
+        connection->in_buffer = NULL;
+        connection->in_capacity = 0;
+    }
+    connection->in_length = remaining;
+    connection->request_length = 0;
+    connection->request_error = 0;
+    http_request_init(&connection->request);
+
+    //Forget the previous response
+    connection->out_length = 0;
+    connection->out_sent = 0;
+    if(connection->body_release != NULL) {
+        connection->body_release(connection->body_release_arg);
+        connection->body_release = NULL;
+    }
+    connection->body = NULL;
+    connection->body_length = 0;
+    connection->body_sent = 0;
+    if(connection->file_fd != -1) {
+        close(connection->file_fd);
+        connection->file_fd = -1;
+    }
+    connection->file_offset = 0;
+    connection->file_remaining = 0;
+    connection->file_copy = 0;
+    connection->keep_alive = 0;
+    connection->route = METRICS_ROUTES;
+    connection->parse_time = 0;
+
+    return remaining > 0 && ParseRequest(connection);
+}
+
+int connection_fill_stream(connection_t* connection, int heartbeat) {
+    connection->out_length = 0;
+    connection->out_sent = 0;
+    return connection->stream_fill(connection, heartbeat);
+}
+
+int connection_flush(connection_t* connection) {
+    while(1) {
+        int headRemaining = connection->out_length - connection->out_sent;
+        int bodyRemaining = connection->body_length - connection->body_sent;
+
+        if(headRemaining > 0 || bodyRemaining > 0) {
+            //Send the head and the body together so that a small response costs a single system call
+            struct iovec vector[2];
+            int vectorCount = 0;
+            if(headRemaining > 0) {
+                vector[vectorCount].iov_base = connection->out_buffer + connection->out_sent;
+                vector[vectorCount].iov_len = headRemaining;
+                vectorCount++;
+            }
+            if(bodyRemaining > 0) {
+                vector[vectorCount].iov_base = (void*)(connection->body + connection->body_sent);
+                vector[vectorCount].iov_len = bodyRemaining;
+                vectorCount++;
+            }
+
+            ssize_t numWritten = writev(connection->fd, vector, vectorCount);
+            if(numWritten < 0) {
+                if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return CONNECTION_AGAIN;
+                } else if(errno == EINTR) {
+                    continue;
+                }
+                return CONNECTION_ERROR;
+            }
+
+            connection_advance(connection, numWritten);
+        } else if(connection->file_remaining > 0 && !connection->file_copy) {
+            //Let the kernel move the file from the page cache to the socket without copying it through user space
+            ssize_t numSent = sendfile(connection->fd, connection->file_fd, &connection->file_offset,
+                    connection->file_remaining);
+            if(numSent > 0) {
+                connection->file_remaining -= numSent;
+            } else if(numSent == 0) {
+                //The file was truncated after the Content-Length was sent
+                return CONNECTION_ERROR;
+            } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return CONNECTION_AGAIN;
+            } else if(errno == EINVAL || errno == ENOSYS) {
+                //The file system does not support sendfile(), so fall back to copying
+                connection->file_copy = 1;
+            } else if(errno != EINTR) {
+                return CONNECTION_ERROR;
+            }
+        } else if(connection->file_remaining > 0) {
+            int toRead = connection_reserve_file_chunk(connection);
+            if(toRead < 0) {
+                return CONNECTION_ERROR;
+            }
+            int numRead = pread(connection->file_fd, connection->out_buffer, toRead, connection->file_offset);
+            if(numRead <= 0) {
+                return CONNECTION_ERROR;
+            }
+            connection_file_chunk_read(connection, numRead);
+        } else {
+            return CONNECTION_DONE;
+        }
+    }
+}
+
+void connection_advance(connection_t* connection, int numWritten) {
+    //Advance through the head first, then the body
+    int headRemaining = connection->out_length - connection->out_sent;
+    if(numWritten <= headRemaining) {
+        connection->out_sent += numWritten;
+    } else {
+        connection->out_sent = connection->out_length;
+        connection->body_sent += numWritten - headRemaining;
+    }
+}
+
+int connection_reserve_file_chunk(connection_t* connection) {
+    //The head has been sent, so reuse its buffer for the next chunk of the file
+    connection->out_length = 0;
+    connection->out_sent = 0;
+    if(ReserveOutput(connection, FILE_CHUNK) < 0) {
+        return -1;
+    }
+    return connection->file_remaining < FILE_CHUNK ? connection->file_remaining : FILE_CHUNK;
+}
+
+void connection_file_chunk_read(connection_t* connection, int numRead) {
+    connection->out_length = numRead;
+    connection->file_offset += numRead;
+    connection->file_remaining -= numRead;
+}
+
+static int ReserveOutput(connection_t* connection, int extra) {
+    int needed = connection->out_length + extra;
+    if(needed > connection->out_capacity) {
+        int newCapacity = connection->out_capacity == 0 ? 1024 : connection->out_capacity;
+        while(newCapacity < needed) {
+            newCapacity *= 2;
+        }
+        char* newBuffer = (char*)realloc(connection->out_buffer, newCapacity);
+        if(newBuffer == NULL) {
+            return -1;
+        }
+        connection->out_buffer = newBuffer;
+        connection->out_capacity = newCapacity;
+    }
+    return 0;
+}
+
+static int ReserveInput(connection_t* connection) {
+    //Grow the request buffer once it is full
+    if(connection->in_length == connection->in_capacity) {
+        if(connection->in_capacity >= CONNECTION_MAX_REQUEST) {
+            return -1;
+        }
+        int newCapacity = connection->in_capacity == 0 ? CONNECTION_READ_CHUNK : connection->in_capacity * 2;
+        char* newBuffer = (char*)realloc(connection->in_buffer, newCapacity + 1);
+        if(newBuffer == NULL) {
+            return -1;
+        }
+        connection->in_buffer = newBuffer;
+        connection->in_capacity = newCapacity;
+    }
+    return 0;
+}
+
+static int FinishRequest(connection_t* connection) {
+    connection->peer_closed = 1;
+    if(connection->in_length == 0) {
+        return CONNECTION_ERROR;
+    }
+    long start = metrics_now();
+    if(http_parse_finish(&connection->request, connection->in_buffer, connection->in_length) == HTTP_PARSE_ERROR) {
+        connection->request_error = 1;
+    }
+    connection->parse_time += metrics_now() - start;
+    connection->request_length = connection->in_length;
+    return CONNECTION_DONE;
+}
+
+static int ParseRequest(connection_t* connection) {
+    long start = metrics_now();
+    int result = http_parse(&connection->request, connection->in_buffer, connection->in_length);
+    connection->parse_time += metrics_now() - start;
+    if(result == HTTP_PARSE_DONE) {
+        connection->request_length = connection->request.length;
+        return 1;
+    } else if(result == HTTP_PARSE_ERROR) {
+        //There is no telling where the next request would start, so the handler answers and closes
+        connection->request_error = 1;
+        connection->request_length = connection->in_length;
+        return 1;
+    }
+    return 0;
+}
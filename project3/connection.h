@@ -0,0 +1,166 @@
+#ifndef _CONNECTION_H_
+#define _CONNECTION_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "http_parser.h"
+#include "metrics.h"
+
+/*
+connection holds the per-socket state used by the event loop: the bytes of the request read so far and the
+response waiting to be written.  A connection is only ever touched by one thread at a time.  The event loop owns
+it while it is reading the request or writing the response, and a worker thread owns it while the request is
+being handled.
+*/
+
+//Initial size of the request buffer.  Most requests arrive in a single read() of this size
+#define CONNECTION_READ_CHUNK 8192
+
+//Requests (headers and body) that do not fit in this many bytes are rejected
+#define CONNECTION_MAX_REQUEST 65536
+
+//Result codes for connection_read, connection_receive and connection_flush
+#define CONNECTION_DONE 1       //The request is complete / the response has been completely written
+#define CONNECTION_AGAIN 0      //The socket would block, wait for the next readiness event
+#define CONNECTION_ERROR -1     //The peer closed the socket or an error occurred, the connection should be destroyed
+
+struct event_loop_t;
+
+typedef enum
+{
+    CONNECTION_READING,     //The event loop is waiting for a complete request
+    CONNECTION_HANDLING,    //A worker thread is handling the request
+    CONNECTION_WRITING,     //The event loop is waiting for the socket to accept the rest of the response
+    CONNECTION_STREAMING    //The response never ends.  The event loop sends more of it whenever there is more
+} connection_state_t;
+
+typedef struct connection_t {
+    int fd;
+    connection_state_t state;
+    struct event_loop_t* loop; //The event loop this connection is registered with
+    int keep_alive; //Set by the request handler if the connection stays open after the response
+    int peer_closed; //True once the client has shut down its side of the socket
+
+    //Links in the event loop's list of connections waiting for a request, oldest first
+    struct connection_t* idle_prev;
+    struct connection_t* idle_next;
+    long idle_since; //Time in seconds at which the connection started waiting
+    long dispatch_time; //Time in microseconds at which the current request was handed to the thread pool
+
+    //Timings of the current request, for metrics
+    metrics_route_t route; //Set by the request handler.  METRICS_ROUTES if the request is not to be recorded
+    long parse_time; //Microseconds spent parsing the request, over every read it took
+    long handler_start; //Times in microseconds at which the handler was called and returned
+    long handler_end;
+
+    //Request buffer.  Holds the raw bytes read from the socket
+    char* in_buffer;
+    int in_length;
+    int in_capacity;
+    int request_length; //Length of the complete request at the start of in_buffer, 0 if still incomplete
+    int request_error; //True if the request at the start of in_buffer is malformed
+
+    //The request being parsed, incrementally as bytes arrive.  Its slices point into in_buffer
+    http_request_t request;
+
+    //Response head.  Holds the status line, headers and any dynamically generated content
+    char* out_buffer;
+    int out_length;
+    int out_capacity;
+    int out_sent;
+
+    //Optional response body that is not owned by the connection (a file cache entry)
+    //body_release is called with body_release_arg once the connection no longer needs the memory
+    const char* body;
+    int body_length;
+    int body_sent;
+    void (*body_release)(void*);
+    void* body_release_arg;
+
+    //Optional response body streamed from an open file.  The connection closes file_fd when it is done
+    //The file is sent with sendfile() unless that fails, in which case file_copy is set and it is copied through
+    //out_buffer instead
+    int file_fd;
+    off_t file_offset;
+    off_t file_remaining;
+    int file_copy;
+
+    //Set by a request handler whose response is a stream that does not end, such as server-sent events.  Once the
+    //head has been sent the event loop keeps the connection, and whenever it is woken with event_loop_wake_streams
+    //it calls stream_fill to append the next part of the response to the (by then empty) head.  stream_fill returns
+    //the number of bytes it appended.  If heartbeat is true the stream has been quiet for a while, and stream_fill
+    //should append something the client ignores when it has nothing else, so that a client that has gone away is
+    //noticed.  stream_position is for stream_fill to keep its place in whatever it streams
+    int (*stream_fill)(struct connection_t* connection, int heartbeat);
+    uint64_t stream_position;
+    long stream_sent_at; //Time in seconds at which the stream last sent anything
+
+    //Links in the event loop's list of streams
+    struct connection_t* stream_prev;
+    struct connection_t* stream_next;
+
+    //Used by the io_uring engine: the operations it has in flight for the connection, whether one of them failed,
+    //whether the connection has timed out and its receive (or, for a stream, its poll) has been cancelled, and
+    //whether a stream has a poll in flight that completes when its client goes away
+    int pending_ops;
+    int op_failed;
+    int cancelled;
+    int stream_polling;
+} connection_t;
+
+//Allocates a connection for an accepted, non-blocking socket
+connection_t* connection_create(int fd, struct event_loop_t* loop);
+
+//Closes the socket and any open response file, and frees the connection
+void connection_destroy(connection_t* connection);
+
+//Reads what is available on the socket into the request buffer and parses it
+//Several pipelined requests may be buffered at once; request_length marks the end of the first
+//Returns CONNECTION_DONE once a complete request has been buffered and parsed (or found to be malformed, in which
+//case request_error is set), CONNECTION_AGAIN if more bytes are needed, or CONNECTION_ERROR on EOF, error or an
+//oversized request
+int connection_read(connection_t* connection);
+
+//Appends bytes that were received without connection_read (by the io_uring engine) to the request buffer and parses
+//them.  A length of 0 means the client half-closed the socket
+//Returns the same as connection_read
+int connection_receive(connection_t* connection, const char* data, int length);
+
+//Appends bytes to the response head
+//Returns 0 on success, -1 if memory could not be allocated
+int connection_append(connection_t* connection, const char* data, int length);
+
+//Sets a response body that is sent after the head without being copied.  The memory must stay valid until
+//release (if not NULL) is called with releaseArg, which happens once the response has been written
+void connection_set_body(connection_t* connection, const char* body, int length, void (*release)(void*),
+        void* releaseArg);
+
+//Sets an open regular file to be sent after the head.  The connection takes ownership of fileDescriptor
+void connection_set_file(connection_t* connection, int fileDescriptor, off_t length);
+
+//Discards the request that was just answered and resets the response
+//Any bytes that followed the request (pipelined requests) are kept at the start of the request buffer
+//Returns true if the next request is already complete
+int connection_next_request(connection_t* connection);
+
+//Forgets the part of a stream that has been sent and calls stream_fill for the next part
+//Returns the number of bytes stream_fill appended
+int connection_fill_stream(connection_t* connection, int heartbeat);
+
+//Writes as much of the pending response as the socket will accept
+//Returns CONNECTION_DONE when the whole response has been sent, CONNECTION_AGAIN if the socket would block,
+//or CONNECTION_ERROR if the write failed
+int connection_flush(connection_t* connection);
+
+//Records that numWritten bytes of the head and body were sent without connection_flush (by the io_uring engine)
+void connection_advance(connection_t* connection, int numWritten);
+
+//Makes room in the response head, which must have been sent already, for the next chunk of the response file
+//Returns the number of bytes to read from file_fd at file_offset into out_buffer, or -1 on allocation failure
+int connection_reserve_file_chunk(connection_t* connection);
+
+//Records that numRead bytes of the file were read into the response head by connection_reserve_file_chunk's caller
+void connection_file_chunk_read(connection_t* connection, int numRead);
+
+#endif
@@ -0,0 +1,1144 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "event_loop.h"
+#include "uring.h"
+
+//Maximum number of readiness events handled per call to epoll_wait
+#define MAX_EVENTS 256
+
+//Every socket is registered edge-triggered and one-shot.  One-shot guarantees that only one thread owns a
+//connection at a time: after an event fires, the fd stays disabled until whoever owns the connection re-arms it
+#define CONNECTION_EVENTS (EPOLLET | EPOLLONESHOT | EPOLLRDHUP)
+
+//Edge-triggered but not one-shot, for streams.  Only the event loop thread ever touches a stream, so there is no
+//need to disable it between events, and it is told straight away when the client goes away
+#define STREAM_EVENTS (EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP)
+
+//Seconds a stream may send nothing before it is asked for a heartbeat
+#define STREAM_HEARTBEAT 15
+
+//Size of the io_uring engine's submission queue
+#define URING_ENTRIES 4096
+
+//Provided buffers that the io_uring engine's receives are given.  A buffer is only held from the moment data
+//arrives until its completion has been copied into the connection, so a few hundred serve any number of connections
+#define URING_BUFFERS 256
+#define URING_BUFFER_GROUP 0
+
+//The user data of an io_uring completion is the connection it belongs to, with the operation in the low bits
+//(connections come from malloc, so they are at least 16 byte aligned).  Operations of the loop itself have no
+//connection
+#define OP_MASK 15
+#define OP_RECV 1
+#define OP_SEND 2
+#define OP_READ 3
+#define OP_POLL 4
+#define OP_ACCEPT 1
+#define OP_SWEEP 2
+#define OP_CANCEL 3
+#define OP_WAKE 4
+
+struct event_loop_t {
+    int epoll_fd;
+    int listen_fd;
+    threadpool_t* thread_pool;
+    void (*handler)(void*); //Request handler run on the thread pool
+    void (*overload_handler)(void*); //Refuses a request that could not be handled in time
+    int queue_deadline; //Milliseconds a request may wait in the thread pool's queue, 0 for no limit
+
+    //Connections waiting for a request, in the order they started waiting (oldest at the head)
+    //Worker threads append to the list when a keep-alive response completes, so it needs a lock
+    int idle_timeout;
+    pthread_mutex_t idle_lock;
+    connection_t* idle_head;
+    connection_t* idle_tail;
+
+    //io_uring engine, or NULL if the loop uses epoll.  Worker threads submit their responses directly, so
+    //submissions are serialized by submit_lock.  Completions are only ever reaped by the event loop thread
+    uring_t* ring;
+    pthread_mutex_t submit_lock;
+    int multishot_accept; //False if the kernel can only accept one connection per submission
+    int accept_stalled; //True if accepting failed and is retried at the next sweep
+    struct __kernel_timespec sweep_interval;
+
+    //Streams.  stream_fd is an eventfd that event_loop_wake_streams writes to, at most once until the loop has
+    //handled it.  Workers hand new streams over through new_streams; everything else about streams is only touched
+    //by the event loop thread
+    int stream_fd;
+    atomic_int stream_wake_pending;
+    atomic_int stream_count;
+    pthread_mutex_t stream_lock;
+    connection_t* new_streams;
+    connection_t* streams;
+    connection_t* closed_streams; //Freed once the epoll events that may still refer to them have been handled
+    uint64_t stream_wake_value; //The io_uring engine reads stream_fd into this
+
+    atomic_int stopping; //Set by event_loop_stop, which then wakes the loop through stream_fd
+};
+
+//Allocates a loop and fills in everything but the I/O backend
+static event_loop_t* NewLoop(int listenfd, threadpool_t* threadPool, void (*handler)(void*),
+        void (*overloadHandler)(void*), int idleTimeout, int queueDeadline);
+
+//Accepts every pending connection on the listening socket and registers it for reading
+static void AcceptConnections(event_loop_t* loop);
+
+//Reads from a connection that became readable.  Dispatches it to the thread pool once the request is complete
+static void HandleReadable(event_loop_t* loop, connection_t* connection);
+
+//Continues writing a response on a connection that became writable
+static void HandleWritable(event_loop_t* loop, connection_t* connection);
+
+//Hands a connection with a complete request to the thread pool, or refuses the request if the pool is full
+static void Dispatch(event_loop_t* loop, connection_t* connection);
+
+//Answers the current request with the overload handler and closes the connection once the answer is sent
+static void RefuseRequest(event_loop_t* loop, connection_t* connection);
+
+//Writes as much of the response as the socket accepts
+//Returns true if it has all been written.  Otherwise the connection has been re-armed or closed and must not be used
+static int SendResponse(event_loop_t* loop, connection_t* connection);
+
+//Thread pool task.  Runs the request handler and writes the response, then carries on with any pipelined
+//requests that are already buffered
+static void ServeRequests(void* connectionArg);
+
+//Called once the whole response has been written.  Closes the connection, or gets it ready for the next request
+//Returns true if the next request is already buffered and should be handled by the caller
+static int FinishResponse(event_loop_t* loop, connection_t* connection);
+
+//Records how long each phase of the request just answered took, unless the handler left it unrecorded
+static void RecordRequest(connection_t* connection);
+
+//Puts a connection in the idle list and re-arms it for reading
+static void StartWaiting(event_loop_t* loop, connection_t* connection);
+
+//Appends a connection to the idle list, stamped with the current time
+static void AddToIdleList(event_loop_t* loop, connection_t* connection);
+
+//Removes a connection from the idle list
+static void RemoveFromIdleList(event_loop_t* loop, connection_t* connection);
+
+//Hands a connection whose response head has been sent over to the event loop thread as a stream
+static void StartStream(event_loop_t* loop, connection_t* connection);
+
+//Takes over the streams handed over by StartStream, and sends whatever every stream has to send
+//Called by the event loop thread whenever stream_fd fires
+static void HandleStreamWake(event_loop_t* loop);
+
+//Handles an epoll event on a stream
+static void HandleStreamEvent(event_loop_t* loop, connection_t* connection, int events);
+
+//Sends as much of a stream as the socket accepts, asking stream_fill for more each time it has all been sent.
+//heartbeat is passed on to stream_fill
+static void ContinueStream(event_loop_t* loop, connection_t* connection, int heartbeat);
+
+//Asks the streams that have been quiet for STREAM_HEARTBEAT seconds for a heartbeat
+static void SweepStreams(event_loop_t* loop);
+
+//Frees the streams closed while handling the last batch of epoll events
+static void FreeClosedStreams(event_loop_t* loop);
+
+//Closes a connection owned by the calling thread
+static void CloseConnection(event_loop_t* loop, connection_t* connection);
+
+//Closes the connections that have been waiting for a request for longer than the idle timeout
+static void CloseIdleConnections(event_loop_t* loop);
+
+//Re-enables a one-shot registration for the given events
+static void Rearm(event_loop_t* loop, connection_t* connection, int events);
+
+//Runs the io_uring engine until the loop is stopped
+static void RunUring(event_loop_t* loop);
+
+//Handles one io_uring completion
+static void HandleCompletion(event_loop_t* loop, unsigned long userData, int result, unsigned int flags);
+
+//Registers a connection accepted by the multishot accept, or re-submits the accept once it has stopped
+static void HandleAccepted(event_loop_t* loop, int result, unsigned int flags);
+
+//Copies the data a receive completed with into the connection, and dispatches it once the request is complete
+static void HandleReceived(event_loop_t* loop, connection_t* connection, int result, unsigned int flags);
+
+//Accounts for a completed send or file read, and carries on with the response once all of them have completed
+static void HandleSent(event_loop_t* loop, connection_t* connection, int operation, int result);
+
+//Submits the accept, as a multishot accept if the kernel supports it
+static void SubmitAccept(event_loop_t* loop);
+
+//Submits the timeout that wakes the engine up once a second to close idle connections
+static void SubmitSweep(event_loop_t* loop);
+
+//Submits a read of stream_fd
+static void SubmitStreamWake(event_loop_t* loop);
+
+//Submits a poll that completes when a stream's client goes away
+static void SubmitStreamPoll(event_loop_t* loop, connection_t* connection);
+
+//Closes a stream whose poll has completed, because its client went away or because the stream was closed and the
+//poll cancelled
+static void HandleStreamHangup(event_loop_t* loop, connection_t* connection);
+
+//Submits a receive into a provided buffer for a connection waiting for a request
+static void SubmitReceive(event_loop_t* loop, connection_t* connection);
+
+//Submits the rest of the response: the head and the body as two linked sends, or a read of the next chunk of the
+//response file
+//Returns true if nothing is left to send.  Otherwise the completions carry on with the connection, or it has been
+//closed, and it must not be used
+static int SubmitResponse(event_loop_t* loop, connection_t* connection);
+
+//Cancels the receives of the connections that have been waiting for a request for longer than the idle timeout.
+//Each connection is closed when its receive completes
+static void CancelIdleConnections(event_loop_t* loop);
+
+//Returns the current time in seconds from a clock that never jumps
+static long Now();
+
+event_loop_t* event_loop_create(int listenfd, threadpool_t* threadPool, void (*handler)(void*),
+        void (*overloadHandler)(void*), int idleTimeout, int queueDeadline) {
+    event_loop_t* loop = NewLoop(listenfd, threadPool, handler, overloadHandler, idleTimeout, queueDeadline);
+
+    loop->epoll_fd = epoll_create1(0);
+    if(loop->epoll_fd < 0) {
+        perror("epoll_create1");
+        event_loop_destroy(loop);
+        return NULL;
+    }
+
+    //The listening socket must not block once the pending connections have been drained
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+
+    //The listening socket is identified by a NULL data pointer
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = NULL;
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listenfd, &event) < 0) {
+        perror("epoll_ctl");
+        event_loop_destroy(loop);
+        return NULL;
+    }
+
+    //And the streams' eventfd by the loop itself
+    fcntl(loop->stream_fd, F_SETFL, fcntl(loop->stream_fd, F_GETFL, 0) | O_NONBLOCK);
+    event.data.ptr = loop;
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->stream_fd, &event) < 0) {
+        perror("epoll_ctl");
+        event_loop_destroy(loop);
+        return NULL;
+    }
+
+    return loop;
+}
+
+event_loop_t* event_loop_create_uring(int listenfd, threadpool_t* threadPool, void (*handler)(void*),
+        void (*overloadHandler)(void*), int idleTimeout, int queueDeadline) {
+    event_loop_t* loop = NewLoop(listenfd, threadPool, handler, overloadHandler, idleTimeout, queueDeadline);
+
+    loop->ring = uring_create(URING_ENTRIES);
+    int result = loop->ring != NULL ? uring_register_buffers(loop->ring, URING_BUFFER_GROUP, URING_BUFFERS,
+            CONNECTION_READ_CHUNK) : -errno;
+    if(result < 0) {
+        //Older kernels, seccomp filters and the io_uring_disabled sysctl all end up here
+        fprintf(stderr, "io_uring is not available (%s), using epoll\n", strerror(-result));
+        event_loop_destroy(loop);
+        return event_loop_create(listenfd, threadPool, handler, overloadHandler, idleTimeout, queueDeadline);
+    }
+
+    //io_uring waits for the sockets itself, so they are left blocking.  That way no operation ever completes with
+    //EAGAIN, whatever the kernel version
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) & ~O_NONBLOCK);
+    loop->multishot_accept = 1;
+    loop->sweep_interval.tv_sec = 1;
+    loop->sweep_interval.tv_nsec = 0;
+    return loop;
+}
+
+void event_loop_run(event_loop_t* loop) {
+    if(loop->ring != NULL) {
+        RunUring(loop);
+        return;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    long lastSweep = Now();
+
+    while(!atomic_load(&loop->stopping)) {
+        //Wake up at least once a second to close idle connections
+        int numEvents = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, 1000);
+        if(numEvents < 0) {
+            if(errno != EINTR) {
+                perror("epoll_wait");
+            }
+            continue;
+        }
+
+        int i;
+        for(i = 0; i < numEvents; i++) {
+            connection_t* connection = (connection_t*)events[i].data.ptr;
+            if(connection == NULL) {
+                AcceptConnections(loop);
+            } else if((void*)connection == (void*)loop) {
+                HandleStreamWake(loop);
+            } else if(connection->state == CONNECTION_STREAMING) {
+                HandleStreamEvent(loop, connection, events[i].events);
+            } else if(connection->state == CONNECTION_WRITING) {
+                HandleWritable(loop, connection);
+            } else {
+                HandleReadable(loop, connection);
+            }
+        }
+
+        if(Now() != lastSweep) {
+            lastSweep = Now();
+            CloseIdleConnections(loop);
+            SweepStreams(loop);
+            if(loop->accept_stalled) {
+                loop->accept_stalled = 0;
+                AcceptConnections(loop);
+            }
+        }
+        FreeClosedStreams(loop);
+    }
+}
+
+void event_loop_destroy(event_loop_t* loop) {
+    if(loop->epoll_fd >= 0) {
+        close(loop->epoll_fd);
+    }
+    if(loop->ring != NULL) {
+        uring_destroy(loop->ring);
+    }
+    if(loop->stream_fd >= 0) {
+        close(loop->stream_fd);
+    }
+    pthread_mutex_destroy(&loop->stream_lock);
+    pthread_mutex_destroy(&loop->idle_lock);
+    pthread_mutex_destroy(&loop->submit_lock);
+    free(loop);
+}
+
+static event_loop_t* NewLoop(int listenfd, threadpool_t* threadPool, void (*handler)(void*),
+        void (*overloadHandler)(void*), int idleTimeout, int queueDeadline) {
+    event_loop_t* loop = (event_loop_t*)calloc(1, sizeof(event_loop_t));
+    loop->epoll_fd = -1;
+    loop->listen_fd = listenfd;
+    loop->thread_pool = threadPool;
+    loop->handler = handler;
+    loop->overload_handler = overloadHandler;
+    loop->queue_deadline = queueDeadline;
+
+    loop->idle_timeout = idleTimeout;
+    pthread_mutex_init(&loop->idle_lock, NULL);
+    loop->idle_head = NULL;
+    loop->idle_tail = NULL;
+
+    loop->ring = NULL;
+    pthread_mutex_init(&loop->submit_lock, NULL);
+
+    loop->stream_fd = eventfd(0, EFD_CLOEXEC);
+    if(loop->stream_fd < 0) {
+        perror("eventfd");
+    }
+    atomic_init(&loop->stream_wake_pending, 0);
+    atomic_init(&loop->stream_count, 0);
+    atomic_init(&loop->stopping, 0);
+    pthread_mutex_init(&loop->stream_lock, NULL);
+    loop->new_streams = NULL;
+    loop->streams = NULL;
+    loop->closed_streams = NULL;
+    return loop;
+}
+
+void event_loop_stop(event_loop_t* loop) {
+    atomic_store(&loop->stopping, 1);
+
+    //Nothing can be reported from a signal handler.  The write only fails if the counter is full, and then the loop
+    //is awake already
+    uint64_t one = 1;
+    if(write(loop->stream_fd, &one, sizeof(one)) < 0) {
+        return;
+    }
+}
+
+void event_loop_wake_streams(event_loop_t* loop) {
+    //Every wake-up before the loop clears stream_wake_pending is handled by the one that set it
+    if(atomic_load(&loop->stream_count) == 0 || atomic_load(&loop->stream_wake_pending) ||
+            atomic_exchange(&loop->stream_wake_pending, 1)) {
+        return;
+    }
+    uint64_t one = 1;
+    if(write(loop->stream_fd, &one, sizeof(one)) < 0) {
+        perror("eventfd");
+    }
+}
+
+static void AcceptConnections(event_loop_t* loop) {
+    while(1) {
+        int connfd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if(connfd < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                //Most likely out of file descriptors.  The listening socket is edge triggered, so the connections
+                //still in the backlog would wait for the next one to arrive; retry them at the next sweep instead,
+                //once idle connections may have been closed
+                perror("accept");
+                loop->accept_stalled = 1;
+            }
+            return;
+        }
+
+        //Responses are written in as few calls as possible, so there is nothing to gain from Nagle's algorithm
+        int flag = 1;
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+        connection_t* connection = connection_create(connfd, loop);
+        if(connection == NULL) {
+            close(connfd);
+            continue;
+        }
+
+        //Put the connection in the idle list before epoll can report it, since that may happen right away
+        connection->state = CONNECTION_READING;
+        AddToIdleList(loop, connection);
+
+        struct epoll_event event;
+        event.events = EPOLLIN | CONNECTION_EVENTS;
+        event.data.ptr = connection;
+        if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, connfd, &event) < 0) {
+            perror("epoll_ctl");
+            CloseConnection(loop, connection);
+        }
+    }
+}
+
+static void HandleReadable(event_loop_t* loop, connection_t* connection) {
+    int result = connection_read(connection);
+    if(result == CONNECTION_DONE) {
+        RemoveFromIdleList(loop, connection);
+        Dispatch(loop, connection);
+    } else if(result == CONNECTION_AGAIN) {
+        Rearm(loop, connection, EPOLLIN);
+    } else {
+        CloseConnection(loop, connection);
+    }
+}
+
+static void HandleWritable(event_loop_t* loop, connection_t* connection) {
+    int result = connection_flush(connection);
+    if(result == CONNECTION_DONE) {
+        if(FinishResponse(loop, connection)) {
+            Dispatch(loop, connection);
+        }
+    } else if(result == CONNECTION_AGAIN) {
+        Rearm(loop, connection, EPOLLOUT);
+    } else {
+        CloseConnection(loop, connection);
+    }
+}
+
+static void Dispatch(event_loop_t* loop, connection_t* connection) {
+    //The worker now owns the connection.  It stays disabled in epoll until the worker re-arms it
+    //The request has been parsed already, so the customer's priority decides where it waits in the queue.  A
+    //malformed request only gets an error, so its arguments are not trusted
+    connection->state = CONNECTION_HANDLING;
+    connection->dispatch_time = metrics_now();
+    int priority = connection->request_error ? 0 : http_request_arg_int(&connection->request, "priority", 0);
+    if(threadpool_try_add(loop->thread_pool, &ServeRequests, connection, priority) == THREADPOOL_FULL) {
+        //Waiting for room would stop the event loop from accepting and reading, so turn the request away now
+        RefuseRequest(loop, connection);
+    }
+}
+
+static void RefuseRequest(event_loop_t* loop, connection_t* connection) {
+    connection->keep_alive = 0;
+    loop->overload_handler(connection);
+    if(SendResponse(loop, connection)) {
+        FinishResponse(loop, connection);
+    }
+}
+
+static int SendResponse(event_loop_t* loop, connection_t* connection) {
+    connection->state = CONNECTION_WRITING;
+    if(loop->ring != NULL) {
+        return SubmitResponse(loop, connection);
+    }
+
+    //Try to send the response right away.  Most responses fit in the socket buffer, which saves a round trip
+    //through epoll
+    int result = connection_flush(connection);
+    if(result == CONNECTION_AGAIN) {
+        Rearm(loop, connection, EPOLLOUT);
+        return 0;
+    } else if(result == CONNECTION_ERROR) {
+        CloseConnection(loop, connection);
+        return 0;
+    }
+    return 1;
+}
+
+static void ServeRequests(void* connectionArg) {
+    connection_t* connection = (connection_t*)connectionArg;
+    event_loop_t* loop = connection->loop;
+
+    //A request that sat in the queue past its deadline is dropped rather than run.  The client has probably given
+    //up on it, and running it would only make the requests behind it later still
+    connection->handler_start = metrics_now();
+    if(loop->queue_deadline > 0 &&
+            connection->handler_start - connection->dispatch_time > loop->queue_deadline * 1000L) {
+        RefuseRequest(loop, connection);
+        return;
+    }
+
+    do {
+        loop->handler(connection);
+        connection->handler_end = metrics_now();
+
+        //A client that has shut down its side cannot send another request
+        if(connection->peer_closed) {
+            connection->keep_alive = 0;
+        }
+
+        if(!SendResponse(loop, connection)) {
+            return;
+        }
+    } while(FinishResponse(loop, connection));
+}
+
+static int FinishResponse(event_loop_t* loop, connection_t* connection) {
+    RecordRequest(connection);
+    if(connection->stream_fill != NULL) {
+        StartStream(loop, connection);
+        return 0;
+    }
+    if(!connection->keep_alive) {
+        CloseConnection(loop, connection);
+        return 0;
+    }
+
+    if(connection_next_request(connection)) {
+        //A pipelined request is handled straight away, without waiting in the queue
+        connection->state = CONNECTION_HANDLING;
+        connection->dispatch_time = metrics_now();
+        connection->handler_start = connection->dispatch_time;
+        return 1;
+    }
+
+    StartWaiting(loop, connection);
+    return 0;
+}
+
+static void RecordRequest(connection_t* connection) {
+    metrics_route_t route = connection->route;
+    if(route == METRICS_ROUTES) {
+        return;
+    }
+    connection->route = METRICS_ROUTES;
+
+    //Writing ends here for a whole response, and with the head for a stream
+    metrics_record(route, METRICS_QUEUE, connection->handler_start - connection->dispatch_time);
+    metrics_record(route, METRICS_PARSE, connection->parse_time);
+    metrics_record(route, METRICS_HANDLER, connection->handler_end - connection->handler_start);
+    metrics_record(route, METRICS_WRITE, metrics_now() - connection->handler_end);
+}
+
+static void StartWaiting(event_loop_t* loop, connection_t* connection) {
+    connection->state = CONNECTION_READING;
+    AddToIdleList(loop, connection);
+
+    //Once re-armed, the event loop owns the connection, so this must be the last thing done with it
+    if(loop->ring != NULL) {
+        SubmitReceive(loop, connection);
+    } else {
+        Rearm(loop, connection, EPOLLIN);
+    }
+}
+
+static void AddToIdleList(event_loop_t* loop, connection_t* connection) {
+    connection->idle_since = Now();
+
+    pthread_mutex_lock(&loop->idle_lock);
+    connection->idle_prev = loop->idle_tail;
+    connection->idle_next = NULL;
+    if(loop->idle_tail != NULL) {
+        loop->idle_tail->idle_next = connection;
+    } else {
+        loop->idle_head = connection;
+    }
+    loop->idle_tail = connection;
+    pthread_mutex_unlock(&loop->idle_lock);
+}
+
+static void RemoveFromIdleList(event_loop_t* loop, connection_t* connection) {
+    pthread_mutex_lock(&loop->idle_lock);
+    if(connection->idle_prev != NULL) {
+        connection->idle_prev->idle_next = connection->idle_next;
+    } else {
+        loop->idle_head = connection->idle_next;
+    }
+    if(connection->idle_next != NULL) {
+        connection->idle_next->idle_prev = connection->idle_prev;
+    } else {
+        loop->idle_tail = connection->idle_prev;
+    }
+    connection->idle_prev = NULL;
+    connection->idle_next = NULL;
+    pthread_mutex_unlock(&loop->idle_lock);
+}
+
+static void StartStream(event_loop_t* loop, connection_t* connection) {
+    connection->state = CONNECTION_STREAMING;
+    connection->stream_sent_at = Now();
+    atomic_fetch_add(&loop->stream_count, 1);
+
+    pthread_mutex_lock(&loop->stream_lock);
+    connection->stream_next = loop->new_streams;
+    loop->new_streams = connection;
+    pthread_mutex_unlock(&loop->stream_lock);
+
+    //The loop thread owns the stream from here on
+    event_loop_wake_streams(loop);
+}
+
+static void HandleStreamWake(event_loop_t* loop) {
+    //Clear the flag before looking at the streams, so that anything added from now on wakes the loop again
+    uint64_t value;
+    if(loop->ring == NULL && read(loop->stream_fd, &value, sizeof(value)) < 0 && errno != EAGAIN) {
+        perror("eventfd");
+    }
+    atomic_store(&loop->stream_wake_pending, 0);
+
+    pthread_mutex_lock(&loop->stream_lock);
+    connection_t* adopted = loop->new_streams;
+    loop->new_streams = NULL;
+    pthread_mutex_unlock(&loop->stream_lock);
+
+    while(adopted != NULL) {
+        connection_t* connection = adopted;
+        adopted = connection->stream_next;
+        connection->stream_prev = NULL;
+        connection->stream_next = loop->streams;
+        if(loop->streams != NULL) {
+            loop->streams->stream_prev = connection;
+        }
+        loop->streams = connection;
+
+        if(loop->ring != NULL) {
+            SubmitStreamPoll(loop, connection);
+        } else {
+            struct epoll_event event;
+            event.events = STREAM_EVENTS;
+            event.data.ptr = connection;
+            if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) < 0) {
+                perror("epoll_ctl");
+                CloseConnection(loop, connection);
+            }
+        }
+    }
+
+    connection_t* connection = loop->streams;
+    while(connection != NULL) {
+        //Continuing the stream may close it
+        connection_t* next = connection->stream_next;
+        ContinueStream(loop, connection, 0);
+        connection = next;
+    }
+}
+
+static void HandleStreamEvent(event_loop_t* loop, connection_t* connection, int events) {
+    //A stream closed earlier in the same batch of events is not freed until the batch is done
+    if(connection->stream_fill == NULL) {
+        return;
+    }
+    //The client has nothing to say to a stream, so input can only mean that it is going away
+    if(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+        CloseConnection(loop, connection);
+    } else if(events & EPOLLOUT) {
+        ContinueStream(loop, connection, 0);
+    }
+}
+
+static void ContinueStream(event_loop_t* loop, connection_t* connection, int heartbeat) {
+    if(loop->ring != NULL) {
+        //One send at a time.  When it completes, HandleSent continues the stream
+        if(connection->pending_ops == 0 && connection_fill_stream(connection, heartbeat) > 0) {
+            connection->stream_sent_at = Now();
+            SubmitResponse(loop, connection);
+        }
+        return;
+    }
+
+    while(1) {
+        //Once the socket is full, the next EPOLLOUT edge carries on
+        int result = connection_flush(connection);
+        if(result == CONNECTION_AGAIN) {
+            return;
+        } else if(result == CONNECTION_ERROR) {
+            CloseConnection(loop, connection);
+            return;
+        }
+        if(connection_fill_stream(connection, heartbeat) <= 0) {
+            return;
+        }
+        connection->stream_sent_at = Now();
+        heartbeat = 0;
+    }
+}
+
+static void SweepStreams(event_loop_t* loop) {
+    long quiet = Now() - STREAM_HEARTBEAT;
+    connection_t* connection = loop->streams;
+    while(connection != NULL) {
+        connection_t* next = connection->stream_next;
+        if(connection->stream_sent_at <= quiet) {
+            ContinueStream(loop, connection, 1);
+        }
+        connection = next;
+    }
+}
+
+static void FreeClosedStreams(event_loop_t* loop) {
+    while(loop->closed_streams != NULL) {
+        connection_t* connection = loop->closed_streams;
+        loop->closed_streams = connection->stream_next;
+        connection_destroy(connection);
+    }
+}
+
+static void CloseConnection(event_loop_t* loop, connection_t* connection) {
+    if(connection->state == CONNECTION_STREAMING) {
+        //A stream leaves the list once, however many times it is closed while its poll is being cancelled
+        if(connection->stream_fill != NULL) {
+            if(connection->stream_prev != NULL) {
+                connection->stream_prev->stream_next = connection->stream_next;
+            } else {
+                loop->streams = connection->stream_next;
+            }
+            if(connection->stream_next != NULL) {
+                connection->stream_next->stream_prev = connection->stream_prev;
+            }
+            connection->stream_fill = NULL;
+            atomic_fetch_sub(&loop->stream_count, 1);
+        }
+
+        //epoll may already have returned more events for the stream in the batch being handled
+        if(loop->ring == NULL) {
+            connection->stream_next = loop->closed_streams;
+            loop->closed_streams = connection;
+            return;
+        }
+
+        //With io_uring, the stream's poll must be cancelled and complete before the connection can be freed.  Its
+        //completion closes the connection again
+        if(connection->stream_polling) {
+            if(!connection->cancelled) {
+                connection->cancelled = 1;
+                pthread_mutex_lock(&loop->submit_lock);
+                struct io_uring_sqe* sqe = uring_get_sqe(loop->ring);
+                if(sqe != NULL) {
+                    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                    sqe->addr = (unsigned long)connection | OP_POLL;
+                    sqe->user_data = OP_CANCEL;
+                    uring_submit(loop->ring);
+                }
+                pthread_mutex_unlock(&loop->submit_lock);
+            }
+            return;
+        }
+    }
+
+    //Only connections waiting for a request are in the idle list
+    if(connection->state == CONNECTION_READING) {
+        RemoveFromIdleList(loop, connection);
+    }
+    connection_destroy(connection);
+}
+
+static void CloseIdleConnections(event_loop_t* loop) {
+    if(loop->idle_timeout <= 0) {
+        return;
+    }
+
+    long expired = Now() - loop->idle_timeout;
+
+    //Connections in the idle list are only ever read from by the event loop thread, so they are safe to close here
+    pthread_mutex_lock(&loop->idle_lock);
+    while(loop->idle_head != NULL && loop->idle_head->idle_since <= expired) {
+        connection_t* connection = loop->idle_head;
+        loop->idle_head = connection->idle_next;
+        if(loop->idle_head != NULL) {
+            loop->idle_head->idle_prev = NULL;
+        } else {
+            loop->idle_tail = NULL;
+        }
+        connection_destroy(connection);
+    }
+    pthread_mutex_unlock(&loop->idle_lock);
+}
+
+static void Rearm(event_loop_t* loop, connection_t* connection, int events) {
+    struct epoll_event event;
+    event.events = events | CONNECTION_EVENTS;
+    event.data.ptr = connection;
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) < 0) {
+        perror("epoll_ctl");
+        CloseConnection(loop, connection);
+    }
+}
+
+static void RunUring(event_loop_t* loop) {
+    SubmitAccept(loop);
+    SubmitSweep(loop);
+    SubmitStreamWake(loop);
+
+    while(!atomic_load(&loop->stopping)) {
+        int result = uring_wait(loop->ring);
+        if(result < 0 && result != -EINTR) {
+            fprintf(stderr, "io_uring_enter: %s\n", strerror(-result));
+        }
+
+        struct io_uring_cqe* cqe;
+        while((cqe = uring_peek_cqe(loop->ring)) != NULL) {
+            //Free the slot first, since handling the completion may submit more operations
+            unsigned long userData = cqe->user_data;
+            int res = cqe->res;
+            unsigned int flags = cqe->flags;
+            uring_cqe_seen(loop->ring);
+            HandleCompletion(loop, userData, res, flags);
+        }
+    }
+}
+
+static void HandleCompletion(event_loop_t* loop, unsigned long userData, int result, unsigned int flags) {
+    connection_t* connection = (connection_t*)(userData & ~(unsigned long)OP_MASK);
+    int operation = userData & OP_MASK;
+
+    if(connection != NULL) {
+        if(operation == OP_RECV) {
+            HandleReceived(loop, connection, result, flags);
+        } else if(operation == OP_POLL) {
+            HandleStreamHangup(loop, connection);
+        } else {
+            HandleSent(loop, connection, operation, result);
+        }
+    } else if(operation == OP_ACCEPT) {
+        HandleAccepted(loop, result, flags);
+    } else if(operation == OP_SWEEP) {
+        if(loop->accept_stalled) {
+            loop->accept_stalled = 0;
+            SubmitAccept(loop);
+        }
+        CancelIdleConnections(loop);
+        SweepStreams(loop);
+        SubmitSweep(loop);
+    } else if(operation == OP_WAKE) {
+        HandleStreamWake(loop);
+        SubmitStreamWake(loop);
+    }
+}
+
+static void HandleAccepted(event_loop_t* loop, int result, unsigned int flags) {
+    if(result >= 0) {
+        int flag = 1;
+        setsockopt(result, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+        connection_t* connection = connection_create(result, loop);
+        if(connection == NULL) {
+            close(result);
+        } else {
+            connection->state = CONNECTION_READING;
+            AddToIdleList(loop, connection);
+            SubmitReceive(loop, connection);
+        }
+    } else if(result == -EINVAL && loop->multishot_accept) {
+        //Multishot accept needs Linux 5.19
+        loop->multishot_accept = 0;
+    } else if(result != -ECONNABORTED && result != -EINTR) {
+        //Most likely out of file descriptors.  Retrying straight away would spin, so wait for the next sweep
+        fprintf(stderr, "accept: %s\n", strerror(-result));
+        if(!(flags & IORING_CQE_F_MORE)) {
+            loop->accept_stalled = 1;
+            return;
+        }
+    }
+
+    //A multishot accept keeps going for as long as the completions say there are more to come
+    if(!(flags & IORING_CQE_F_MORE)) {
+        SubmitAccept(loop);
+    }
+}
+
+static void HandleReceived(event_loop_t* loop, connection_t* connection, int result, unsigned int flags) {
+    int status = CONNECTION_ERROR;
+    if(flags & IORING_CQE_F_BUFFER) {
+        //Copy the data out so the buffer can go straight back to the kernel
+        int id = flags >> IORING_CQE_BUFFER_SHIFT;
+        if(result > 0 && !connection->cancelled) {
+            status = connection_receive(connection, uring_buffer(loop->ring, id), result);
+        }
+        uring_recycle_buffer(loop->ring, id);
+    } else if(connection->cancelled) {
+        //Timed out while waiting for a request
+    } else if(result == 0) {
+        status = connection_receive(connection, NULL, 0);
+    } else if(result == -ENOBUFS) {
+        //Every buffer was holding data that had not been copied yet.  They have been given back by now
+        status = CONNECTION_AGAIN;
+    }
+
+    if(status == CONNECTION_DONE) {
+        RemoveFromIdleList(loop, connection);
+        Dispatch(loop, connection);
+    } else if(status == CONNECTION_AGAIN) {
+        SubmitReceive(loop, connection);
+    } else {
+        CloseConnection(loop, connection);
+    }
+}
+
+static void HandleSent(event_loop_t* loop, connection_t* connection, int operation, int result) {
+    if(operation == OP_READ) {
+        if(result > 0) {
+            connection_file_chunk_read(connection, result);
+        } else {
+            //A read of 0 means the file was truncated after the Content-Length was sent
+            connection->op_failed = 1;
+        }
+    } else if(result >= 0) {
+        connection_advance(connection, result);
+    } else if(result != -ECANCELED) {
+        //A body send is cancelled when the head before it falls short.  It is simply sent again
+        connection->op_failed = 1;
+    }
+
+    if(--connection->pending_ops > 0) {
+        return;
+    }
+    if(connection->op_failed) {
+        CloseConnection(loop, connection);
+    } else if(connection->state == CONNECTION_STREAMING) {
+        if(SubmitResponse(loop, connection)) {
+            ContinueStream(loop, connection, 0);
+        }
+    } else if(SubmitResponse(loop, connection) && FinishResponse(loop, connection)) {
+        Dispatch(loop, connection);
+    }
+}
+
+static void SubmitAccept(event_loop_t* loop) {
+    pthread_mutex_lock(&loop->submit_lock);
+    struct io_uring_sqe* sqe = uring_get_sqe(loop->ring);
+    if(sqe != NULL) {
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = loop->listen_fd;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->ioprio = loop->multishot_accept ? IORING_ACCEPT_MULTISHOT : 0;
+        sqe->user_data = OP_ACCEPT;
+        uring_submit(loop->ring);
+    }
+    pthread_mutex_unlock(&loop->submit_lock);
+}
+
+static void SubmitSweep(event_loop_t* loop) {
+    pthread_mutex_lock(&loop->submit_lock);
+    struct io_uring_sqe* sqe = uring_get_sqe(loop->ring);
+    if(sqe != NULL) {
+        sqe->opcode = IORING_OP_TIMEOUT;
+        sqe->addr = (unsigned long)&loop->sweep_interval;
+        sqe->len = 1;
+        sqe->user_data = OP_SWEEP;
+        uring_submit(loop->ring);
+    }
+    pthread_mutex_unlock(&loop->submit_lock);
+}
+
+static void SubmitStreamWake(event_loop_t* loop) {
+    pthread_mutex_lock(&loop->submit_lock);
+    struct io_uring_sqe* sqe = uring_get_sqe(loop->ring);
+    if(sqe != NULL) {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = loop->stream_fd;
+        sqe->addr = (unsigned long)&loop->stream_wake_value;
+        sqe->len = sizeof(loop->stream_wake_value);
+        sqe->user_data = OP_WAKE;
+        uring_submit(loop->ring);
+    }
+    pthread_mutex_unlock(&loop->submit_lock);
+}
+
+static void SubmitStreamPoll(event_loop_t* loop, connection_t* connection) {
+    pthread_mutex_lock(&loop->submit_lock);
+    struct io_uring_sqe* sqe = uring_get_sqe(loop->ring);
+    if(sqe != NULL) {
+        //POLLHUP and POLLERR are always reported as well
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = connection->fd;
+        sqe->poll32_events = POLLRDHUP;
+        sqe->user_data = (unsigned long)connection | OP_POLL;
+        connection->stream_polling = 1;
+        uring_submit(loop->ring);
+    }
+    pthread_mutex_unlock(&loop->submit_lock);
+}
+
+static void HandleStreamHangup(event_loop_t* loop, connection_t* connection) {
+    connection->stream_polling = 0;
+    //A send that is still in flight fails or completes soon, and HandleSent closes the stream then
+    if(connection->pending_ops > 0) {
+        connection->op_failed = 1;
+        return;
+    }
+    CloseConnection(loop, connection);
+}
+
+static void SubmitReceive(event_loop_t* loop, connection_t* connection) {
+    pthread_mutex_lock(&loop->submit_lock);
+    struct io_uring_sqe* sqe = uring_get_sqe(loop->ring);
+    if(sqe != NULL) {
+        //No buffer is given: the kernel picks one of the provided buffers once data arrives
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = connection->fd;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->user_data = (unsigned long)connection | OP_RECV;
+        uring_submit(loop->ring);
+    }
+    pthread_mutex_unlock(&loop->submit_lock);
+
+    if(sqe == NULL) {
+        perror("io_uring_enter");
+        CloseConnection(loop, connection);
+    }
+}
+
+static int SubmitResponse(event_loop_t* loop, connection_t* connection) {
+    int headRemaining = connection->out_length - connection->out_sent;
+    int bodyRemaining = connection->body_length - connection->body_sent;
+    int toRead = 0;
+    if(headRemaining == 0 && bodyRemaining == 0) {
+        if(connection->file_remaining == 0) {
+            return 1;
+        }
+        toRead = connection_reserve_file_chunk(connection);
+        if(toRead < 0) {
+            CloseConnection(loop, connection);
+            return 0;
+        }
+    }
+
+    //The loop thread may handle the completions before this thread returns, so everything about them must be set
+    //before they are submitted
+    connection->op_failed = 0;
+    connection->pending_ops = toRead > 0 ? 1 : (headRemaining > 0) + (bodyRemaining > 0);
+    int fd = connection->fd;
+    unsigned long userData = (unsigned long)connection;
+
+    //The head and body are sent with two linked entries, which must not be split across two submissions, so there
+    //must be room for both before either is claimed
+    int linked = toRead == 0 && headRemaining > 0 && bodyRemaining > 0;
+    pthread_mutex_lock(&loop->submit_lock);
+    if(uring_sq_space(loop->ring) < 1 + linked) {
+        uring_submit(loop->ring);
+    }
+    struct io_uring_sqe* sqe = NULL;
+    struct io_uring_sqe* bodySqe = NULL;
+    if(uring_sq_space(loop->ring) >= 1 + linked) {
+        sqe = uring_get_sqe(loop->ring);
+        if(linked) {
+            bodySqe = uring_get_sqe(loop->ring);
+        }
+    }
+    if(sqe == NULL || (linked && bodySqe == NULL)) {
+        //An entry that was claimed but not filled in is a no-op, and its completion is ignored
+        pthread_mutex_unlock(&loop->submit_lock);
+        perror("io_uring_enter");
+        connection->pending_ops = 0;
+        CloseConnection(loop, connection);
+        return 0;
+    }
+    if(toRead > 0) {
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = connection->file_fd;
+        sqe->addr = (unsigned long)connection->out_buffer;
+        sqe->len = toRead;
+        sqe->off = connection->file_offset;
+        sqe->user_data = userData | OP_READ;
+    } else {
+        //MSG_WAITALL makes the kernel retry a short send itself, so the body only starts once the head is out
+        if(headRemaining > 0) {
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = fd;
+            sqe->addr = (unsigned long)(connection->out_buffer + connection->out_sent);
+            sqe->len = headRemaining;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->user_data = userData | OP_SEND;
+            if(linked) {
+                sqe->flags = IOSQE_IO_LINK;
+                sqe = bodySqe;
+            }
+        }
+        if(bodyRemaining > 0) {
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = fd;
+            sqe->addr = (unsigned long)(connection->body + connection->body_sent);
+            sqe->len = bodyRemaining;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->user_data = userData | OP_SEND;
+        }
+    }
+    uring_submit(loop->ring);
+    pthread_mutex_unlock(&loop->submit_lock);
+    return 0;
+}
+
+static void CancelIdleConnections(event_loop_t* loop) {
+    if(loop->idle_timeout <= 0) {
+        return;
+    }
+
+    long expired = Now() - loop->idle_timeout;
+
+    //The connections stay in the idle list until their receives complete
+    pthread_mutex_lock(&loop->idle_lock);
+    connection_t* connection;
+    for(connection = loop->idle_head; connection != NULL && connection->idle_since <= expired;
+            connection = connection->idle_next) {
+        if(connection->cancelled) {
+            continue;
+        }
+        connection->cancelled = 1;
+
+        pthread_mutex_lock(&loop->submit_lock);
+        struct io_uring_sqe* sqe = uring_get_sqe(loop->ring);
+        if(sqe != NULL) {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (unsigned long)connection | OP_RECV;
+            sqe->user_data = OP_CANCEL;
+            uring_submit(loop->ring);
+        }
+        pthread_mutex_unlock(&loop->submit_lock);
+    }
+    pthread_mutex_unlock(&loop->idle_lock);
+}
+
+static long Now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec;
+}
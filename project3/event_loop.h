@@ -0,0 +1,66 @@
+#ifndef _EVENT_LOOP_H_
+#define _EVENT_LOOP_H_
+
+#include "thread_pool.h"
+#include "connection.h"
+
+/*
+event_loop is an edge-triggered epoll reactor.  The thread running event_loop_run accepts connections and reads
+requests on non-blocking sockets.  Only once a complete request has been buffered is the connection handed to the
+thread pool, so idle or slow clients do not tie up worker threads.  The worker runs the request handler, which
+fills in the response, and then writes as much of it as the socket accepts.  Anything left over is finished by the
+event loop.
+
+The event loop never waits for the thread pool.  When the pool's queue is full, the request is refused on the spot,
+so that the loop keeps accepting and reading while the pool catches up.
+
+Connections are persistent (HTTP/1.1 keep-alive).  Pipelined requests are answered in order by the same worker,
+and a connection that has been waiting for a request for longer than the idle timeout is closed.
+
+event_loop_create_uring builds the same loop on io_uring instead of epoll readiness.  Rather than being told that a
+socket is ready and then calling accept(), read() and writev(), the loop submits the operations themselves and is
+told when they have completed: one multishot accept produces every new connection, each waiting connection has a
+receive in flight that the kernel fills from a shared ring of provided buffers, and workers submit the response head
+and body as two linked sends.  The loop thread reaps all of the completions, so it still owns every connection that
+is not being handled by a worker.
+
+A handler can also answer with a stream that never ends, by setting stream_fill on the connection (see connection.h).
+Once the head has been sent, the stream belongs to the event loop thread.  Whatever produces the stream's content
+calls event_loop_wake_streams when there is more, which wakes the loop through an eventfd, and the loop asks each of
+its streams for its next part and sends it.  A stream that has been quiet for STREAM_HEARTBEAT seconds is asked for
+a heartbeat, so that clients that have gone away are found even if nothing happens.
+*/
+
+typedef struct event_loop_t event_loop_t;
+
+//Creates an event loop that accepts connections on listenfd.  listenfd must already be bound and listening
+//Each complete request is passed to handler (with the connection_t* as its argument) on a thread of threadPool.
+//The handler places the response in the connection and sets keep_alive if the connection should stay open
+//A request that cannot be queued because the thread pool is full, or that waited in the queue for longer than
+//queueDeadline milliseconds (0 for no limit), is passed to overloadHandler instead, which places a short refusal
+//in the connection.  The connection is closed once the refusal is sent
+//Connections that wait longer than idleTimeout seconds for a request are closed
+//Returns NULL if epoll could not be initialized
+event_loop_t* event_loop_create(int listenfd, threadpool_t* threadPool, void (*handler)(void*),
+        void (*overloadHandler)(void*), int idleTimeout, int queueDeadline);
+
+//Creates the same event loop on io_uring.  Falls back to event_loop_create, with a message on stderr, if the kernel
+//does not support io_uring (or the features used here, which need Linux 5.19) or it has been disabled
+event_loop_t* event_loop_create_uring(int listenfd, threadpool_t* threadPool, void (*handler)(void*),
+        void (*overloadHandler)(void*), int idleTimeout, int queueDeadline);
+
+//Runs the event loop on the calling thread until event_loop_stop is called
+void event_loop_run(event_loop_t* loop);
+
+//Makes event_loop_run return once it has handled the events it is working on.  Only sets a flag and writes to an
+//eventfd, so it may be called from any thread and from a signal handler
+void event_loop_stop(event_loop_t* loop);
+
+//Wakes the event loop's streams up, from any thread, so that they send whatever has been added to their sources
+//Cheap if the loop has no streams, or has been woken already and has not got round to it yet
+void event_loop_wake_streams(event_loop_t* loop);
+
+//Frees the event loop.  Connections that are still open are not closed
+void event_loop_destroy(event_loop_t* loop);
+
+#endif
@@ -1,91 +1,330 @@
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <fcntl.h>
 
 #include "file_cache.h"
 
-//The file cache entries and size.  The cache is stored as a fixed size array of FileCache structs
-static FileCache* fileCache = NULL;
-static int currentSize = 0;
+//Each shard of the cache.  The entries form a circular list that the clock hand walks around, and are also
+//chained into hash buckets for lookup
+typedef struct {
+    pthread_rwlock_t lock;
+    FileCache* hand; //Next entry the clock will consider for eviction, NULL if the shard is empty
+    long bytes; //Bytes of file contents currently held by the shard
+    FileCache** buckets;
+    int bucket_count; //Always a power of two
+    int entry_count;
+} CacheShard;
 
-void InitializeFileCache() {
-    //Initializes the array of FileCache structs.
+static CacheShard* shards = NULL;
+static long shardCapacity = 0; //Maximum bytes per shard.  This is also the largest file that can be cached
+static int useMmap = 0; //True if entries are mappings of the files
+
+//Returns the shard that a hash belongs in
+static inline CacheShard* ShardForHash(unsigned int hash);
+
+//Returns the bucket of a shard that a hash belongs in.  The low bits of the hash pick the shard, so the bucket
+//is picked with the bits above them
+static inline FileCache** BucketForHash(CacheShard* shard, unsigned int hash);
+
+//Finds the entry for a path in a shard.  The shard must be locked (for reading or writing)
+static FileCache* FindInShard(CacheShard* shard, const char* path, unsigned int hash);
+
+//Doubles the number of buckets in a write-locked shard
+static void GrowShard(CacheShard* shard);
+
+//Fills in the pre-built response headers and entity tag of a new entry
+static void BuildHeaders(FileCache* entry, const struct stat* fileStat);
+
+//Removes entries from a write-locked shard until it has room for size more bytes
+static void EvictFromShard(CacheShard* shard, long size);
+
+//Removes an entry from a write-locked shard and drops the cache's reference to it
+static void UnlinkFromShard(CacheShard* shard, FileCache* entry);
+
+void InitializeFileCache(long maxBytes, int flags) {
+    //Initializes the empty shards.
     //Does not allocate file buffers (this is done when entries are added to the cache)
-    fileCache = (FileCache*)malloc(sizeof(FileCache) * CACHE_SIZE);
+    shards = (CacheShard*)malloc(sizeof(CacheShard) * CACHE_SHARDS);
+    shardCapacity = maxBytes / CACHE_SHARDS;
+    useMmap = (flags & CACHE_MMAP) != 0;
     int i;
-    for(i = 0; i < CACHE_SIZE; i++) {
-        fileCache[i].path = NULL;
+    for(i = 0; i < CACHE_SHARDS; i++) {
+        pthread_rwlock_init(&shards[i].lock, NULL);
+        shards[i].hand = NULL;
+        shards[i].bytes = 0;
+        shards[i].buckets = (FileCache**)calloc(CACHE_INITIAL_BUCKETS, sizeof(FileCache*));
+        shards[i].bucket_count = CACHE_INITIAL_BUCKETS;
+        shards[i].entry_count = 0;
     }
 }
 
 void DeinitializeFileCache() {
     int i;
-    for(i = 0; i < currentSize; i++) {
-        //If a file cache entry has been added, free the file buffer and the path buffer
-        free(fileCache[i].path);
-        free(fileCache[i].buffer);
+    for(i = 0; i < CACHE_SHARDS; i++) {
+        //Drop the cache's reference to every entry.  Entries that are still being sent are freed by their last user
+        pthread_rwlock_wrlock(&shards[i].lock);
+        while(shards[i].hand != NULL) {
+            UnlinkFromShard(&shards[i], shards[i].hand);
+        }
+        pthread_rwlock_unlock(&shards[i].lock);
+        pthread_rwlock_destroy(&shards[i].lock);
+        free(shards[i].buckets);
     }
-    //Free the fixed array of FileCache
-    free(fileCache);
+    free(shards);
 }
 
-FileCache* AddFileCacheEntry(int fileDescriptor, char* pathToAdd) {
-    FileCache* newEntry = NULL;
-    if(currentSize < CACHE_SIZE) {
-        //Ask the OS to find the size of the file
-        struct stat fileStat;
-        fstat(fileDescriptor, &fileStat);
-        int fileSize = fileStat.st_size;
-
-        //Allocate an appropriately sized buffer
-        char* buffer = (char*)malloc(fileSize);
+FileCache* AddFileCacheEntry(int fileDescriptor, char* pathToAdd, unsigned int hash) {
+    //Ask the OS to find the size of the file
+    struct stat fileStat;
+    if(fstat(fileDescriptor, &fileStat) == -1 || fileStat.st_size > shardCapacity) {
+        return NULL;
+    }
+    int fileSize = fileStat.st_size;
 
-        //Read the file into the newly allocated buffer
+    //Map the file, or read it into a newly allocated buffer, before taking any lock, since this is the slow part
+    //Empty files cannot be mapped, so they always get a (one byte) heap buffer
+    char* buffer;
+    int mapped = useMmap && fileSize > 0;
+    if(mapped) {
+        buffer = (char*)mmap(NULL, fileSize, PROT_READ, MAP_SHARED, fileDescriptor, 0);
+        if(buffer == MAP_FAILED) {
+            return NULL;
+        }
+    } else {
+        buffer = (char*)malloc(fileSize > 0 ? fileSize : 1);
         int numRead = 0;
         while(numRead < fileSize) {
-            numRead += read(fileDescriptor, buffer + numRead, fileSize - numRead);
+            int result = pread(fileDescriptor, buffer + numRead, fileSize - numRead, numRead);
+            if(result <= 0) {
+                free(buffer);
+                return NULL;
+            }
+            numRead += result;
         }
+    }
+
+    FileCache* newEntry = (FileCache*)malloc(sizeof(FileCache));
+    newEntry->path = strdup(pathToAdd);
+    newEntry->buffer = buffer;
+    newEntry->size = fileSize;
+    newEntry->mapped = mapped;
+    newEntry->hash = hash;
+    BuildHeaders(newEntry, &fileStat);
+    atomic_init(&newEntry->references, 2); //One for the cache and one for the caller
+    atomic_init(&newEntry->referenced, 1);
 
-        //Copy the path to the cache as well
-        char* path = (char*)malloc(strlen(pathToAdd) + 1);
-        strcpy(path, pathToAdd);
+    CacheShard* shard = ShardForHash(hash);
+    pthread_rwlock_wrlock(&shard->lock);
 
-        //Update the cache entry
-        fileCache[currentSize].size = fileSize;
-        fileCache[currentSize].buffer = buffer;
-        fileCache[currentSize].path = path;
+    //Another thread may have missed on the same file at the same time and added it first
+    FileCache* existing = FindInShard(shard, pathToAdd, hash);
+    if(existing != NULL) {
+        atomic_fetch_add(&existing->references, 1);
+        pthread_rwlock_unlock(&shard->lock);
+        atomic_init(&newEntry->references, 1);
+        ReleaseCacheEntry(newEntry);
+        return existing;
+    }
 
-        newEntry = &fileCache[currentSize];
+    EvictFromShard(shard, fileSize);
 
-        currentSize++;
+    //Insert the new entry just behind the hand, so it is the last one the clock reaches
+    if(shard->hand == NULL) {
+        newEntry->clock_prev = newEntry;
+        newEntry->clock_next = newEntry;
+        shard->hand = newEntry;
+    } else {
+        newEntry->clock_next = shard->hand;
+        newEntry->clock_prev = shard->hand->clock_prev;
+        shard->hand->clock_prev->clock_next = newEntry;
+        shard->hand->clock_prev = newEntry;
+    }
+    shard->bytes += fileSize;
 
+    //Index it by its path
+    if(shard->entry_count >= shard->bucket_count * 2) {
+        GrowShard(shard);
     }
+    FileCache** bucket = BucketForHash(shard, hash);
+    newEntry->hash_next = *bucket;
+    *bucket = newEntry;
+    shard->entry_count++;
+
+    pthread_rwlock_unlock(&shard->lock);
     return newEntry;
 }
 
-FileCache* GetCacheEntry(char* pathToFind) {
-    //Simple array search, attempts to match the cache key string with the pathToFind string
-    int i;
-    for(i = 0; i < currentSize; i++) {
-        if(strcmp(pathToFind, fileCache[i].path) == 0) {
-            return &fileCache[i];
+FileCache* GetCacheEntry(char* pathToFind, unsigned int hash) {
+    CacheShard* shard = ShardForHash(hash);
+
+    //Lookups only need the read lock, so any number of them can run at once
+    pthread_rwlock_rdlock(&shard->lock);
+    FileCache* entry = FindInShard(shard, pathToFind, hash);
+    if(entry != NULL) {
+        atomic_fetch_add(&entry->references, 1);
+        atomic_store_explicit(&entry->referenced, 1, memory_order_relaxed);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    return entry;
+}
+
+void ReleaseCacheEntry(void* entryArg) {
+    FileCache* entry = (FileCache*)entryArg;
+    if(atomic_fetch_sub(&entry->references, 1) == 1) {
+        if(entry->mapped) {
+            munmap(entry->buffer, entry->size);
+        } else {
+            free(entry->buffer);
         }
+        free(entry->path);
+        free(entry);
     }
-    return NULL;
 }
 
-FileCache* PreloadCache(char* pathToAdd) {
+int PreloadCache(char* pathToAdd) {
     int fileDescriptor;
-    FileCache* newEntry = NULL;
-    //Only preload if there is not currently an entry for pathToAdd, there is room, and pathToAdd is a valid path
-    if(GetCacheEntry(pathToAdd) == NULL && currentSize < CACHE_SIZE && (fileDescriptor = open(pathToAdd, O_RDONLY)) != -1) {
-        newEntry = AddFileCacheEntry(fileDescriptor, pathToAdd);
+    unsigned int hash = FileCacheHash(pathToAdd);
+    FileCache* entry = GetCacheEntry(pathToAdd, hash);
+    //Only preload if there is not currently an entry for pathToAdd and pathToAdd is a valid path
+    if(entry == NULL && (fileDescriptor = open(pathToAdd, O_RDONLY)) != -1) {
+        entry = AddFileCacheEntry(fileDescriptor, pathToAdd, hash);
         close(fileDescriptor);
     }
-    return newEntry;
+    if(entry != NULL) {
+        ReleaseCacheEntry(entry);
+    }
+    return entry != NULL;
+}
+
+unsigned int FileCacheHash(const char* path) {
+    //FNV-1a
+    unsigned int hash = 2166136261u;
+    for(; *path != '\0'; path++) {
+        hash = (hash ^ (unsigned char)*path) * 16777619u;
+    }
+    return hash;
+}
+
+const char* ContentTypeForPath(const char* path) {
+    static const char* types[][2] = {
+        {".html", "text/html"},
+        {".htm", "text/html"},
+        {".css", "text/css"},
+        {".js", "application/javascript"},
+        {".json", "application/json"},
+        {".txt", "text/plain"},
+        {".png", "image/png"},
+        {".jpg", "image/jpeg"},
+        {".jpeg", "image/jpeg"},
+        {".gif", "image/gif"},
+        {".ico", "image/x-icon"},
+        {".svg", "image/svg+xml"},
+    };
+
+    const char* extension = strrchr(path, '.');
+    if(extension != NULL) {
+        int i;
+        for(i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+            if(strcasecmp(extension, types[i][0]) == 0) {
+                return types[i][1];
+            }
+        }
+    }
+    return "application/octet-stream";
+}
+
+static inline CacheShard* ShardForHash(unsigned int hash) {
+    return &shards[hash % CACHE_SHARDS];
+}
+
+static inline FileCache** BucketForHash(CacheShard* shard, unsigned int hash) {
+    return &shard->buckets[(hash / CACHE_SHARDS) & (shard->bucket_count - 1)];
+}
+
+static FileCache* FindInShard(CacheShard* shard, const char* path, unsigned int hash) {
+    FileCache* entry;
+    for(entry = *BucketForHash(shard, hash); entry != NULL; entry = entry->hash_next) {
+        //Only compare the strings when the full hashes match
+        if(entry->hash == hash && strcmp(path, entry->path) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
 
+static void GrowShard(CacheShard* shard) {
+    FileCache** oldBuckets = shard->buckets;
+    int oldCount = shard->bucket_count;
+
+    shard->bucket_count = oldCount * 2;
+    shard->buckets = (FileCache**)calloc(shard->bucket_count, sizeof(FileCache*));
+
+    int i;
+    for(i = 0; i < oldCount; i++) {
+        FileCache* entry = oldBuckets[i];
+        while(entry != NULL) {
+            FileCache* next = entry->hash_next;
+            FileCache** bucket = BucketForHash(shard, entry->hash);
+            entry->hash_next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+    free(oldBuckets);
+}
+
+static void BuildHeaders(FileCache* entry, const struct stat* fileStat) {
+    snprintf(entry->etag, sizeof(entry->etag), "\"%lx-%x\"", (long)fileStat->st_mtime, entry->size);
+
+    int keepAlive;
+    for(keepAlive = 0; keepAlive <= 1; keepAlive++) {
+        entry->header_length[keepAlive] = snprintf(entry->header[keepAlive], CACHE_HEADER_SIZE,
+                "HTTP/1.1 200 OK\r\n"
+                "Content-type: %s\r\n"
+                "Content-Length: %d\r\n"
+                "ETag: %s\r\n"
+                "Connection: %s\r\n\r\n",
+                ContentTypeForPath(entry->path), entry->size, entry->etag, keepAlive ? "keep-alive" : "close");
+    }
+}
+
+static void EvictFromShard(CacheShard* shard, long size) {
+    while(shard->hand != NULL && shard->bytes + size > shardCapacity) {
+        FileCache* candidate = shard->hand;
+        if(atomic_exchange_explicit(&candidate->referenced, 0, memory_order_relaxed)) {
+            //Used since the hand last passed, so give it a second chance
+            shard->hand = candidate->clock_next;
+        } else {
+            UnlinkFromShard(shard, candidate);
+        }
+    }
+}
+
+static void UnlinkFromShard(CacheShard* shard, FileCache* entry) {
+    //Remove it from its hash bucket
+    FileCache** link = BucketForHash(shard, entry->hash);
+    while(*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+    shard->entry_count--;
+
+    //Remove it from the clock
+    if(entry->clock_next == entry) {
+        shard->hand = NULL;
+    } else {
+        entry->clock_prev->clock_next = entry->clock_next;
+        entry->clock_next->clock_prev = entry->clock_prev;
+        if(shard->hand == entry) {
+            shard->hand = entry->clock_next;
+        }
+    }
+    shard->bytes -= entry->size;
+    ReleaseCacheEntry(entry);
 }
@@ -1,9 +1,43 @@
-#define CACHE_SIZE 3
+#include <pthread.h>
+#include <stdatomic.h>
+
+#ifndef _FILE_CACHE_H_
+#define _FILE_CACHE_H_
+
+//Number of independently locked shards.  A path always lives in the same shard, chosen by a hash of the path
+#define CACHE_SHARDS 16
+
+//Flags for InitializeFileCache
+#define CACHE_MMAP 1 //Map cached files read-only instead of copying them onto the heap
+
+//Room for the pre-built response header stored in each entry
+#define CACHE_HEADER_SIZE 256
+
+//Initial number of hash buckets per shard.  A shard doubles its buckets when it holds twice as many entries
+#define CACHE_INITIAL_BUCKETS 64
 
 /*
-file_cache maintains a cache in memory of the contents of files.  You can adjust the maximum number of files
-in the cache with CACHE_SIZE.  Entries can only be added to, not removed from the cache.
-NOT THREADSAFE!!! (TAs: This is ok because we only write to the cache using the main thread during initialization, prior to the thread pool)
+file_cache maintains a cache in memory of the contents of files.  The cache is bounded by the total number of bytes
+it holds rather than by a number of entries.  Worker threads add files to the cache the first time they are
+requested, and when a shard is full the least recently used entries are evicted with the CLOCK algorithm.
+
+The cache is THREADSAFE.  It is split into CACHE_SHARDS shards, each protected by its own readers-writer lock, so
+lookups in different shards never contend and lookups in the same shard proceed in parallel.  A lookup only marks
+the entry as referenced; it does not reorder anything, so it never needs the write lock.
+
+Within a shard, entries are indexed by a chained hash table keyed on the path.  The hash is computed once per
+request with FileCacheHash and passed to every cache call, so a lookup is O(1) and does not allocate.
+
+Each entry also holds the complete HTTP response header for the file (status line, Content-Type, Content-Length and
+ETag), built once when the entry is added, so that a cache hit is sent without formatting anything.
+
+With CACHE_MMAP, entries are read-only mappings of the files instead of heap copies.  The bytes then live only in
+the kernel's page cache, which the mapping shares, so adding an entry costs no read() and the cache does not hold a
+second copy of every file.  A mapped file must not be truncated while it is cached.
+
+Entries are reference counted.  GetCacheEntry and AddFileCacheEntry return an entry with a reference held for the
+caller, who must give it back with ReleaseCacheEntry once it is done with the buffer.  An entry that is evicted
+while it is still being sent is freed when the last reference is released.
 */
 
 //Structure holding each file cache entry.  Each entry is represented by a file path (key) - file buffer (value) pair
@@ -11,25 +45,53 @@ typedef struct FileCache_ {
     char* path;
     char* buffer;
     int size;
+    int mapped; //True if buffer is a mapping of the file rather than a heap copy
+
+    unsigned int hash; //FileCacheHash of path
+
+    //Pre-built "200 OK" response headers, indexed by whether the connection is kept alive
+    char header[2][CACHE_HEADER_SIZE];
+    int header_length[2];
+    char etag[32]; //Quoted entity tag built from the file's modification time and size
+
+    atomic_int references; //One for the cache while the entry is in it, plus one per caller using the buffer
+    atomic_int referenced; //CLOCK bit, set on every lookup and cleared as the clock hand passes
+    struct FileCache_* clock_prev; //Circular list of the entries in the shard, in the order the clock visits them
+    struct FileCache_* clock_next;
+    struct FileCache_* hash_next; //Next entry in the same hash bucket
 } FileCache;
 
 //Allocates space for the file cache
-//Initializes an empty cache
-void InitializeFileCache();
+//Initializes an empty cache that will hold at most maxBytes bytes of file contents
+//flags is 0 or CACHE_MMAP
+void InitializeFileCache(long maxBytes, int flags);
 
 //Deallocates the memory from the file cache
 void DeinitializeFileCache();
 
+//Returns the hash of a path, to be passed to GetCacheEntry and AddFileCacheEntry
+unsigned int FileCacheHash(const char* path);
+
+//Returns the Content-Type to send for a file, based on its extension
+const char* ContentTypeForPath(const char* path);
+
 //Adds an entry to the file cache given an open file descriptor and the file path that the entry will use as the key
-//Memory is allocated and the file contents are copied to memory
-//If the entry was successfully added, the new entry, which contains the copied file contents, is returned
-//If the entry was not successfully added (if there was no room), returns NULL
-FileCache* AddFileCacheEntry(int fileDescriptor, char* pathToAdd);
+//Memory is allocated and the file contents are copied to memory (or mapped, with CACHE_MMAP), evicting other entries if the shard is full
+//If another thread added the same path first, its entry is returned instead
+//Returns the entry with a reference held for the caller, or NULL if the file is too large to be cached
+FileCache* AddFileCacheEntry(int fileDescriptor, char* pathToAdd, unsigned int hash);
 
-//Returns the file cache entry with pathToFind as the key.
-//Returns NULL if there is no entry with that path as key.
-FileCache* GetCacheEntry(char* pathToFind);
+//Returns the file cache entry with pathToFind as the key, with a reference held for the caller.
+//hash must be FileCacheHash(pathToFind).  Returns NULL if there is no entry with that path as key.
+FileCache* GetCacheEntry(char* pathToFind, unsigned int hash);
+
+//Gives back a reference returned by GetCacheEntry or AddFileCacheEntry
+//Takes a void* so that it can be used as a connection body release callback
+void ReleaseCacheEntry(void* entry);
 
 //Given the file path, opens a file, adds an entry to the cache, and closes the file
 //Intended to be used to preload the cache at initialization
-FileCache* PreloadCache(char* pathToAdd);
+//Returns true if the file is in the cache
+int PreloadCache(char* pathToAdd);
+
+#endif
@@ -0,0 +1,376 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include "http_parser.h"
+
+//Parser states, in the order a request is read
+#define STATE_METHOD 0      //Reading the method at the start of the request line
+#define STATE_TARGET 1      //Reading the request target (path and query string)
+#define STATE_VERSION 2     //Reading the protocol version at the end of the request line
+#define STATE_HEADER 3      //Reading header lines until the blank line
+#define STATE_BODY 4        //Waiting for Content-Length bytes of body
+#define STATE_COMPLETE 5
+
+//Records the request target that runs from start to end, splitting it into path, query and arguments
+static void RecordTarget(http_request_t* request, const char* buffer, int start, int end);
+
+//Records a header line that runs from start to end (without the line terminator)
+//Returns false if the line is malformed
+static int RecordHeader(http_request_t* request, const char* buffer, int start, int end);
+
+//Called once the headers are complete to work out whether the connection is persistent
+static void FinishHeaders(http_request_t* request, const char* buffer);
+
+//Returns true if the slice contains the given lower case token, ignoring case
+static int SliceContainsToken(const char* buffer, http_slice_t slice, const char* token);
+
+//Finds the named query argument.  Returns NULL if the request does not have it
+static const http_pair_t* FindArg(const http_request_t* request, const char* name);
+
+//Same as atoi, but for a value that is not NUL terminated.  Parses from *position up to end, and leaves *position on
+//the first character that is not part of the integer
+static int ParseInt(const char* value, int* position, int end);
+
+//Returns the end of a line that stops just before end, minus any trailing carriage return
+static inline int TrimCarriageReturn(const char* buffer, int start, int end);
+
+//Does the work of http_parse, without recording the buffer
+static int Parse(http_request_t* request, const char* buffer, int length);
+
+void http_request_init(http_request_t* request) {
+    memset(request, 0, sizeof(http_request_t));
+    request->state = STATE_METHOD;
+}
+
+int http_parse(http_request_t* request, const char* buffer, int length) {
+    //A malformed request is still answered, and the slices it has so far are read from this buffer
+    int result = Parse(request, buffer, length);
+    if(result != HTTP_PARSE_AGAIN) {
+        request->buffer = buffer;
+    }
+    return result;
+}
+
+static int Parse(http_request_t* request, const char* buffer, int length) {
+    while(request->state != STATE_BODY) {
+        if(request->position >= length) {
+            return HTTP_PARSE_AGAIN;
+        }
+
+        if(request->state == STATE_METHOD) {
+            char c = buffer[request->position];
+            if(c == ' ') {
+                if(request->position == request->mark) {
+                    return HTTP_PARSE_ERROR;
+                }
+                request->method.offset = request->mark;
+                request->method.length = request->position - request->mark;
+                request->position++;
+                request->mark = request->position;
+                request->state = STATE_TARGET;
+            } else if(c == '\r' || c == '\n') {
+                //Blank lines before the request line are allowed and skipped
+                if(request->position != request->mark) {
+                    return HTTP_PARSE_ERROR;
+                }
+                request->position++;
+                request->mark = request->position;
+            } else if(!isalpha(c)) {
+                return HTTP_PARSE_ERROR;
+            } else {
+                request->position++;
+            }
+        } else if(request->state == STATE_TARGET) {
+            //The target ends at the space before the version, or at the end of the line for HTTP/0.9 style requests
+            int i = request->position;
+            while(i < length && buffer[i] != ' ' && buffer[i] != '\n') {
+                i++;
+            }
+            request->position = i;
+            if(i == length) {
+                return HTTP_PARSE_AGAIN;
+            }
+
+            if(buffer[i] == ' ') {
+                RecordTarget(request, buffer, request->mark, i);
+                request->state = STATE_VERSION;
+            } else {
+                RecordTarget(request, buffer, request->mark, TrimCarriageReturn(buffer, request->mark, i));
+                request->version.offset = i;
+                request->version.length = 0;
+                request->state = STATE_HEADER;
+            }
+            request->position = i + 1;
+            request->mark = request->position;
+        } else {
+            //The version and the headers are both read a line at a time
+            const char* newline = memchr(buffer + request->position, '\n', length - request->position);
+            if(newline == NULL) {
+                request->position = length;
+                return HTTP_PARSE_AGAIN;
+            }
+            int end = newline - buffer;
+            int lineEnd = TrimCarriageReturn(buffer, request->mark, end);
+
+            if(request->state == STATE_VERSION) {
+                request->version.offset = request->mark;
+                request->version.length = lineEnd - request->mark;
+                request->state = STATE_HEADER;
+            } else if(lineEnd == request->mark) {
+                //A blank line ends the headers
+                request->header_length = end + 1;
+                FinishHeaders(request, buffer);
+                if(request->content_length < 0) {
+                    return HTTP_PARSE_ERROR;
+                }
+                request->state = STATE_BODY;
+            } else if(!RecordHeader(request, buffer, request->mark, lineEnd)) {
+                return HTTP_PARSE_ERROR;
+            }
+            request->position = end + 1;
+            request->mark = request->position;
+        }
+    }
+
+    //The body is not parsed, only waited for so that the next pipelined request starts in the right place
+    if(length < request->header_length + request->content_length) {
+        return HTTP_PARSE_AGAIN;
+    }
+    request->length = request->header_length + request->content_length;
+    request->state = STATE_COMPLETE;
+    return HTTP_PARSE_DONE;
+}
+
+int http_parse_finish(http_request_t* request, const char* buffer, int length) {
+    if(request->state == STATE_TARGET && length > request->mark) {
+        RecordTarget(request, buffer, request->mark, TrimCarriageReturn(buffer, request->mark, length));
+        request->version.offset = length;
+        request->version.length = 0;
+    } else if(request->state == STATE_VERSION) {
+        request->version.offset = request->mark;
+        request->version.length = TrimCarriageReturn(buffer, request->mark, length) - request->mark;
+    } else if(request->state != STATE_HEADER) {
+        request->buffer = buffer;
+        return HTTP_PARSE_ERROR;
+    }
+
+    //The client cannot send another request, so whatever headers arrived are all there are
+    request->header_length = length;
+    request->content_length = 0;
+    request->length = length;
+    request->keep_alive = 0;
+    request->buffer = buffer;
+    request->state = STATE_COMPLETE;
+    return HTTP_PARSE_DONE;
+}
+
+const char* http_slice_data(const http_request_t* request, http_slice_t slice) {
+    return request->buffer + slice.offset;
+}
+
+int http_slice_equals(const http_request_t* request, http_slice_t slice, const char* string) {
+    return slice.length == strlen(string) && memcmp(request->buffer + slice.offset, string, slice.length) == 0;
+}
+
+int http_slice_copy(const http_request_t* request, http_slice_t slice, char* buf, int size) {
+    int length = slice.length < size - 1 ? slice.length : size - 1;
+    memcpy(buf, request->buffer + slice.offset, length);
+    buf[length] = '\0';
+    return length;
+}
+
+const http_slice_t* http_request_header(const http_request_t* request, const char* name) {
+    int nameLength = strlen(name);
+    int i;
+    for(i = 0; i < request->header_count; i++) {
+        const http_pair_t* header = &request->headers[i];
+        if(header->name.length == nameLength &&
+                strncasecmp(request->buffer + header->name.offset, name, nameLength) == 0) {
+            return &header->value;
+        }
+    }
+    return NULL;
+}
+
+int http_request_arg_int(const http_request_t* request, const char* name, int defaultValue) {
+    const http_pair_t* arg = FindArg(request, name);
+    if(arg == NULL) {
+        return defaultValue;
+    }
+    int position = 0;
+    return ParseInt(request->buffer + arg->value.offset, &position, arg->value.length);
+}
+
+int http_request_arg_int_list(const http_request_t* request, const char* name, int* values, int maxValues) {
+    const http_pair_t* arg = FindArg(request, name);
+    if(arg == NULL || arg->value.length == 0) {
+        return 0;
+    }
+
+    //Each item runs up to the next comma.  Anything else after the digits of an item is ignored, as atoi would
+    const char* value = request->buffer + arg->value.offset;
+    int position = 0;
+    int count = 0;
+    while(1) {
+        int item = ParseInt(value, &position, arg->value.length);
+        if(count < maxValues) {
+            values[count] = item;
+        }
+        count++;
+        while(position < arg->value.length && value[position] != ',') {
+            position++;
+        }
+        if(position == arg->value.length) {
+            return count;
+        }
+        position++;
+    }
+}
+
+static const http_pair_t* FindArg(const http_request_t* request, const char* name) {
+    int i;
+    for(i = 0; i < request->arg_count; i++) {
+        if(http_slice_equals(request, request->args[i].name, name)) {
+            return &request->args[i];
+        }
+    }
+    return NULL;
+}
+
+static int ParseInt(const char* value, int* position, int end) {
+    int negative = 0;
+    int result = 0;
+    if(*position < end && value[*position] == '-') {
+        negative = 1;
+        (*position)++;
+    }
+    for(; *position < end && isdigit(value[*position]); (*position)++) {
+        result = result * 10 + (value[*position] - '0');
+    }
+    return negative ? -result : result;
+}
+
+static void RecordTarget(http_request_t* request, const char* buffer, int start, int end) {
+    //Resources are relative to the server's directory, so drop the leading slash
+    if(start < end && buffer[start] == '/') {
+        start++;
+    }
+
+    const char* question = memchr(buffer + start, '?', end - start);
+    int pathEnd = question != NULL ? question - buffer : end;
+    request->path.offset = start;
+    request->path.length = pathEnd - start;
+
+    request->query.offset = pathEnd;
+    request->query.length = 0;
+    if(question == NULL) {
+        return;
+    }
+    request->query.offset = pathEnd + 1;
+    request->query.length = end - pathEnd - 1;
+
+    //Arguments are name=value pairs separated by '&'.  '?' is accepted as a separator too, since some clients
+    //send "view_seat?user=1?seat=2"
+    int i = pathEnd + 1;
+    while(i < end && request->arg_count < HTTP_MAX_ARGS) {
+        int argStart = i;
+        int equals = -1;
+        while(i < end && buffer[i] != '&' && buffer[i] != '?') {
+            if(buffer[i] == '=' && equals == -1) {
+                equals = i;
+            }
+            i++;
+        }
+        if(i > argStart) {
+            http_pair_t* arg = &request->args[request->arg_count++];
+            arg->name.offset = argStart;
+            arg->name.length = (equals != -1 ? equals : i) - argStart;
+            arg->value.offset = equals != -1 ? equals + 1 : i;
+            arg->value.length = i - arg->value.offset;
+        }
+        i++;
+    }
+}
+
+static int RecordHeader(http_request_t* request, const char* buffer, int start, int end) {
+    const char* colon = memchr(buffer + start, ':', end - start);
+    if(colon == NULL || colon == buffer + start) {
+        return 0;
+    }
+
+    if(request->header_count == HTTP_MAX_HEADERS) {
+        return 1;
+    }
+
+    //Strip the whitespace around the value
+    int valueStart = colon - buffer + 1;
+    while(valueStart < end && (buffer[valueStart] == ' ' || buffer[valueStart] == '\t')) {
+        valueStart++;
+    }
+    int valueEnd = end;
+    while(valueEnd > valueStart && (buffer[valueEnd - 1] == ' ' || buffer[valueEnd - 1] == '\t')) {
+        valueEnd--;
+    }
+
+    http_pair_t* header = &request->headers[request->header_count++];
+    header->name.offset = start;
+    header->name.length = colon - buffer - start;
+    header->value.offset = valueStart;
+    header->value.length = valueEnd - valueStart;
+    return 1;
+}
+
+static void FinishHeaders(http_request_t* request, const char* buffer) {
+    //http_request_header needs the buffer, and the request is not complete yet, so look through the headers here
+    request->keep_alive = request->version.length == 8 &&
+            memcmp(buffer + request->version.offset, "HTTP/1.1", 8) == 0;
+    request->content_length = 0;
+
+    int i;
+    for(i = 0; i < request->header_count; i++) {
+        http_pair_t* header = &request->headers[i];
+        const char* name = buffer + header->name.offset;
+        if(header->name.length == 10 && strncasecmp(name, "Connection", 10) == 0) {
+            //HTTP/1.1 connections are persistent by default, HTTP/1.0 connections only if the client asks
+            if(SliceContainsToken(buffer, header->value, "close")) {
+                request->keep_alive = 0;
+            } else if(SliceContainsToken(buffer, header->value, "keep-alive")) {
+                request->keep_alive = 1;
+            }
+        } else if(header->name.length == 14 && strncasecmp(name, "Content-Length", 14) == 0) {
+            const char* value = buffer + header->value.offset;
+            int j;
+            if(header->value.length == 0 || header->value.length > 9) {
+                request->content_length = -1;
+                return;
+            }
+            for(j = 0; j < header->value.length; j++) {
+                if(!isdigit(value[j])) {
+                    request->content_length = -1;
+                    return;
+                }
+                request->content_length = request->content_length * 10 + (value[j] - '0');
+            }
+        }
+    }
+}
+
+static int SliceContainsToken(const char* buffer, http_slice_t slice, const char* token) {
+    int tokenLength = strlen(token);
+    int i;
+    for(i = 0; i + tokenLength <= slice.length; i++) {
+        if(strncasecmp(buffer + slice.offset + i, token, tokenLength) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline int TrimCarriageReturn(const char* buffer, int start, int end) {
+    if(end > start && buffer[end - 1] == '\r') {
+        return end - 1;
+    }
+    return end;
+}
@@ -0,0 +1,91 @@
+#ifndef _HTTP_PARSER_H_
+#define _HTTP_PARSER_H_
+
+/*
+http_parser is an incremental HTTP/1.x request parser.  It works directly on the connection's request buffer and
+can be called again each time more bytes arrive; it resumes where it stopped instead of rescanning.  Nothing is
+copied: the method, path, query arguments and headers are recorded as slices (offset and length) of the buffer.
+Slices are offsets rather than pointers because the buffer may be moved by realloc while a request is still
+arriving.  Use http_slice_data once the request is complete to get at the bytes.
+*/
+
+//Limits on the number of query arguments and headers recorded per request.  Extra ones are ignored
+#define HTTP_MAX_ARGS 16
+#define HTTP_MAX_HEADERS 32
+
+//Result codes for http_parse
+#define HTTP_PARSE_DONE 1       //A complete request (including any body) is in the buffer
+#define HTTP_PARSE_AGAIN 0      //More bytes are needed
+#define HTTP_PARSE_ERROR -1     //The request is malformed
+
+//A run of bytes in the request buffer
+typedef struct http_slice_t {
+    int offset;
+    int length;
+} http_slice_t;
+
+//A name/value pair, used for both query arguments and headers
+typedef struct http_pair_t {
+    http_slice_t name;
+    http_slice_t value;
+} http_pair_t;
+
+typedef struct http_request_t {
+    //Parser state.  position is the offset of the next byte to look at, mark the start of the current token
+    int state;
+    int position;
+    int mark;
+
+    //Request line.  path does not include the leading '/' or the query string
+    http_slice_t method;
+    http_slice_t path;
+    http_slice_t query;
+    http_slice_t version;
+
+    http_pair_t args[HTTP_MAX_ARGS];
+    int arg_count;
+
+    http_pair_t headers[HTTP_MAX_HEADERS];
+    int header_count;
+
+    int header_length; //Length of the request line and headers, including the blank line
+    int content_length; //Length of the body that follows the headers
+    int length; //Total length of the request once it is complete
+    int keep_alive; //True if the client expects the connection to stay open after the response
+
+    const char* buffer; //The buffer the request was parsed from, valid once the request is complete or malformed
+} http_request_t;
+
+//Resets a request so that a new one can be parsed
+void http_request_init(http_request_t* request);
+
+//Parses the bytes of buffer that have not been looked at yet.  length is the total number of bytes in buffer
+//Returns HTTP_PARSE_DONE, HTTP_PARSE_AGAIN or HTTP_PARSE_ERROR
+int http_parse(http_request_t* request, const char* buffer, int length);
+
+//Called when the client closes its side of the connection before the blank line ending the headers
+//A request whose request line is complete is accepted as is (this is how HTTP/0.9 style clients send requests)
+//Returns HTTP_PARSE_DONE or HTTP_PARSE_ERROR
+int http_parse_finish(http_request_t* request, const char* buffer, int length);
+
+//Returns a pointer to the first byte of a slice of a complete request.  The bytes are not NUL terminated
+const char* http_slice_data(const http_request_t* request, http_slice_t slice);
+
+//Returns true if the slice is exactly equal to the given string
+int http_slice_equals(const http_request_t* request, http_slice_t slice, const char* string);
+
+//Copies a slice into buf as a NUL terminated string, truncating it to fit in size bytes
+//Returns the number of bytes copied
+int http_slice_copy(const http_request_t* request, http_slice_t slice, char* buf, int size);
+
+//Returns the value of the header with the given (case insensitive) name, or NULL if the request does not have it
+const http_slice_t* http_request_header(const http_request_t* request, const char* name);
+
+//Returns the value of the named query argument as an integer, or defaultValue if it is missing
+int http_request_arg_int(const http_request_t* request, const char* name, int defaultValue);
+
+//Reads the named query argument as a comma separated list of integers, such as seats=4,5,6, into values
+//Returns how many integers the list holds, which may be more than the maxValues stored, or 0 if it is missing
+int http_request_arg_int_list(const http_request_t* request, const char* name, int* values, int maxValues);
+
+#endif
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <sched.h>
 #include <signal.h>
 #include <ctype.h>
 #include <fcntl.h>
@@ -10,40 +11,134 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <stdatomic.h>
 
 #include "thread_pool.h"
 #include "seats.h"
 #include "util.h"
 #include "pthread.h"
 #include "file_cache.h"
+#include "event_loop.h"
+#include "seat_events.h"
+#include "metrics.h"
 
 #define BUFSIZE 1024
 #define FILENAMESIZE 100
 
+//Total bytes of file contents the file cache may hold
+#define FILE_CACHE_BYTES (64 * 1024 * 1024)
+
 #define NUM_THREADS 2
 #define QUEUE_SIZE 4000
 
+//The default pool starts with NUM_THREADS threads and adds more, up to MAX_THREADS, when they fall behind
+//Threads above NUM_THREADS exit after THREAD_IDLE_TIMEOUT milliseconds without work
+#define MAX_THREADS 32
+#define THREAD_IDLE_TIMEOUT 30000
+
+//Milliseconds a request may wait for a worker thread.  Requests that wait longer get a 503 instead of being handled
+#define QUEUE_DEADLINE 2000
+
+//Seconds a keep-alive connection may wait for its next request before it is closed
+#define IDLE_TIMEOUT 10
+
+//Connections are accepted as fast as the event loop can drain them, so allow a deep kernel backlog
+#define LISTEN_BACKLOG 1024
+
+//Most listening sockets that -s can open
+#define MAX_SHARDS 64
+
+// Seconds a seat stays held by view_seat before it is released, unless it is confirmed or cancelled first
+#define HOLD_TIMEOUT 300
+
+//Seat transitions the seat_events feed keeps, for subscribers that fall behind or reconnect
+#define SEAT_EVENTS 65536
+
+//Each listening socket has its own event loop and thread pool.  With -s, the kernel spreads connections across
+//the sockets (SO_REUSEPORT), and each shard runs on its own thread, pinned with its workers to a set of CPUs
+typedef struct {
+    int listenfd;
+    threadpool_t* threadpool;
+    _Atomic(event_loop_t*) event_loop; //Read by the SIGINT handler, which may run before the loop exists
+    pthread_t thread;
+    cpu_set_t cpus;
+} shard_t;
+
 void shutdown_server(int);
+void destroy_server();
+int open_listen_socket(int port, int reuse_port);
+threadpool_t* create_threadpool();
+void* run_shard(void* shard);
 
-int listenfd;
-threadpool_t* threadpool;
+shard_t shards[MAX_SHARDS];
+int num_shards = 1;
+int sharded = 0; //True if the shards run on their own threads
+int work_stealing = 0, lock_free = 0;
+int use_uring = 0;
+atomic_int stop_requested = 0; //Set by the SIGINT handler; a shard that starts afterwards stops at once
 
-int main(int argc,char *argv[])
+void usage(char* program)
 {
+    fprintf(stderr, "usage: %s [-m] [-w | -l] [-u] [-s shards] [-t hold_timeout] [-d log_dir] [num_seats]\n"\
+                    "  -m  map cached files with mmap instead of copying them to the heap\n"\
+                    "  -w  schedule requests on a work stealing thread pool\n"\
+                    "  -l  schedule requests on a thread pool with a lock-free queue\n"\
+                    "  -u  do socket I/O through io_uring instead of epoll (falls back to epoll if unavailable)\n"\
+                    "  -s  accept on this many SO_REUSEPORT sockets, each with its own event loop and\n"\
+                    "      thread pool, pinned to its share of the CPUs\n"\
+                    "  -t  seconds before an unconfirmed seat hold is released (0 for never)\n"\
+                    "  -d  keep seat state across restarts in a log and snapshot in this directory\n", program);
+    exit(-1);
+}
 
-    int flag, num_seats = 20;
-    int connfd = 0;
-    struct sockaddr_in serv_addr;
-
-    char send_buffer[BUFSIZE];
+int main(int argc,char *argv[])
+{
 
-    listenfd = 0;
+    int num_seats = 20;
+    int hold_timeout = HOLD_TIMEOUT;
+    char* log_directory = NULL;
+    int option, cache_flags = 0;
 
     int server_port = 8080;
 
-    if (argc > 1)
+    while ((option = getopt(argc, argv, "mwlus:t:d:")) != -1)
     {
-        num_seats = atoi(argv[1]);
+        switch (option)
+        {
+            case 'm':
+                cache_flags |= CACHE_MMAP;
+                break;
+            case 'w':
+                work_stealing = 1;
+                break;
+            case 'l':
+                lock_free = 1;
+                break;
+            case 'u':
+                use_uring = 1;
+                break;
+            case 's':
+                num_shards = atoi(optarg);
+                sharded = 1;
+                if (num_shards < 1 || num_shards > MAX_SHARDS)
+                    usage(argv[0]);
+                break;
+            case 't':
+                hold_timeout = atoi(optarg);
+                if (hold_timeout < 0)
+                    usage(argv[0]);
+                break;
+            case 'd':
+                log_directory = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    if (optind < argc)
+    {
+        num_seats = atoi(argv[optind]);
     }
 
     if (server_port < 1500)
@@ -55,31 +150,110 @@ int main(int argc,char *argv[])
     if (signal(SIGINT, shutdown_server) == SIG_ERR)
         printf("Issue registering SIGINT handler");
 
-    listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    if ( listenfd < 0 ){
-        perror("Socket");
-        exit(errno);
-    }
-    printf("Established Socket: %d\n", listenfd);
-    flag = 1;
-    setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag) );
+    //A client that disconnects mid-response must not kill the server
+    signal(SIGPIPE, SIG_IGN);
 
     //Preload the static files to the file cache
-    InitializeFileCache();
+    InitializeFileCache(FILE_CACHE_BYTES, cache_flags);
     PreloadCache("reserveSeat.html");
     PreloadCache("selectSeats.html");
     PreloadCache("aquajet_full.png");
 
-    //Initialize the thread pool
-    threadpool = threadpool_create(NUM_THREADS, QUEUE_SIZE);
+    seat_events_init(SEAT_EVENTS);
+    load_seats(num_seats, hold_timeout, log_directory);
+
+    // open every listening socket before any of them accepts, so that the kernel spreads connections over all
+    int i;
+    for (i = 0; i < num_shards; i++)
+    {
+        shards[i].listenfd = open_listen_socket(server_port, sharded);
+        shards[i].threadpool = NULL;
+        atomic_init(&shards[i].event_loop, NULL);
+    }
+
+    if (!sharded)
+    {
+        // accept connections and read requests on this thread; complete requests go to the thread pool
+        run_shard(&shards[0]);
+        destroy_server();
+        return 0;
+    }
+
+    // deal the CPUs this process may run on out to the shards; with more shards than CPUs, shards share
+    cpu_set_t allowed;
+    int cpu_list[CPU_SETSIZE], num_cpus = 0;
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    for (i = 0; i < CPU_SETSIZE; i++)
+    {
+        if (CPU_ISSET(i, &allowed))
+            cpu_list[num_cpus++] = i;
+    }
+    for (i = 0; i < num_shards; i++)
+    {
+        CPU_ZERO(&shards[i].cpus);
+        if (num_shards >= num_cpus)
+        {
+            CPU_SET(cpu_list[i % num_cpus], &shards[i].cpus);
+        }
+        else
+        {
+            int j;
+            for (j = i; j < num_cpus; j += num_shards)
+                CPU_SET(cpu_list[j], &shards[i].cpus);
+        }
+    }
+
+    // SIGINT must reach this thread, which waits for the shards to stop before tearing anything down.  It stays
+    // blocked outside of sigsuspend, so that it cannot arrive between the check of stop_requested and the wait
+    sigset_t interrupt, waitMask;
+    sigemptyset(&interrupt);
+    sigaddset(&interrupt, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &interrupt, &waitMask);
+    sigdelset(&waitMask, SIGINT);
+    for (i = 0; i < num_shards; i++)
+    {
+        if (pthread_create(&shards[i].thread, NULL, &run_shard, &shards[i]) != 0)
+        {
+            perror("pthread_create");
+            exit(-1);
+        }
+    }
+
+    // the shards run until SIGINT
+    while (!atomic_load(&stop_requested))
+        sigsuspend(&waitMask);
+    for (i = 0; i < num_shards; i++)
+        pthread_join(shards[i].thread, NULL);
+
+    destroy_server();
+    return 0;
+}
+
+//Opens a listening TCP socket on port.  With reuse_port, any number of sockets can listen on the same port and the
+//kernel balances new connections between them
+int open_listen_socket(int port, int reuse_port)
+{
+    int flag = 1;
+    struct sockaddr_in serv_addr;
+
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if ( listenfd < 0 ){
+        perror("Socket");
+        exit(errno);
+    }
+    printf("Established Socket: %d\n", listenfd);
+    setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag) );
+    if (reuse_port && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) != 0)
+    {
+        perror("SO_REUSEPORT");
+        exit(errno);
+    }
 
-    load_seats(num_seats); //TODO read from argv
     // set server address
-    memset(&serv_addr, '0', sizeof(serv_addr));
-    memset(send_buffer, '0', sizeof(send_buffer));
+    memset(&serv_addr, 0, sizeof(serv_addr));
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    serv_addr.sin_port = htons(server_port);
+    serv_addr.sin_port = htons(port);
 
     // bind to socket
     if ( bind(listenfd, (struct sockaddr*) &serv_addr, sizeof(serv_addr)) != 0)
@@ -89,20 +263,91 @@ int main(int argc,char *argv[])
     }
 
     // listen for incoming requests
-    listen(listenfd, 10);
+    listen(listenfd, LISTEN_BACKLOG);
+    return listenfd;
+}
 
-    // handle connections loop (forever)
-    while(1)
+//Creates a thread pool of the kind chosen on the command line
+threadpool_t* create_threadpool()
+{
+    if (work_stealing)
+        return threadpool_create_stealing(NUM_THREADS, QUEUE_SIZE);
+    else if (lock_free)
+        return threadpool_create_lockfree(NUM_THREADS, QUEUE_SIZE);
+    else
+        return threadpool_create_elastic(NUM_THREADS, MAX_THREADS, QUEUE_SIZE, THREAD_IDLE_TIMEOUT);
+}
+
+//Creates a shard's thread pool and event loop and runs the event loop until shutdown_server stops it
+//A sharded thread pins itself first: threads inherit the CPU set of the thread that creates them, so the workers
+//(including any that an elastic pool adds later) stay on the same CPUs as the shard's event loop
+void* run_shard(void* shardArg)
+{
+    shard_t* shard = (shard_t*)shardArg;
+
+    if (sharded)
+        pthread_setaffinity_np(pthread_self(), sizeof(shard->cpus), &shard->cpus);
+
+    shard->threadpool = create_threadpool();
+    metrics_watch_pool(shard->threadpool);
+    event_loop_t* loop;
+    if (use_uring)
+        loop = event_loop_create_uring(shard->listenfd, shard->threadpool, &handle_connection,
+                &handle_overload, IDLE_TIMEOUT, QUEUE_DEADLINE);
+    else
+        loop = event_loop_create(shard->listenfd, shard->threadpool, &handle_connection,
+                &handle_overload, IDLE_TIMEOUT, QUEUE_DEADLINE);
+    if (loop == NULL)
     {
-        connfd = accept(listenfd, (struct sockaddr*)NULL, NULL);
-        threadpool_add_task(threadpool, &handle_connection, connfd);
+        exit(-1);
     }
+
+    // publish the loop before checking the flag, so that either this thread or the handler sees the other
+    atomic_store(&shard->event_loop, loop);
+    if (atomic_load(&stop_requested))
+        event_loop_stop(loop);
+
+    // handle connections loop (until SIGINT)
+    event_loop_run(loop);
+    return NULL;
 }
 
+//SIGINT handler.  Only asks each event loop to stop: main tears the server down once the loops have returned
 void shutdown_server(int signo){
-    threadpool_destroy(threadpool);
+    int i;
+
+    atomic_store(&stop_requested, 1);
+    for (i = 0; i < num_shards; i++)
+    {
+        event_loop_t* loop = atomic_load(&shards[i].event_loop);
+        if (loop != NULL)
+            event_loop_stop(loop);
+    }
+}
+
+//Frees everything main set up, once every shard's event loop has returned
+void destroy_server(){
+    int i;
+
+    // stop the workers first, since the requests they handle use the loops and the seats
+    for (i = 0; i < num_shards; i++)
+    {
+        if (shards[i].threadpool != NULL)
+        {
+            metrics_unwatch_pool(shards[i].threadpool);
+            threadpool_destroy(shards[i].threadpool);
+        }
+    }
+
+    // the hold timers publish expiries to the event loops' streams, so stop them before the loops go
     unload_seats();
+    for (i = 0; i < num_shards; i++)
+    {
+        event_loop_t* loop = atomic_load(&shards[i].event_loop);
+        if (loop != NULL)
+            event_loop_destroy(loop);
+        close(shards[i].listenfd);
+    }
+    seat_events_destroy();
     DeinitializeFileCache();
-    close(listenfd);
-    exit(0);
 }
@@ -0,0 +1,302 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "metrics.h"
+
+//Buckets in a histogram: one per value below METRICS_SUB_BUCKETS, then METRICS_SUB_BUCKETS for each power of two up
+//to METRICS_MAX_BITS
+#define BUCKETS (METRICS_SUB_BUCKETS * (METRICS_MAX_BITS - METRICS_SUB_BUCKET_BITS + 1))
+
+//Room for one line of the report
+#define REPORT_LINE 160
+
+//Lines of the report for each thread pool, and for the thread pool section as a whole
+#define POOL_LINES 9
+#define POOL_HEADER_LINES 18
+
+typedef struct {
+    //Only the owning thread writes a histogram, and metrics_report reads it at any time, so the counters are
+    //atomics updated with a relaxed load and store rather than a locked read-modify-write
+    _Atomic uint64_t buckets[BUCKETS];
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+} histogram_t;
+
+typedef struct thread_metrics_t {
+    histogram_t histograms[METRICS_ROUTES][METRICS_PHASES];
+    struct thread_metrics_t* next; //Every thread_metrics_t ever allocated, newest first
+    int in_use; //False once its thread has exited.  Protected by metrics_lock
+} thread_metrics_t;
+
+//The calling thread's histograms, or NULL before it first records
+static __thread thread_metrics_t* thread_metrics = NULL;
+
+static thread_metrics_t* all_metrics = NULL;
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Its destructor runs when a thread that has recorded exits
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_key_once = PTHREAD_ONCE_INIT;
+
+//Pools in the report, in the order they were added.  Protected by metrics_lock
+static threadpool_t* pools[METRICS_MAX_POOLS];
+static int pool_count = 0;
+
+static const char* route_names[METRICS_ROUTES] = {"static", "list_seats", "view_seat", "confirm", "cancel", "other"};
+static const char* phase_names[METRICS_PHASES] = {"queue", "parse", "handler", "write"};
+
+//Percentiles in the report
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+#define QUANTILES (sizeof(quantiles) / sizeof(quantiles[0]))
+
+//Gives the calling thread histograms: those of a thread that has exited if there are any, or new ones
+static thread_metrics_t* AttachThread();
+
+//pthread key destructor.  Leaves a thread's histograms, with their counts, for the next thread to take over
+static void DetachThread(void* metricsArg);
+
+//Creates metrics_key
+static void CreateKey();
+
+//Appends the state of every watched thread pool to the report
+//Returns the new length of the report
+static int ReportPools(char* text, int index, int capacity);
+
+//Returns the bucket a value goes in
+static inline int BucketIndex(uint64_t value);
+
+//Returns the largest value that goes in a bucket
+static inline uint64_t BucketValue(int index);
+
+//Adds to a counter that only the calling thread writes
+static inline void AddCounter(_Atomic uint64_t* counter, uint64_t amount);
+
+long metrics_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void metrics_record(metrics_route_t route, metrics_phase_t phase, long microseconds) {
+    thread_metrics_t* metrics = thread_metrics;
+    if(metrics == NULL) {
+        metrics = AttachThread();
+        if(metrics == NULL) {
+            return;
+        }
+    }
+
+    uint64_t value = microseconds > 0 ? microseconds : 0;
+    histogram_t* histogram = &metrics->histograms[route][phase];
+    AddCounter(&histogram->buckets[BucketIndex(value)], 1);
+    AddCounter(&histogram->count, 1);
+    AddCounter(&histogram->sum, value);
+    if(value > atomic_load_explicit(&histogram->max, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+    }
+}
+
+void metrics_watch_pool(threadpool_t* pool) {
+    pthread_mutex_lock(&metrics_lock);
+    if(pool_count < METRICS_MAX_POOLS) {
+        pools[pool_count++] = pool;
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+void metrics_unwatch_pool(threadpool_t* pool) {
+    pthread_mutex_lock(&metrics_lock);
+    int i;
+    for(i = 0; i < pool_count; i++) {
+        if(pools[i] == pool) {
+            memmove(&pools[i], &pools[i + 1], (pool_count - i - 1) * sizeof(threadpool_t*));
+            pool_count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+char* metrics_report(int* length) {
+    int capacity = METRICS_ROUTES * METRICS_PHASES * (QUANTILES + 3) * REPORT_LINE + 2 * REPORT_LINE +
+            (METRICS_MAX_POOLS * POOL_LINES + POOL_HEADER_LINES) * REPORT_LINE;
+    char* text = (char*)malloc(capacity);
+    if(text == NULL) {
+        *length = 0;
+        return NULL;
+    }
+    int index = snprintf(text, capacity,
+            "# HELP request_phase_microseconds Time spent in each phase of a request, by route\n"\
+            "# TYPE request_phase_microseconds summary\n");
+
+    //One histogram at a time, so that only one merged histogram is ever needed
+    uint64_t merged[BUCKETS];
+    int route, phase;
+    for(route = 0; route < METRICS_ROUTES; route++) {
+        for(phase = 0; phase < METRICS_PHASES; phase++) {
+            memset(merged, 0, sizeof(merged));
+            uint64_t count = 0, sum = 0, max = 0;
+
+            pthread_mutex_lock(&metrics_lock);
+            thread_metrics_t* metrics;
+            for(metrics = all_metrics; metrics != NULL; metrics = metrics->next) {
+                histogram_t* histogram = &metrics->histograms[route][phase];
+                int i;
+                for(i = 0; i < BUCKETS; i++) {
+                    merged[i] += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+                }
+                sum += atomic_load_explicit(&histogram->sum, memory_order_relaxed);
+                uint64_t histogramMax = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+                if(histogramMax > max) {
+                    max = histogramMax;
+                }
+            }
+            pthread_mutex_unlock(&metrics_lock);
+
+            //The count comes from the buckets, so that the percentiles agree with it even if requests were being
+            //recorded while the histograms were read
+            int i;
+            for(i = 0; i < BUCKETS; i++) {
+                count += merged[i];
+            }
+
+            const char* labels = "request_phase_microseconds{route=\"%s\",phase=\"%s\"";
+            int q;
+            for(q = 0; q < QUANTILES; q++) {
+                //The smallest value that at least quantile of the requests did not exceed
+                uint64_t rank = (uint64_t)(quantiles[q] * count + 0.5);
+                uint64_t seen = 0;
+                uint64_t value = 0;
+                if(count > 0) {
+                    for(i = 0; i < BUCKETS && (seen += merged[i]) < (rank > 0 ? rank : 1); i++) {
+                    }
+                    value = i < BUCKETS ? BucketValue(i) : max;
+                    if(value > max) {
+                        value = max;
+                    }
+                }
+                index += snprintf(text + index, capacity - index, labels, route_names[route], phase_names[phase]);
+                index += snprintf(text + index, capacity - index, ",quantile=\"%g\"} %llu\n", quantiles[q],
+                        (unsigned long long)value);
+            }
+            index += snprintf(text + index, capacity - index, labels, route_names[route], phase_names[phase]);
+            index += snprintf(text + index, capacity - index, ",quantile=\"1\"} %llu\n", (unsigned long long)max);
+            index += snprintf(text + index, capacity - index, "request_phase_microseconds_sum{route=\"%s\","\
+                    "phase=\"%s\"} %llu\n", route_names[route], phase_names[phase], (unsigned long long)sum);
+            index += snprintf(text + index, capacity - index, "request_phase_microseconds_count{route=\"%s\","\
+                    "phase=\"%s\"} %llu\n", route_names[route], phase_names[phase], (unsigned long long)count);
+        }
+    }
+
+    index = ReportPools(text, index, capacity);
+
+    *length = index;
+    return text;
+}
+
+static int ReportPools(char* text, int index, int capacity) {
+    //The lock is held while the pools are read, so that metrics_unwatch_pool can wait for the report to be done
+    //with a pool before it is destroyed
+    pthread_mutex_lock(&metrics_lock);
+    threadpool_stats_t stats[METRICS_MAX_POOLS];
+    int count = pool_count;
+    int i;
+    for(i = 0; i < count; i++) {
+        threadpool_get_stats(pools[i], &stats[i]);
+    }
+    pthread_mutex_unlock(&metrics_lock);
+    if(count == 0) {
+        return index;
+    }
+
+    //One gauge or counter at a time, with a line for each pool, as the format asks for
+    static const char* names[POOL_LINES] = {"threads", "idle_threads", "max_threads", "queued_tasks",
+            "oldest_wait_milliseconds", "peak_threads", "grown_for_depth_total", "grown_for_wait_total",
+            "retired_total"};
+    static const char* help[POOL_LINES] = {"Live worker threads", "Worker threads waiting for work",
+            "Most worker threads the pool may grow to", "Tasks waiting in the queue",
+            "Time the oldest queued task has waited", "Most worker threads alive at once",
+            "Threads started because too many tasks were queued",
+            "Threads started because the oldest task waited too long", "Threads that exited after an idle timeout"};
+    int line;
+    for(line = 0; line < POOL_LINES; line++) {
+        index += snprintf(text + index, capacity - index, "# HELP thread_pool_%s %s\n# TYPE thread_pool_%s %s\n",
+                names[line], help[line], names[line], line >= 6 ? "counter" : "gauge");
+        for(i = 0; i < count; i++) {
+            long values[POOL_LINES] = {stats[i].threads, stats[i].idle_threads, stats[i].max_threads,
+                    stats[i].queued, stats[i].oldest_wait, stats[i].peak_threads, stats[i].grown_for_depth,
+                    stats[i].grown_for_wait, stats[i].retired};
+            index += snprintf(text + index, capacity - index, "thread_pool_%s{pool=\"%d\"} %ld\n", names[line], i,
+                    values[line]);
+        }
+    }
+    return index;
+}
+
+static thread_metrics_t* AttachThread() {
+    pthread_once(&metrics_key_once, &CreateKey);
+
+    pthread_mutex_lock(&metrics_lock);
+    thread_metrics_t* metrics;
+    for(metrics = all_metrics; metrics != NULL && metrics->in_use; metrics = metrics->next) {
+    }
+    if(metrics == NULL) {
+        metrics = (thread_metrics_t*)calloc(1, sizeof(thread_metrics_t));
+        if(metrics == NULL) {
+            pthread_mutex_unlock(&metrics_lock);
+            return NULL;
+        }
+        metrics->next = all_metrics;
+        all_metrics = metrics;
+    }
+    metrics->in_use = 1;
+    pthread_mutex_unlock(&metrics_lock);
+
+    thread_metrics = metrics;
+    pthread_setspecific(metrics_key, metrics);
+    return metrics;
+}
+
+static void DetachThread(void* metricsArg) {
+    //The lock also makes sure the next thread to take the histograms over sees this thread's last counts
+    pthread_mutex_lock(&metrics_lock);
+    ((thread_metrics_t*)metricsArg)->in_use = 0;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+static void CreateKey() {
+    pthread_key_create(&metrics_key, &DetachThread);
+}
+
+static inline int BucketIndex(uint64_t value) {
+    if(value < METRICS_SUB_BUCKETS) {
+        return value;
+    }
+    if(value >> METRICS_MAX_BITS) {
+        return BUCKETS - 1;
+    }
+    //The top METRICS_SUB_BUCKET_BITS + 1 bits of the value pick the sub-bucket within its power of two
+    int magnitude = 63 - __builtin_clzll(value) - METRICS_SUB_BUCKET_BITS;
+    int subBucket = (value >> magnitude) - METRICS_SUB_BUCKETS;
+    return METRICS_SUB_BUCKETS * (magnitude + 1) + subBucket;
+}
+
+static inline uint64_t BucketValue(int index) {
+    if(index < METRICS_SUB_BUCKETS) {
+        return index;
+    }
+    int magnitude = index / METRICS_SUB_BUCKETS - 1;
+    uint64_t subBucket = index % METRICS_SUB_BUCKETS;
+    return ((METRICS_SUB_BUCKETS + subBucket + 1) << magnitude) - 1;
+}
+
+static inline void AddCounter(_Atomic uint64_t* counter, uint64_t amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount,
+            memory_order_relaxed);
+}
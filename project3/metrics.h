@@ -0,0 +1,70 @@
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include "thread_pool.h"
+
+/*
+metrics keeps latency histograms of every request, by route and by phase, and renders them for the metrics page.
+
+Each thread records into histograms of its own, so recording is a few plain increments with no lock and no shared
+cache line, and costs the same however many threads there are.  The histograms are log-linear, like HdrHistogram:
+values below METRICS_SUB_BUCKETS microseconds each have a bucket, and every power of two above that is split into
+METRICS_SUB_BUCKETS equal buckets, so a percentile is never off by more than 1/METRICS_SUB_BUCKETS of its value
+whatever its size.  metrics_report merges every thread's histograms when it is asked to, and adds the sizing
+decisions of the thread pools it has been given with metrics_watch_pool.
+
+A thread's histograms are handed on to the next thread that records once it exits, rather than freed, so threads
+that come and go (as in the elastic pool) neither lose their counts nor make the memory grow.
+*/
+
+//Sub-buckets per power of two.  Percentiles are within 1/METRICS_SUB_BUCKETS (6%) of the true value
+#define METRICS_SUB_BUCKET_BITS 4
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+
+//Most thread pools metrics_report can describe
+#define METRICS_MAX_POOLS 64
+
+//Values are recorded in microseconds, and those of 2^METRICS_MAX_BITS (about 71 minutes) or more are counted as
+//the largest that fits
+#define METRICS_MAX_BITS 32
+
+//What a request was for.  Set by the request handler
+typedef enum {
+    METRICS_STATIC,         //A file
+    METRICS_LIST_SEATS,
+    METRICS_VIEW_SEAT,
+    METRICS_CONFIRM,
+    METRICS_CANCEL,
+    METRICS_OTHER,          //Every other page
+    METRICS_ROUTES          //Not a route: the number of routes, and the route of a request that is not recorded
+} metrics_route_t;
+
+//The phases of a request
+typedef enum {
+    METRICS_QUEUE,          //Waiting in the thread pool's queue
+    METRICS_PARSE,          //Parsing, summed over the reads the request arrived in
+    METRICS_HANDLER,        //Running the request handler
+    METRICS_WRITE,          //From the end of the handler until the whole response has been written
+    METRICS_PHASES
+} metrics_phase_t;
+
+//Returns the current time in microseconds from a clock that never jumps
+long metrics_now();
+
+//Records that a phase of a request for route took microseconds, in the calling thread's histograms
+void metrics_record(metrics_route_t route, metrics_phase_t phase, long microseconds);
+
+//Adds a thread pool's size, load and sizing decisions to the report.  Does nothing if METRICS_MAX_POOLS pools are
+//already watched
+void metrics_watch_pool(threadpool_t* pool);
+
+//Takes a pool out of the report.  Once it returns, no report is looking at the pool, so it may be destroyed
+void metrics_unwatch_pool(threadpool_t* pool);
+
+//Merges every thread's histograms and renders them in the Prometheus text format: for each route and phase, the
+//count, the sum and the 50th, 90th, 99th and 99.9th percentiles and the maximum, in microseconds, followed by the
+//state of each watched thread pool
+//Returns the text, which the caller frees, and sets *length to its length
+char* metrics_report(int* length);
+
+#endif
@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "mpmc_queue.h"
+
+//An event count that threads can sleep on.  epoch is the futex word and changes every time a waiter is notified.
+//waiters counts the threads that are registered to sleep, so that notifying costs nothing while there are none
+typedef struct {
+    atomic_uint epoch;
+    atomic_int waiters;
+} __attribute__((aligned(64))) event_count_t;
+
+//Every cell starts with its sequence number, followed by the element
+//A cell at index i is free for the producer whose position is pos when sequence == pos, and holds an element for
+//the consumer whose position is pos when sequence == pos + 1
+typedef struct {
+    atomic_size_t sequence;
+} cell_t;
+
+struct mpmc_queue_t {
+    char* cells;
+    int cell_size; //Bytes per cell: the sequence number and the element, rounded up to keep cells aligned
+    int element_size;
+    size_t mask; //Capacity - 1
+    atomic_int closed;
+
+    //The positions only ever increase.  Each is written by one side only, so keep them on their own cache lines
+    atomic_size_t enqueue_position __attribute__((aligned(64)));
+    atomic_size_t dequeue_position __attribute__((aligned(64)));
+
+    event_count_t not_empty; //Consumers sleep here while the queue is empty
+    event_count_t not_full; //Producers sleep here while the queue is full
+};
+
+//Returns the cell for a position
+static inline cell_t* CellAt(mpmc_queue_t* queue, size_t position);
+
+//Registers the calling thread as a waiter on an event count
+//Returns the key to pass to WaitForEvent.  The caller must check its condition again before waiting
+static unsigned int PrepareWait(event_count_t* eventCount);
+
+//Sleeps until the event count moves past key, then unregisters the caller
+static void WaitForEvent(event_count_t* eventCount, unsigned int key);
+
+//Unregisters a caller of PrepareWait that found its condition true and is not going to wait
+static void CancelWait(event_count_t* eventCount);
+
+//Wakes one waiter (or all of them) if there are any
+static void NotifyEvent(event_count_t* eventCount, int all);
+
+mpmc_queue_t* mpmc_queue_create(int capacity, int elementSize) {
+    size_t size = 2;
+    while(size < capacity) {
+        size *= 2;
+    }
+
+    mpmc_queue_t* queue = (mpmc_queue_t*)aligned_alloc(64, sizeof(mpmc_queue_t));
+    queue->element_size = elementSize;
+    queue->cell_size = (sizeof(cell_t) + elementSize + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+    queue->mask = size - 1;
+    queue->cells = (char*)malloc(queue->cell_size * size);
+    atomic_init(&queue->closed, 0);
+    atomic_init(&queue->enqueue_position, 0);
+    atomic_init(&queue->dequeue_position, 0);
+    atomic_init(&queue->not_empty.epoch, 0);
+    atomic_init(&queue->not_empty.waiters, 0);
+    atomic_init(&queue->not_full.epoch, 0);
+    atomic_init(&queue->not_full.waiters, 0);
+
+    //Every cell starts out free for the producer that reaches it on the first lap
+    size_t i;
+    for(i = 0; i < size; i++) {
+        atomic_init(&CellAt(queue, i)->sequence, i);
+    }
+    return queue;
+}
+
+void mpmc_queue_destroy(mpmc_queue_t* queue) {
+    free(queue->cells);
+    free(queue);
+}
+
+int mpmc_queue_try_push(mpmc_queue_t* queue, const void* element) {
+    size_t position = atomic_load_explicit(&queue->enqueue_position, memory_order_relaxed);
+    cell_t* cell;
+    while(1) {
+        cell = CellAt(queue, position);
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+        if(difference == 0) {
+            //The cell is free on this lap, so try to claim it
+            if(atomic_compare_exchange_weak_explicit(&queue->enqueue_position, &position, position + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+            //Another producer claimed it first; position now holds the current value
+        } else if(difference < 0) {
+            //The cell still holds the element from the previous lap, so the queue is full
+            return 0;
+        } else {
+            position = atomic_load_explicit(&queue->enqueue_position, memory_order_relaxed);
+        }
+    }
+
+    memcpy(cell + 1, element, queue->element_size);
+    atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+
+    NotifyEvent(&queue->not_empty, 0);
+    return 1;
+}
+
+int mpmc_queue_try_pop(mpmc_queue_t* queue, void* element) {
+    size_t position = atomic_load_explicit(&queue->dequeue_position, memory_order_relaxed);
+    cell_t* cell;
+    while(1) {
+        cell = CellAt(queue, position);
+        size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+        if(difference == 0) {
+            if(atomic_compare_exchange_weak_explicit(&queue->dequeue_position, &position, position + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if(difference < 0) {
+            //Nothing has been published in this cell yet, so the queue is empty
+            return 0;
+        } else {
+            position = atomic_load_explicit(&queue->dequeue_position, memory_order_relaxed);
+        }
+    }
+
+    memcpy(element, cell + 1, queue->element_size);
+    //Free the cell for the producer that reaches it on the next lap
+    atomic_store_explicit(&cell->sequence, position + queue->mask + 1, memory_order_release);
+
+    NotifyEvent(&queue->not_full, 0);
+    return 1;
+}
+
+int mpmc_queue_push(mpmc_queue_t* queue, const void* element) {
+    while(1) {
+        if(atomic_load(&queue->closed)) {
+            return 0;
+        }
+        if(mpmc_queue_try_push(queue, element)) {
+            return 1;
+        }
+
+        unsigned int key = PrepareWait(&queue->not_full);
+        if(mpmc_queue_try_push(queue, element)) {
+            CancelWait(&queue->not_full);
+            return 1;
+        }
+        if(atomic_load(&queue->closed)) {
+            CancelWait(&queue->not_full);
+            return 0;
+        }
+        WaitForEvent(&queue->not_full, key);
+    }
+}
+
+int mpmc_queue_pop(mpmc_queue_t* queue, void* element) {
+    while(1) {
+        if(mpmc_queue_try_pop(queue, element)) {
+            return 1;
+        }
+
+        unsigned int key = PrepareWait(&queue->not_empty);
+        if(mpmc_queue_try_pop(queue, element)) {
+            CancelWait(&queue->not_empty);
+            return 1;
+        }
+        if(atomic_load(&queue->closed)) {
+            CancelWait(&queue->not_empty);
+            return 0;
+        }
+        WaitForEvent(&queue->not_empty, key);
+    }
+}
+
+void mpmc_queue_close(mpmc_queue_t* queue) {
+    atomic_store(&queue->closed, 1);
+    NotifyEvent(&queue->not_empty, 1);
+    NotifyEvent(&queue->not_full, 1);
+}
+
+static inline cell_t* CellAt(mpmc_queue_t* queue, size_t position) {
+    return (cell_t*)(queue->cells + (position & queue->mask) * queue->cell_size);
+}
+
+static unsigned int PrepareWait(event_count_t* eventCount) {
+    //Registering must be visible before the caller checks its condition again.  The notifier makes its change
+    //visible before it looks at waiters, so at least one of the two sees the other
+    atomic_fetch_add(&eventCount->waiters, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    return atomic_load(&eventCount->epoch);
+}
+
+static void WaitForEvent(event_count_t* eventCount, unsigned int key) {
+    //Returns straight away if the epoch has already moved on since PrepareWait
+    syscall(SYS_futex, &eventCount->epoch, FUTEX_WAIT_PRIVATE, key, NULL, NULL, 0);
+    atomic_fetch_sub(&eventCount->waiters, 1);
+}
+
+static void CancelWait(event_count_t* eventCount) {
+    atomic_fetch_sub(&eventCount->waiters, 1);
+}
+
+static void NotifyEvent(event_count_t* eventCount, int all) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load_explicit(&eventCount->waiters, memory_order_relaxed) == 0) {
+        return;
+    }
+    atomic_fetch_add(&eventCount->epoch, 1);
+    syscall(SYS_futex, &eventCount->epoch, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1, NULL, NULL, 0);
+}
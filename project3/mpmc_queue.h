@@ -0,0 +1,46 @@
+#ifndef _MPMC_QUEUE_H_
+#define _MPMC_QUEUE_H_
+
+/*
+mpmc_queue is a bounded multi-producer multi-consumer queue that does not use locks (Dmitry Vyukov's design).
+Elements are copied in and out of a ring of cells, and each cell carries a sequence number that says whether it is
+ready to be written or read on the current lap of the ring.  A producer claims a cell with one compare-and-swap on
+the enqueue position and publishes it with one store to the cell's sequence number; a consumer does the same on the
+dequeue position.  Producers and consumers never touch each other's position, and the two positions are kept on
+separate cache lines.
+
+The blocking calls sleep on futex based event counts.  A thread that finds the queue empty (or full) registers as
+a waiter, tries once more, and only then sleeps on the event count.  The other side bumps the event count and
+issues a FUTEX_WAKE only if someone is registered, so while no thread is asleep, pushing and popping cost a few
+atomic operations and no system calls.
+*/
+
+typedef struct mpmc_queue_t mpmc_queue_t;
+
+//Creates an empty queue of elements of elementSize bytes
+//capacity is rounded up to a power of two
+mpmc_queue_t* mpmc_queue_create(int capacity, int elementSize);
+
+//Frees the queue.  No thread may be using it
+void mpmc_queue_destroy(mpmc_queue_t* queue);
+
+//Copies an element into the queue
+//Returns true if it was added, false if the queue is full
+int mpmc_queue_try_push(mpmc_queue_t* queue, const void* element);
+
+//Copies the oldest element out of the queue into element
+//Returns true if an element was removed, false if the queue is empty
+int mpmc_queue_try_pop(mpmc_queue_t* queue, void* element);
+
+//Copies an element into the queue, sleeping while the queue is full
+//Returns true if it was added, false if the queue has been closed
+int mpmc_queue_push(mpmc_queue_t* queue, const void* element);
+
+//Copies the oldest element out of the queue into element, sleeping while the queue is empty
+//Returns true if an element was removed, false once the queue has been closed and is empty
+int mpmc_queue_pop(mpmc_queue_t* queue, void* element);
+
+//Closes the queue and wakes every sleeping thread.  Elements already in the queue can still be popped
+void mpmc_queue_close(mpmc_queue_t* queue);
+
+#endif
@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "seat_events.h"
+#include "seats.h"
+#include "event_loop.h"
+
+//A slot of the ring.  sequence is one more than the sequence number of the record in the slot, or 0 while a record
+//is being written, which lets a reader tell that the slot was overwritten while it read it
+typedef struct {
+    _Atomic uint64_t sequence;
+    atomic_int seat_id;
+} seat_event_t;
+
+static seat_event_t* ring = NULL;
+static uint64_t ring_capacity = 0;
+static _Atomic uint64_t ring_head; //Sequence number of the next record to be published
+
+//The event loops that have had subscribers, to be woken when a record is published.  A loop is added once, the
+//first time one of its connections subscribes, and stays
+static event_loop_t* loops[SEAT_EVENTS_MAX_LOOPS];
+static atomic_int loop_count;
+static pthread_mutex_t loops_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//stream_fill for subscribers.  Appends the events from the subscriber's cursor, a reset event if it has fallen too
+//far behind, or a comment as a heartbeat
+static int FillSeatEvents(connection_t* connection, int heartbeat);
+
+//Adds an event loop to the loops woken by seat_events_publish, if it is not there already
+static void AddLoop(event_loop_t* loop);
+
+void seat_events_init(int capacity) {
+    ring_capacity = 1;
+    while(ring_capacity < capacity) {
+        ring_capacity *= 2;
+    }
+    ring = (seat_event_t*)malloc(sizeof(seat_event_t) * ring_capacity);
+    uint64_t i;
+    for(i = 0; i < ring_capacity; i++) {
+        atomic_init(&ring[i].sequence, 0);
+        atomic_init(&ring[i].seat_id, 0);
+    }
+    atomic_init(&ring_head, 0);
+    atomic_init(&loop_count, 0);
+}
+
+void seat_events_destroy() {
+    free(ring);
+    ring = NULL;
+}
+
+void seat_events_publish(int seat_id) {
+    if(ring == NULL) {
+        return;
+    }
+
+    //The slot is marked as being written before the record changes, and given its sequence number after, the way
+    //a seqlock is written
+    uint64_t sequence = atomic_fetch_add(&ring_head, 1);
+    seat_event_t* slot = &ring[sequence & (ring_capacity - 1)];
+    atomic_store_explicit(&slot->sequence, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&slot->seat_id, seat_id, memory_order_relaxed);
+    atomic_store_explicit(&slot->sequence, sequence + 1, memory_order_release);
+
+    int count = atomic_load_explicit(&loop_count, memory_order_acquire);
+    int i;
+    for(i = 0; i < count; i++) {
+        event_loop_wake_streams(loops[i]);
+    }
+}
+
+void seat_events_subscribe(connection_t* connection) {
+    //The stream ends when the connection does, so it has no length
+    const char* head = "HTTP/1.1 200 OK\r\n"\
+                       "Content-type: text/event-stream\r\n"\
+                       "Cache-Control: no-cache\r\n"\
+                       "Connection: close\r\n\r\n";
+    connection_append(connection, head, strlen(head));
+    connection->keep_alive = 0;
+
+    //An id is one more than the sequence number of its record, so it is also the position to carry on from
+    uint64_t position = atomic_load(&ring_head);
+    const http_slice_t* lastEventId = http_request_header(&connection->request, "Last-Event-ID");
+    if(lastEventId != NULL) {
+        char id[32];
+        http_slice_copy(&connection->request, *lastEventId, id, sizeof(id));
+        uint64_t last = strtoull(id, NULL, 10);
+        if(last <= position) {
+            position = last;
+        }
+    }
+    connection->stream_position = position;
+    connection->stream_fill = &FillSeatEvents;
+    AddLoop(connection->loop);
+}
+
+static int FillSeatEvents(connection_t* connection, int heartbeat) {
+    char event[64];
+    int length;
+    int appended = 0;
+    uint64_t head = atomic_load(&ring_head);
+    uint64_t cursor = connection->stream_position;
+    int lapped = head - cursor > ring_capacity;
+
+    int count;
+    for(count = 0; !lapped && cursor < head && count < SEAT_EVENTS_BATCH; count++) {
+        seat_event_t* slot = &ring[cursor & (ring_capacity - 1)];
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        if(sequence != cursor + 1) {
+            //Either the record has not been written yet, and its publisher will wake the loop once it has, or the
+            //slot already holds a later record
+            lapped = sequence > cursor + 1;
+            break;
+        }
+        int seat_id = atomic_load_explicit(&slot->seat_id, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+        if(atomic_load_explicit(&slot->sequence, memory_order_relaxed) != sequence) {
+            lapped = 1;
+            break;
+        }
+
+        cursor++;
+        length = snprintf(event, sizeof(event), "id: %llu\ndata: %d %c\n\n", (unsigned long long)cursor, seat_id,
+                seat_state_to_char(seat_state(seat_id)));
+        connection_append(connection, event, length);
+        appended += length;
+    }
+
+    if(lapped) {
+        //The records this subscriber missed are gone.  It has to start again from the whole list
+        cursor = head;
+        length = snprintf(event, sizeof(event), "id: %llu\nevent: reset\ndata:\n\n", (unsigned long long)cursor);
+        connection_append(connection, event, length);
+        appended += length;
+    } else if(appended == 0 && heartbeat) {
+        length = snprintf(event, sizeof(event), ":\n\n");
+        connection_append(connection, event, length);
+        appended += length;
+    }
+
+    connection->stream_position = cursor;
+    return appended;
+}
+
+static void AddLoop(event_loop_t* loop) {
+    pthread_mutex_lock(&loops_lock);
+    int count = atomic_load_explicit(&loop_count, memory_order_relaxed);
+    int i;
+    for(i = 0; i < count && loops[i] != loop; i++) {
+    }
+    if(i == count && count < SEAT_EVENTS_MAX_LOOPS) {
+        //Publishers read the array without the lock, so the loop goes in before the count says it is there
+        loops[count] = loop;
+        atomic_store_explicit(&loop_count, count + 1, memory_order_release);
+    } else if(i == count) {
+        fprintf(stderr, "seat_events: too many event loops, subscribers will not be woken\n");
+    }
+    pthread_mutex_unlock(&loops_lock);
+}
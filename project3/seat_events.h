@@ -0,0 +1,43 @@
+#ifndef _SEAT_EVENTS_H_
+#define _SEAT_EVENTS_H_
+
+#include "connection.h"
+
+/*
+seat_events is the change feed behind the seat_events page, which streams seat transitions to clients as
+server-sent events instead of having them poll list_seats.
+
+Every transition is published to one shared ring of change records, each just a sequence number and a seat id.
+Publishing takes a slot with one atomic add and fills it in, so transitions never wait for subscribers.  Each
+subscriber is a stream on an event loop (see event_loop.h) whose position in the ring is its cursor; when its loop
+is woken, the subscriber formats the records between its cursor and the head of the ring straight into its socket
+buffer.  One transition therefore costs one record however many clients are listening, and a client that is slow
+only falls behind on its own cursor.
+
+An event is "id: N" and "data: <seat> <state>", where the state is read from the seat when the event is sent.  If a
+seat changes twice quickly, both events may show the second state, but the last event for a seat always shows the
+state it ended up in.  A subscriber that falls more than a ring's worth of records behind has missed changes, and is
+sent a "reset" event instead, after which it should fetch list_seats again and carry on from there.  A client that
+reconnects with a Last-Event-ID header carries on where it left off, if the ring still holds that far back.
+*/
+
+//Records sent to a subscriber in one go, so that one subscriber cannot keep its event loop busy for long
+#define SEAT_EVENTS_BATCH 256
+
+//Most event loops that may have subscribers
+#define SEAT_EVENTS_MAX_LOOPS 64
+
+//Creates the ring, which holds the last capacity records (rounded up to a power of two)
+void seat_events_init(int capacity);
+
+//Frees the ring.  The event loops must have been stopped
+void seat_events_destroy();
+
+//Publishes a transition of seat_id.  Does nothing if the ring has not been created
+void seat_events_publish(int seat_id);
+
+//Request handler for the seat_events page.  Places the response head in the connection and turns it into a stream
+//of the transitions published from now on (or after Last-Event-ID)
+void seat_events_subscribe(connection_t* connection);
+
+#endif
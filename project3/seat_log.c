@@ -0,0 +1,416 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "seat_log.h"
+
+//A batch is written as soon as it holds this many records, without waiting for the rest of the batch window
+#define BATCH_LIMIT 4096
+
+//Records are read back in chunks of this many during recovery
+#define RECOVERY_CHUNK 4096
+
+#define SNAPSHOT_MAGIC 0x53454154u //"SEAT"
+
+//One transition.  check is a hash of the other fields, so that a record torn by a crash is recognized
+typedef struct {
+    uint32_t seat_id;
+    uint32_t check;
+    uint64_t word;
+} log_record_t;
+
+//Start of a snapshot file.  It is followed by count seat words and a hash of the words
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+} snapshot_header_t;
+
+struct seat_log_t {
+    int log_fd;
+    int directory_fd;
+    char* log_path;
+    char* snapshot_path;
+    char* temporary_path;
+    seat_t* seats;
+    int count;
+    int batch_window;
+    long log_records; //Records in the log file.  Only touched by the flusher once the log is open
+
+    pthread_mutex_t lock;
+    pthread_cond_t work; //Signalled when the first record of a batch is appended, or the batch is full
+    pthread_cond_t durable; //Broadcast whenever durable_lsn moves
+    pthread_t flusher;
+    int stopping;
+
+    //Records appended since the flusher last took the buffer.  The flusher swaps in the spare buffer and writes
+    //this one out without holding the lock
+    log_record_t* buffer;
+    int buffered;
+    int capacity;
+    log_record_t* spare;
+    int spare_capacity;
+
+    uint64_t appended_lsn; //Sequence number of the last record appended
+    uint64_t durable_lsn; //Sequence number of the last record known to be on disk
+    int failed; //True once a write or sync has failed.  Records after durable_lsn will never be durable
+};
+
+//Returns the check field for a record
+static uint32_t RecordCheck(uint32_t seatId, uint64_t word);
+
+//Returns a hash of the seat words in a snapshot
+static uint64_t SnapshotCheck(const uint64_t* words, int count);
+
+//Returns a newly allocated "directory/name"
+static char* JoinPath(const char* directory, const char* name);
+
+//Replays the snapshot, if there is a valid one, through recover
+static void RecoverSnapshot(seat_log_t* log, void (*recover)(int, uint64_t));
+
+//Replays the log through recover and cuts off a torn record at its end
+static void RecoverLog(seat_log_t* log, void (*recover)(int, uint64_t));
+
+//Writes all of a buffer to a file.  Returns 0, or -1 on error
+static int WriteAll(int fd, const void* data, size_t length);
+
+//Writes a snapshot of the seat table and empties the log.  Runs on the flusher
+static void TakeSnapshot(seat_log_t* log);
+
+//The flusher thread.  Writes out and syncs each batch of appended records, then wakes the waiters
+static void* RunFlusher(void* logArg);
+
+seat_log_t* seat_log_open(const char* directory, seat_t* seats, int count, int batchWindow,
+        void (*recover)(int seat_id, uint64_t word)) {
+    mkdir(directory, 0755);
+    int directoryFd = open(directory, O_RDONLY | O_DIRECTORY);
+    if(directoryFd < 0) {
+        perror(directory);
+        return NULL;
+    }
+
+    seat_log_t* log = (seat_log_t*)calloc(1, sizeof(seat_log_t));
+    log->directory_fd = directoryFd;
+    log->log_path = JoinPath(directory, "seats.log");
+    log->snapshot_path = JoinPath(directory, "seats.snap");
+    log->temporary_path = JoinPath(directory, "seats.snap.tmp");
+    log->seats = seats;
+    log->count = count;
+    log->batch_window = batchWindow;
+
+    log->log_fd = open(log->log_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if(log->log_fd < 0) {
+        perror(log->log_path);
+        close(directoryFd);
+        free(log->log_path);
+        free(log->snapshot_path);
+        free(log->temporary_path);
+        free(log);
+        return NULL;
+    }
+
+    RecoverSnapshot(log, recover);
+    RecoverLog(log, recover);
+
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->work, NULL);
+    pthread_cond_init(&log->durable, NULL);
+    log->capacity = BATCH_LIMIT;
+    log->buffer = (log_record_t*)malloc(sizeof(log_record_t) * log->capacity);
+    log->spare_capacity = BATCH_LIMIT;
+    log->spare = (log_record_t*)malloc(sizeof(log_record_t) * log->spare_capacity);
+
+    //Signal handlers (which close the log) must run on the application's own threads
+    sigset_t allSignals, oldMask;
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_SETMASK, &allSignals, &oldMask);
+    pthread_create(&log->flusher, NULL, &RunFlusher, log);
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+    return log;
+}
+
+void seat_log_close(seat_log_t* log) {
+    //The flusher writes out whatever is still buffered before it stops
+    pthread_mutex_lock(&log->lock);
+    log->stopping = 1;
+    pthread_cond_signal(&log->work);
+    pthread_mutex_unlock(&log->lock);
+    pthread_join(log->flusher, NULL);
+
+    close(log->log_fd);
+    close(log->directory_fd);
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->work);
+    pthread_cond_destroy(&log->durable);
+    free(log->buffer);
+    free(log->spare);
+    free(log->log_path);
+    free(log->snapshot_path);
+    free(log->temporary_path);
+    free(log);
+}
+
+uint64_t seat_log_append(seat_log_t* log, int seat_id, uint64_t word) {
+    pthread_mutex_lock(&log->lock);
+    if(log->buffered == log->capacity) {
+        //The flusher is busy with the previous batch, and this one outgrew its buffer
+        log->capacity *= 2;
+        log->buffer = (log_record_t*)realloc(log->buffer, sizeof(log_record_t) * log->capacity);
+    }
+    log_record_t* record = &log->buffer[log->buffered++];
+    record->seat_id = seat_id;
+    record->word = word;
+    record->check = RecordCheck(seat_id, word);
+    uint64_t lsn = ++log->appended_lsn;
+
+    if(log->buffered == 1 || log->buffered == BATCH_LIMIT) {
+        pthread_cond_signal(&log->work);
+    }
+    pthread_mutex_unlock(&log->lock);
+    return lsn;
+}
+
+int seat_log_wait(seat_log_t* log, uint64_t lsn) {
+    pthread_mutex_lock(&log->lock);
+    while(log->durable_lsn < lsn && !log->failed) {
+        pthread_cond_wait(&log->durable, &log->lock);
+    }
+    int result = log->durable_lsn < lsn ? -1 : 0;
+    pthread_mutex_unlock(&log->lock);
+    return result;
+}
+
+static uint32_t RecordCheck(uint32_t seatId, uint64_t word) {
+    //FNV-1a over the fields.  A zeroed (never written) record never checks out, since the hash of zeroes is not 0
+    uint64_t fields[2] = {seatId, word};
+    const unsigned char* bytes = (const unsigned char*)fields;
+    uint32_t hash = 2166136261u;
+    int i;
+    for(i = 0; i < sizeof(fields); i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint64_t SnapshotCheck(const uint64_t* words, int count) {
+    uint64_t hash = 14695981039346656037ull;
+    int i;
+    for(i = 0; i < count; i++) {
+        hash = (hash ^ words[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+static char* JoinPath(const char* directory, const char* name) {
+    char* path = (char*)malloc(strlen(directory) + strlen(name) + 2);
+    sprintf(path, "%s/%s", directory, name);
+    return path;
+}
+
+static void RecoverSnapshot(seat_log_t* log, void (*recover)(int, uint64_t)) {
+    int fd = open(log->snapshot_path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return;
+    }
+
+    //The snapshot is small (8 bytes a seat), so read it in one go
+    struct stat snapshotStat;
+    snapshot_header_t header;
+    if(fstat(fd, &snapshotStat) < 0 || read(fd, &header, sizeof(header)) != sizeof(header) ||
+            header.magic != SNAPSHOT_MAGIC ||
+            snapshotStat.st_size != sizeof(header) + (header.count + 1) * sizeof(uint64_t)) {
+        fprintf(stderr, "%s is not a valid snapshot, ignoring it\n", log->snapshot_path);
+        close(fd);
+        return;
+    }
+    size_t size = (header.count + 1) * sizeof(uint64_t);
+    uint64_t* words = (uint64_t*)malloc(size);
+    if(read(fd, words, size) != size || words[header.count] != SnapshotCheck(words, header.count)) {
+        fprintf(stderr, "%s is corrupt, ignoring it\n", log->snapshot_path);
+    } else {
+        //The venue may have been resized since; seats that no longer exist are dropped
+        int i;
+        for(i = 0; i < header.count && i < log->count; i++) {
+            recover(i, words[i]);
+        }
+    }
+    free(words);
+    close(fd);
+}
+
+static void RecoverLog(seat_log_t* log, void (*recover)(int, uint64_t)) {
+    log_record_t* records = (log_record_t*)malloc(sizeof(log_record_t) * RECOVERY_CHUNK);
+    off_t validLength = 0;
+    int torn = 0;
+
+    while(!torn) {
+        ssize_t numRead = pread(log->log_fd, records, sizeof(log_record_t) * RECOVERY_CHUNK, validLength);
+        if(numRead <= 0) {
+            break;
+        }
+        int numRecords = numRead / sizeof(log_record_t);
+        int i;
+        for(i = 0; i < numRecords; i++) {
+            if(records[i].check != RecordCheck(records[i].seat_id, records[i].word)) {
+                torn = 1;
+                break;
+            }
+            if(records[i].seat_id < log->count) {
+                recover(records[i].seat_id, records[i].word);
+            }
+            validLength += sizeof(log_record_t);
+            log->log_records++;
+        }
+        if(numRecords == 0) {
+            //Only part of a record is left, which is cut off below
+            break;
+        }
+    }
+    free(records);
+
+    //Anything after the last whole record was being written when the server stopped, and was never acknowledged
+    struct stat logStat;
+    if(fstat(log->log_fd, &logStat) == 0 && logStat.st_size > validLength) {
+        fprintf(stderr, "%s: discarding %ld bytes of torn records\n", log->log_path,
+                (long)(logStat.st_size - validLength));
+        if(ftruncate(log->log_fd, validLength) == 0) {
+            fdatasync(log->log_fd);
+        }
+    }
+}
+
+static int WriteAll(int fd, const void* data, size_t length) {
+    const char* bytes = (const char*)data;
+    while(length > 0) {
+        ssize_t numWritten = write(fd, bytes, length);
+        if(numWritten < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += numWritten;
+        length -= numWritten;
+    }
+    return 0;
+}
+
+static void TakeSnapshot(seat_log_t* log) {
+    //Every record in the log file was appended after its transition was made, so the table already reflects all of
+    //them.  Transitions made while the table is being read are also in the buffer, and are written to the emptied log
+    size_t size = sizeof(snapshot_header_t) + (log->count + 1) * sizeof(uint64_t);
+    char* snapshot = (char*)malloc(size);
+    snapshot_header_t* header = (snapshot_header_t*)snapshot;
+    header->magic = SNAPSHOT_MAGIC;
+    header->count = log->count;
+    uint64_t* words = (uint64_t*)(snapshot + sizeof(snapshot_header_t));
+    int i;
+    for(i = 0; i < log->count; i++) {
+        words[i] = atomic_load_explicit(&log->seats[i].word, memory_order_acquire);
+    }
+    words[log->count] = SnapshotCheck(words, log->count);
+
+    int fd = open(log->temporary_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(fd < 0 || WriteAll(fd, snapshot, size) < 0 || fdatasync(fd) < 0) {
+        perror(log->temporary_path);
+        if(fd >= 0) {
+            close(fd);
+        }
+        free(snapshot);
+        return;
+    }
+    close(fd);
+    free(snapshot);
+
+    //Only empty the log once the new snapshot has replaced the old one on disk
+    if(rename(log->temporary_path, log->snapshot_path) < 0 || fsync(log->directory_fd) < 0) {
+        perror(log->snapshot_path);
+        return;
+    }
+    if(ftruncate(log->log_fd, 0) < 0 || fdatasync(log->log_fd) < 0) {
+        perror(log->log_path);
+        return;
+    }
+    log->log_records = 0;
+}
+
+static void* RunFlusher(void* logArg) {
+    seat_log_t* log = (seat_log_t*)logArg;
+
+    pthread_mutex_lock(&log->lock);
+    while(1) {
+        while(log->buffered == 0 && !log->stopping) {
+            pthread_cond_wait(&log->work, &log->lock);
+        }
+        if(log->buffered == 0) {
+            break;
+        }
+
+        //Give other requests the batch window to join this commit
+        if(log->batch_window > 0 && !log->stopping) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += log->batch_window * 1000000L;
+            if(deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+                deadline.tv_nsec %= 1000000000L;
+            }
+            while(log->buffered < BATCH_LIMIT && !log->stopping &&
+                    pthread_cond_timedwait(&log->work, &log->lock, &deadline) != ETIMEDOUT) {
+            }
+        }
+
+        //Take the batch and let appends carry on into the spare buffer while it is written
+        log_record_t* batch = log->buffer;
+        int batchSize = log->buffered;
+        int batchCapacity = log->capacity;
+        uint64_t batchLsn = log->appended_lsn;
+        log->buffer = log->spare;
+        log->capacity = log->spare_capacity;
+        log->buffered = 0;
+        pthread_mutex_unlock(&log->lock);
+
+        //Once the log has failed, batches are dropped: their waiters are told they will never be durable
+        int failed = log->failed;
+        if(!failed &&
+                (WriteAll(log->log_fd, batch, sizeof(log_record_t) * batchSize) < 0 || fdatasync(log->log_fd) < 0)) {
+            perror(log->log_path);
+            fprintf(stderr, "%s: seat transitions are no longer logged\n", log->log_path);
+            failed = 1;
+
+            //Cut off whatever part of the batch was written, so that recovery still reaches every record that
+            //was synced before it, rather than stopping at a torn record in the middle of the file
+            if(ftruncate(log->log_fd, log->log_records * sizeof(log_record_t)) == 0) {
+                fdatasync(log->log_fd);
+            }
+        }
+        if(!failed) {
+            log->log_records += batchSize;
+        }
+
+        pthread_mutex_lock(&log->lock);
+        log->spare = batch;
+        log->spare_capacity = batchCapacity;
+        if(failed) {
+            log->failed = 1;
+        } else {
+            log->durable_lsn = batchLsn;
+        }
+        pthread_cond_broadcast(&log->durable);
+
+        //Compact after waking the waiters, so that they are not held up by the snapshot
+        if(!failed && log->log_records >= SEAT_LOG_SNAPSHOT_RECORDS) {
+            pthread_mutex_unlock(&log->lock);
+            TakeSnapshot(log);
+            pthread_mutex_lock(&log->lock);
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
@@ -0,0 +1,56 @@
+#ifndef _SEAT_LOG_H_
+#define _SEAT_LOG_H_
+
+#include <stdint.h>
+
+#include "seats.h"
+
+/*
+seat_log makes seat state durable.  Every seat transition is appended to a write-ahead log as a small fixed-size
+record holding the seat and its new word; a record only describes the state the seat moved to, so records can be
+replayed any number of times.
+
+Appending only copies the record into a buffer in memory.  A flusher thread writes the buffer out and makes it
+durable with one fdatasync(), so all the transitions appended while it waits for the disk (or during the batch
+window before it starts) share a single write and a single sync: group commit.  A request that must not be answered
+before its transition is durable, such as a confirmation, waits for the flusher with seat_log_wait, so its latency
+is bounded by the batch window plus one sync.
+
+Once the log holds SEAT_LOG_SNAPSHOT_RECORDS records, the flusher writes a snapshot of the whole seat table (one
+word per seat) to a temporary file, syncs it, renames it over the previous snapshot and empties the log.  Recovery
+loads the snapshot and replays the log on top of it, so it reads at most one table and one bounded log.  A crash
+at any point leaves either the old snapshot and the full log, or the new snapshot and a log whose records are
+already in it; either way replaying gives the same table.
+
+If a write or sync fails, the log is cut back to the end of the last batch that was synced and is marked failed.
+Nothing more is written to it, since after a failed sync the kernel may have dropped the unwritten pages and a
+retried sync would report success for data that never reached the disk.  Waiters for records that were not synced
+are told so, and the server carries on without durability.
+*/
+
+//The log is compacted into a snapshot once it holds this many records
+#define SEAT_LOG_SNAPSHOT_RECORDS 65536
+
+typedef struct seat_log_t seat_log_t;
+
+//Opens the log and snapshot in directory (seats.log and seats.snap), creating them if they do not exist
+//Calls recover for each word in the snapshot and then for each record in the log, in the order they were written.
+//A record that was torn by a crash ends the log, and is removed
+//seats and count are the table that snapshots are taken of.  batchWindow is how many milliseconds the flusher
+//waits for more records before it starts a write
+//Returns NULL if the files could not be opened
+seat_log_t* seat_log_open(const char* directory, seat_t* seats, int count, int batchWindow,
+        void (*recover)(int seat_id, uint64_t word));
+
+//Writes out everything that has been appended, stops the flusher and closes the files
+void seat_log_close(seat_log_t* log);
+
+//Appends a transition of seat_id to word
+//Returns the record's sequence number, to pass to seat_log_wait
+uint64_t seat_log_append(seat_log_t* log, int seat_id, uint64_t word);
+
+//Sleeps until the record with sequence number lsn (and so every record before it) is durable
+//Returns 0 once it is, or -1 if the log failed first and the record never will be
+int seat_log_wait(seat_log_t* log, uint64_t lsn);
+
+#endif
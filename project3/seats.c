@@ -1,73 +1,243 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "seats.h"
+#include "timer_wheel.h"
+#include "seat_log.h"
+#include "seat_events.h"
+
+//Resolution of hold expiry, in milliseconds
+#define HOLD_TICK 100
+
+//Milliseconds the seat log waits for more transitions before it writes a batch
+#define LOG_BATCH_WINDOW 2
 
 //The seat list is a fixed size array
 seat_t* seat_list = NULL;
 int number_of_seats;
 
-char seat_state_to_char(seat_state_t);
+//Holds (PENDING seats) are released after hold_timeout milliseconds by a timer wheel.  Each seat has its own timer,
+//which is rescheduled every time the seat is held, so the wheel never holds more timers than there are seats
+static timer_wheel_t* hold_wheel = NULL;
+static wheel_timer_t* hold_timers = NULL;
+static long hold_timeout = 0;
+
+//One bit per seat, set while the seat is AVAILABLE, so that a search for free seats reads 64 seats per load instead of
+//one.  Bits past the last seat are never set
+static _Atomic uint64_t* free_map = NULL;
+
+//list_seats() renders the table once and from then on patches the rendering: a seat's state character is always at
+//the same offset, so a transition changes one byte.  Transitions mark their seat in dirty_map and bump seat_version,
+//and list_seats() rewrites the dirty seats' bytes and notes the version it has caught up to in render_version.  A
+//poll with no transitions since the last one hands back the buffer as it is
+static char* seat_render = NULL;
+static int seat_render_length = 0;
+static _Atomic uint64_t* dirty_map = NULL;
+static _Atomic uint64_t seat_version;
+static _Atomic uint64_t render_version;
+static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Number of words in free_map and dirty_map
+static int map_words = 0;
+
+//Write-ahead log of seat transitions, or NULL if seat state is not kept across restarts
+static seat_log_t* seat_log = NULL;
+
+
+//The customer_id and state of each seat are packed into one word: the customer_id in the high 32 bits and the state
+//in the low bits, with a generation count in between that goes up with every transition.  Readers take a snapshot of
+//the word with a single atomic load, and writers move a seat from one state to the next with a compare-and-swap
+//against the snapshot they based their decision on.  If another thread changed the seat in between, the
+//compare-and-swap fails, hands back the new value, and the decision is made again.
+//Nothing ever blocks, and a request that is turned away does not write to the seat at all
+//The position in the array is the seat_id.  The structure of the array is fixed, so it doesn't need any sort of synchronization
+//A hold's expiry timer carries the word the hold was made with, and only releases the seat if the word is still
+//exactly that.  Without the generation, a seat that was cancelled and held again by the same customer would look the
+//same as the old hold, and the old hold's timer would release the new one.  The generation also orders the records
+//of the seat log, which may be appended in a different order than the transitions were made
+#define SEAT_STATE_MASK 3
+#define SEAT_GENERATION_SHIFT 2
+#define SEAT_GENERATION_MASK 0x3fffffff
+
+//Packs a state, customer_id and generation into a seat word
+static inline uint64_t PackSeat(seat_state_t state, int customer_id, unsigned int generation);
 
+//Unpack a seat word
+static inline seat_state_t SeatState(uint64_t word);
+static inline int SeatCustomer(uint64_t word);
+static inline unsigned int SeatGeneration(uint64_t word);
 
-//The customer_id and state of each seat are synchronized using a solution to the readers-writer problem
-//Multiple people can read, only one can write
-//Writer must wait until there are no readers before writinh
-//The position in the array is the seat_id.  The structure of the array is fixed, so it doesn't need any sort of synchronization
+//Returns true if a seat word is from a later transition than another word for the same seat
+static inline int IsNewerSeat(uint64_t word, uint64_t than);
+
+//Records a transition in the seat log, if there is one
+//Returns the record's sequence number, or 0 if there is no log
+static inline uint64_t LogTransition(int seat_id, uint64_t word);
+
+//Called after every transition.  Brings the seat's bit in free_map up to date, marks it dirty in the rendered list,
+//bumps the table's version and publishes the transition to seat_events subscribers
+static void NoteTransition(int seat_id);
+
+//Brings a seat's bit in free_map up to date
+static void SyncFreeBit(int seat_id);
+
+//Returns the offset of a seat's state character in the rendered list
+static inline int RenderOffset(int seat_id);
+
+//Renders the whole list into seat_render
+static void RenderSeats();
+
+//Returns the index of the lowest bit of the first run of count set bits in word, or -1 if there is none
+static inline int FindRunInWord(uint64_t word, int count);
 
-//Readers call StartRead and EndRead to indicate the beginning and end, repectively, of a section of code
-//that reads the state or customer_id of a seat
-static void StartRead(seat_t* seat);
-static void EndRead(seat_t* seat);
+//seat_log recovery callback.  Keeps the word if it is newer than what the seat holds
+static void RecoverSeat(int seat_id, uint64_t word);
 
-// Writers call StartWrite and EndWrite to indicate the beginning and end, respectively, or a section of code
-//that writes to the state or customer_id of a seat
-static void StartWrite(seat_t* seat);
-static void EndWrite(seat_t* seat);
+//Timer wheel callback.  Returns a seat to AVAILABLE if it is still in the hold that scheduled the timer
+static void ExpireHold(wheel_timer_t* timer);
 
-void list_seats(char* buf, int bufsize)
+//Starts the expiry of a hold this thread just installed, if there is a wheel.  The thread may have been overtaken
+//since the compare-and-swap (the hold cancelled and the seat held again, with its own timer), so the timer is only
+//scheduled if the seat is still in that hold
+static void ScheduleHold(int seat_id, uint64_t held);
+
+//Puts a seat whose confirmation could not be logged back into the hold it was confirmed from, so that memory agrees
+//with what the customer was told and they can confirm again.  Leaves the seat alone if it has changed since
+static void UndoConfirm(int seat_id, uint64_t occupied);
+
+//timer_wheel_schedule_if check for ScheduleHold.  Returns true if the timer's seat still holds the word
+static int IsHoldCurrent(wheel_timer_t* timer, uint64_t held);
+
+//Returns true if a seat whose word is word may move to state for customer_id: the rules of view_seat for PENDING and
+//of confirm_seat for OCCUPIED
+static inline int CanMoveSeat(uint64_t word, int customer_id, seat_state_t state);
+
+//Moves every seat in seat_ids, which are sorted and distinct, to state for customer_id, with one compare-and-swap
+//each in ascending order.  installed receives the new words.  The transitions are only noted (published, marked
+//dirty and counted in free_map) once the whole group has moved, so list_seats, find_seats and seat_events
+//subscribers never see part of a group
+//Returns -1 if every seat moved.  Otherwise puts back the seats that had moved and returns the index of the first
+//seat that could not, whose current word is left in installed
+static int MoveSeats(const int* seat_ids, int count, int customer_id, seat_state_t state, uint64_t* installed);
+
+//Sorts a batch of seat ids and drops duplicates
+//Returns the number of ids left, or -1 if one of them is not a seat
+static int PrepareBatch(int* seat_ids, int count);
+
+//Writes the batch's seat ids to buf after prefix, followed by suffix
+static void FormatBatch(char* buf, int bufsize, const char* prefix, const int* seat_ids, int count,
+        const char* suffix);
+
+//qsort comparison for seat ids
+static int CompareSeatIds(const void* a, const void* b);
+
+//Atomically replaces the seat's word with desired if it still equals *observed
+//Returns true on success.  On failure *observed is updated to the seat's current word
+static inline int UpdateSeat(seat_t* seat, uint64_t* observed, uint64_t desired);
+
+const char* list_seats(int* length)
 {
-    seat_t* curr;
-    int index = 0;
-    int seat_id = 0;
-    for(curr = seat_list; curr < seat_list + number_of_seats && index < bufsize + strlen("%d %c,"); curr++) {
-        //Mark that we are reading when we get the seat state
-        StartRead(curr);
-        int length = snprintf(buf+index, bufsize-index,
-                "%d %c,", seat_id, seat_state_to_char(curr->state));
-        EndRead(curr);
+    //A transition marks its seat dirty before it bumps the version, so once the seats found dirty after reading the
+    //version are patched, the rendering is at least as new as that version
+    uint64_t version = atomic_load(&seat_version);
+    if(atomic_load(&render_version) < version) {
+        pthread_mutex_lock(&render_lock);
+        if(atomic_load(&render_version) < version) {
+            int i;
+            for(i = 0; i < map_words; i++) {
+                if(atomic_load_explicit(&dirty_map[i], memory_order_relaxed) == 0)
+                    continue;
+                uint64_t dirty = atomic_exchange(&dirty_map[i], 0);
+                while(dirty != 0) {
+                    int seat_id = i * 64 + __builtin_ctzll(dirty);
+                    dirty &= dirty - 1;
+                    //Responses may be being sent from the buffer, so each byte is replaced in one store
+                    uint64_t word = atomic_load_explicit(&seat_list[seat_id].word, memory_order_acquire);
+                    atomic_store_explicit((_Atomic char*)&seat_render[RenderOffset(seat_id)],
+                            seat_state_to_char(SeatState(word)), memory_order_relaxed);
+                }
+            }
+            atomic_store(&render_version, version);
+        }
+        pthread_mutex_unlock(&render_lock);
+    }
+
+    *length = seat_render_length;
+    return seat_render;
+}
+
+seat_state_t seat_state(int seat_id)
+{
+    return SeatState(atomic_load_explicit(&seat_list[seat_id].word, memory_order_acquire));
+}
 
-        if (length > 0)
-            index = index + length;
-        seat_id++;
+void find_seats(char* buf, int bufsize, int count)
+{
+    if(count <= 0 || count > number_of_seats) {
+        snprintf(buf, bufsize, "No block of %d seats available\n\n", count);
+        return;
     }
 
-    if (index > 0)
-        snprintf(buf+index-1, bufsize-index-1, "\n");
-    else
-        snprintf(buf, bufsize, "No seats not found\n\n");
+    //run is the number of free seats that end the words scanned so far, and carries a run across word boundaries
+    int run = 0;
+    int i;
+    for(i = 0; i < map_words; i++) {
+        uint64_t bits = atomic_load_explicit(&free_map[i], memory_order_relaxed);
+        int start = -1;
+        if(bits == 0) {
+            run = 0;
+            continue;
+        } else if(bits == ~0ULL) {
+            run += 64;
+            if(run >= count)
+                start = i * 64 + 64 - run;
+        } else {
+            //A run that carries on into the low bits of this word, then one that lies inside it, then the start of
+            //one that carries on into the next word
+            if(run + __builtin_ctzll(~bits) >= count) {
+                start = i * 64 - run;
+            } else if(count <= 64) {
+                int offset = FindRunInWord(bits, count);
+                if(offset >= 0)
+                    start = i * 64 + offset;
+            }
+            run = __builtin_clzll(~bits);
+        }
+        if(start >= 0) {
+            snprintf(buf, bufsize, "Seats available: %d-%d\n\n", start, start + count - 1);
+            return;
+        }
+    }
+    snprintf(buf, bufsize, "No block of %d seats available\n\n", count);
 }
 
 void view_seat(char* buf, int bufsize,  int seat_id, int customer_id, int customer_priority)
 {
-    if(seat_id < number_of_seats) {
+    if(seat_id >= 0 && seat_id < number_of_seats) {
         seat_t* curr = &seat_list[seat_id];
-        //Mark that we are writing since we will update the seat state and customer id
-        StartWrite(curr);
-        if(curr->state == AVAILABLE || (curr->state == PENDING && curr->customer_id == customer_id))
-
-        {
-            snprintf(buf, bufsize, "Confirm seat: %d %c ?\n\n",
-                    seat_id, seat_state_to_char(curr->state));
-            curr->state = PENDING;
-            curr->customer_id = customer_id;
+        uint64_t word = atomic_load_explicit(&curr->word, memory_order_acquire);
+        while(1) {
+            seat_state_t state = SeatState(word);
+            if(state == AVAILABLE || (state == PENDING && SeatCustomer(word) == customer_id))
+            {
+                //Hold the seat for this customer.  Holding it again starts a new hold, with a new expiry
+                uint64_t held = PackSeat(PENDING, customer_id, SeatGeneration(word) + 1);
+                if(!UpdateSeat(curr, &word, held))
+                    continue;
+                NoteTransition(seat_id);
+                LogTransition(seat_id, held);
+                ScheduleHold(seat_id, held);
+                snprintf(buf, bufsize, "Confirm seat: %d %c ?\n\n",
+                        seat_id, seat_state_to_char(state));
+            }
+            else
+            {
+                snprintf(buf, bufsize, "Seat unavailable\n\n");
+            }
+            break;
         }
-        else
-        {
-            snprintf(buf, bufsize, "Seat unavailable\n\n");
-        }
-        EndWrite(curr);
 
         return;
     } else {
@@ -79,34 +249,48 @@ void view_seat(char* buf, int bufsize,  int seat_id, int customer_id, int custom
 
 }
 
-void confirm_seat(char* buf, int bufsize, int seat_id, int customer_id, int customer_priority)
+int confirm_seat(char* buf, int bufsize, int seat_id, int customer_id, int customer_priority)
 {
+    int result = 0;
 
-    if(seat_id < number_of_seats) {
+    if(seat_id >= 0 && seat_id < number_of_seats) {
         seat_t* curr = &seat_list[seat_id];
-
-        //Mark that we are writing because we will change the seat state
-        StartWrite(curr);
-        if(curr->state == PENDING && curr->customer_id == customer_id )
-        {
-            snprintf(buf, bufsize, "Seat confirmed: %d %c\n\n",
-                    seat_id, seat_state_to_char(curr->state));
-            curr->state = OCCUPIED;
+        uint64_t word = atomic_load_explicit(&curr->word, memory_order_acquire);
+        while(1) {
+            seat_state_t state = SeatState(word);
+            if(state == PENDING && SeatCustomer(word) == customer_id)
+            {
+                uint64_t occupied = PackSeat(OCCUPIED, customer_id, SeatGeneration(word) + 1);
+                if(!UpdateSeat(curr, &word, occupied))
+                    continue;
+                NoteTransition(seat_id);
+                //The customer is only told once the confirmation would survive a crash
+                uint64_t lsn = LogTransition(seat_id, occupied);
+                if(lsn != 0 && seat_log_wait(seat_log, lsn) < 0)
+                {
+                    UndoConfirm(seat_id, occupied);
+                    snprintf(buf, bufsize, "Seat confirmation could not be saved: %d\n\n", seat_id);
+                    result = -1;
+                    break;
+                }
+                snprintf(buf, bufsize, "Seat confirmed: %d %c\n\n",
+                        seat_id, seat_state_to_char(state));
+            }
+            else if(SeatCustomer(word) != customer_id)
+            {
+                snprintf(buf, bufsize, "Permission denied - seat held by another user\n\n");
+            }
+            else
+            {
+                snprintf(buf, bufsize, "No pending request\n\n");
+            }
+            break;
         }
-        else if(curr->customer_id != customer_id )
-        {
-            snprintf(buf, bufsize, "Permission denied - seat held by another user\n\n");
-        }
-        else if(curr->state != PENDING)
-        {
-            snprintf(buf, bufsize, "No pending request\n\n");
-        }
-        EndWrite(curr);
 
-        return;
+        return result;
     } else {
         snprintf(buf, bufsize, "Requested seat not found\n\n");
-        return;
+        return result;
 
     }
 
@@ -114,25 +298,33 @@ void confirm_seat(char* buf, int bufsize, int seat_id, int customer_id, int cust
 
 void cancel(char* buf, int bufsize, int seat_id, int customer_id, int customer_priority)
 {
-    if(seat_id < number_of_seats) {
+    if(seat_id >= 0 && seat_id < number_of_seats) {
         seat_t* curr = &seat_list[seat_id];
-        //Mark that we are writing since we are changing the seat state
-        StartWrite(curr);
-        if(curr->state == PENDING && curr->customer_id == customer_id )
-        {
-            snprintf(buf, bufsize, "Seat request cancelled: %d %c\n\n",
-                    seat_id, seat_state_to_char(curr->state));
-            curr->state = AVAILABLE;
-        }
-        else if(curr->customer_id != customer_id )
-        {
-            snprintf(buf, bufsize, "Permission denied - seat held by another user\n\n");
-        }
-        else if(curr->state != PENDING)
-        {
-            snprintf(buf, bufsize, "No pending request\n\n");
+        uint64_t word = atomic_load_explicit(&curr->word, memory_order_acquire);
+        while(1) {
+            seat_state_t state = SeatState(word);
+            if(state == PENDING && SeatCustomer(word) == customer_id)
+            {
+                //The customer_id is kept, as it always has been, so later requests see who last held the seat
+                //The hold's timer is left to fire: the seat no longer matches it, so it does nothing
+                uint64_t available = PackSeat(AVAILABLE, customer_id, SeatGeneration(word) + 1);
+                if(!UpdateSeat(curr, &word, available))
+                    continue;
+                NoteTransition(seat_id);
+                LogTransition(seat_id, available);
+                snprintf(buf, bufsize, "Seat request cancelled: %d %c\n\n",
+                        seat_id, seat_state_to_char(state));
+            }
+            else if(SeatCustomer(word) != customer_id)
+            {
+                snprintf(buf, bufsize, "Permission denied - seat held by another user\n\n");
+            }
+            else
+            {
+                snprintf(buf, bufsize, "No pending request\n\n");
+            }
+            break;
         }
-        EndWrite(curr);
 
         return;
 
@@ -142,8 +334,75 @@ void cancel(char* buf, int bufsize, int seat_id, int customer_id, int customer_p
     }
 }
 
-//Initialize the array of seats
-void load_seats(int number_of_seats_to_load)
+void view_seats(char* buf, int bufsize, int* seat_ids, int count, int customer_id, int customer_priority)
+{
+    if(count > SEATS_MAX_BATCH) {
+        snprintf(buf, bufsize, "Too many seats requested\n\n");
+        return;
+    }
+    count = PrepareBatch(seat_ids, count);
+    if(count <= 0) {
+        snprintf(buf, bufsize, "Requested seat not found\n\n");
+        return;
+    }
+
+    uint64_t held[SEATS_MAX_BATCH];
+    int failed = MoveSeats(seat_ids, count, customer_id, PENDING, held);
+    if(failed >= 0) {
+        snprintf(buf, bufsize, "Seat unavailable: %d\n\n", seat_ids[failed]);
+        return;
+    }
+
+    //Nothing is logged or timed until the whole group is held, so a group that was turned away leaves no trace
+    int i;
+    for(i = 0; i < count; i++) {
+        LogTransition(seat_ids[i], held[i]);
+        ScheduleHold(seat_ids[i], held[i]);
+    }
+    FormatBatch(buf, bufsize, "Confirm seats:", seat_ids, count, " ?\n\n");
+}
+
+int confirm_seats(char* buf, int bufsize, int* seat_ids, int count, int customer_id, int customer_priority)
+{
+    if(count > SEATS_MAX_BATCH) {
+        snprintf(buf, bufsize, "Too many seats requested\n\n");
+        return 0;
+    }
+    count = PrepareBatch(seat_ids, count);
+    if(count <= 0) {
+        snprintf(buf, bufsize, "Requested seat not found\n\n");
+        return 0;
+    }
+
+    uint64_t occupied[SEATS_MAX_BATCH];
+    int failed = MoveSeats(seat_ids, count, customer_id, OCCUPIED, occupied);
+    if(failed >= 0) {
+        if(SeatCustomer(occupied[failed]) != customer_id)
+            snprintf(buf, bufsize, "Permission denied - seat %d held by another user\n\n", seat_ids[failed]);
+        else
+            snprintf(buf, bufsize, "No pending request: %d\n\n", seat_ids[failed]);
+        return 0;
+    }
+
+    //The records of a group share a sync, so waiting for the last one waits for them all
+    uint64_t lsn = 0;
+    int i;
+    for(i = 0; i < count; i++) {
+        lsn = LogTransition(seat_ids[i], occupied[i]);
+    }
+    if(lsn != 0 && seat_log_wait(seat_log, lsn) < 0) {
+        for(i = 0; i < count; i++) {
+            UndoConfirm(seat_ids[i], occupied[i]);
+        }
+        FormatBatch(buf, bufsize, "Seat confirmation could not be saved:", seat_ids, count, "\n\n");
+        return -1;
+    }
+    FormatBatch(buf, bufsize, "Seats confirmed:", seat_ids, count, "\n\n");
+    return 0;
+}
+
+//Initialize the array of seats, and recover their state if they are logged
+void load_seats(int number_of_seats_to_load, int hold_timeout_seconds, const char* log_directory)
 {
     number_of_seats = number_of_seats_to_load;
 
@@ -152,29 +411,76 @@ void load_seats(int number_of_seats_to_load)
     int i;
     for(i = 0; i < number_of_seats; i++)
     {
-        seat_t* current_seat = &seat_list[i];
-        current_seat->customer_id = -1;
-        current_seat->state = AVAILABLE;
+        atomic_init(&seat_list[i].word, PackSeat(AVAILABLE, -1, 0));
+    }
 
-        //Initialize the write semaphore to 1, the mutex lock, and the number of readers to 0
-        pthread_mutexattr_t mutexAttributes;
-        pthread_mutexattr_init(&mutexAttributes);
-        pthread_mutex_init(&current_seat->num_readers_lock, &mutexAttributes);
+    if(log_directory != NULL)
+    {
+        seat_log = seat_log_open(log_directory, seat_list, number_of_seats, LOG_BATCH_WINDOW, &RecoverSeat);
+        if(seat_log == NULL)
+            fprintf(stderr, "Seat state will not be kept across restarts\n");
+    }
 
-        current_seat->num_readers = 0;
+    map_words = (number_of_seats + 63) / 64;
+    free_map = malloc(sizeof(uint64_t) * map_words);
+    for(i = 0; i < map_words; i++)
+    {
+        atomic_init(&free_map[i], 0);
+    }
+    for(i = 0; i < number_of_seats; i++)
+    {
+        if(SeatState(atomic_load(&seat_list[i].word)) == AVAILABLE)
+            atomic_fetch_or(&free_map[i / 64], 1ULL << (i % 64));
+    }
 
-        sem_init(&current_seat->writer_lock, 0, 1);
+    dirty_map = malloc(sizeof(uint64_t) * map_words);
+    for(i = 0; i < map_words; i++)
+    {
+        atomic_init(&dirty_map[i], 0);
+    }
+    atomic_init(&seat_version, 0);
+    atomic_init(&render_version, 0);
+    RenderSeats();
+
+    if(hold_timeout_seconds > 0)
+    {
+        hold_timeout = hold_timeout_seconds * 1000L;
+        hold_timers = malloc(sizeof(wheel_timer_t) * number_of_seats);
+        for(i = 0; i < number_of_seats; i++)
+        {
+            wheel_timer_init(&hold_timers[i], &ExpireHold);
+        }
+        hold_wheel = timer_wheel_create(HOLD_TICK);
+
+        //Holds recovered from the log get a full hold timeout from now
+        for(i = 0; i < number_of_seats; i++)
+        {
+            uint64_t word = atomic_load(&seat_list[i].word);
+            if(SeatState(word) == PENDING)
+                timer_wheel_schedule(hold_wheel, &hold_timers[i], hold_timeout, word);
+        }
     }
 }
 
 void unload_seats()
 {
-    int i;
-    for(i = 0; i < number_of_seats; i++) {
-        seat_t* current_seat = &seat_list[i];
-        pthread_mutex_destroy(&current_seat->num_readers_lock);
-        sem_destroy(&current_seat->writer_lock);
+    //Stop the wheel first, so that no timer fires on a freed seat
+    if(hold_wheel != NULL)
+    {
+        timer_wheel_destroy(hold_wheel);
+        hold_wheel = NULL;
+        free(hold_timers);
+        hold_timers = NULL;
     }
+    //Then the log, which writes out the last transitions, including any the wheel just made
+    if(seat_log != NULL)
+    {
+        seat_log_close(seat_log);
+        seat_log = NULL;
+    }
+    free(seat_render);
+    free(dirty_map);
+    free(free_map);
     free(seat_list);
 }
 
@@ -193,31 +499,236 @@ char seat_state_to_char(seat_state_t state)
     return '0';
 }
 
-static void StartRead(seat_t* seat) {
-    pthread_mutex_lock(&seat->num_readers_lock);
-    seat->num_readers++;
-    if(seat->num_readers == 1) {
-        //If we are the first reader, wait until the writer is done and prevent more writing
-        sem_wait(&seat->writer_lock);
+static inline uint64_t PackSeat(seat_state_t state, int customer_id, unsigned int generation) {
+    return ((uint64_t)(uint32_t)customer_id << 32) |
+            ((uint64_t)(generation & SEAT_GENERATION_MASK) << SEAT_GENERATION_SHIFT) | state;
+}
+
+static inline seat_state_t SeatState(uint64_t word) {
+    return (seat_state_t)(word & SEAT_STATE_MASK);
+}
+
+static inline int SeatCustomer(uint64_t word) {
+    return (int)(uint32_t)(word >> 32);
+}
+
+static inline unsigned int SeatGeneration(uint64_t word) {
+    return (word >> SEAT_GENERATION_SHIFT) & SEAT_GENERATION_MASK;
+}
+
+static void ExpireHold(wheel_timer_t* timer) {
+    seat_t* seat = &seat_list[timer - hold_timers];
+    uint64_t held = timer->data;
+
+    //A strong compare-and-swap, since this is the only attempt.  It fails if the seat was confirmed, cancelled or
+    //held again since, and those all leave the seat as they should be
+    uint64_t released = PackSeat(AVAILABLE, SeatCustomer(held), SeatGeneration(held) + 1);
+    if(atomic_compare_exchange_strong(&seat->word, &held, released)) {
+        NoteTransition(seat - seat_list);
+        LogTransition(seat - seat_list, released);
+    }
+}
+
+static void ScheduleHold(int seat_id, uint64_t held) {
+    if(hold_wheel != NULL)
+        timer_wheel_schedule_if(hold_wheel, &hold_timers[seat_id], hold_timeout, held, &IsHoldCurrent);
+}
+
+static void UndoConfirm(int seat_id, uint64_t occupied) {
+    //The confirmation replaced the hold one generation before it.  Putting back that exact word also keeps the
+    //hold's timer valid; if the timer fired while the seat was confirmed, it is scheduled again
+    uint64_t held = PackSeat(PENDING, SeatCustomer(occupied), SeatGeneration(occupied) - 1);
+    uint64_t expected = occupied;
+    if(!atomic_compare_exchange_strong(&seat_list[seat_id].word, &expected, held))
+        return;
+    NoteTransition(seat_id);
+    ScheduleHold(seat_id, held);
+}
+
+static int IsHoldCurrent(wheel_timer_t* timer, uint64_t held) {
+    return atomic_load(&seat_list[timer - hold_timers].word) == held;
+}
+
+static void NoteTransition(int seat_id) {
+    SyncFreeBit(seat_id);
+
+    //The bit may already be set by another transition that list_seats() has not caught up with yet.  Whenever it
+    //does, it reads the seat's word after clearing the bit, and so sees this transition too
+    _Atomic uint64_t* dirty = &dirty_map[seat_id / 64];
+    uint64_t mask = 1ULL << (seat_id % 64);
+    if(!(atomic_load(dirty) & mask))
+        atomic_fetch_or(dirty, mask);
+    atomic_fetch_add(&seat_version, 1);
+    seat_events_publish(seat_id);
+}
+
+static void SyncFreeBit(int seat_id) {
+    //Several transitions of one seat may sync its bit in any order, so each sync sets the bit from the word as it
+    //is now, and goes again if the word changed while it did.  Whichever sync writes the bit last saw the word
+    //unchanged after its write, and any later transition syncs again, so the bit always ends up right
+    _Atomic uint64_t* bits = &free_map[seat_id / 64];
+    uint64_t mask = 1ULL << (seat_id % 64);
+    uint64_t word = atomic_load(&seat_list[seat_id].word);
+    while(1) {
+        //Only write when the bit is wrong, so that neighbouring seats do not fight over the map word for nothing
+        int available = SeatState(word) == AVAILABLE;
+        if(available && !(atomic_load(bits) & mask))
+            atomic_fetch_or(bits, mask);
+        else if(!available && (atomic_load(bits) & mask))
+            atomic_fetch_and(bits, ~mask);
+
+        uint64_t now = atomic_load(&seat_list[seat_id].word);
+        if(now == word)
+            return;
+        word = now;
     }
-    pthread_mutex_unlock(&seat->num_readers_lock);
 }
 
-static void EndRead(seat_t* seat) {
-    pthread_mutex_lock(&seat->num_readers_lock);
-    seat->num_readers--;
-    if(seat->num_readers == 0) {
-        //If we finished the last read, signal the writer to begin writing
-        sem_post(&seat->writer_lock);
+static inline int FindRunInWord(uint64_t word, int count) {
+    //Shifting and anding leaves bit i set only where bits i to i+length-1 were all set.  Doubling length each time
+    //(without overshooting count) takes log2(count) steps
+    int length = 1;
+    while(length < count) {
+        int shift = length < count - length ? length : count - length;
+        word &= word >> shift;
+        length += shift;
+    }
+    return word != 0 ? __builtin_ctzll(word) : -1;
+}
+
+static inline int RenderOffset(int seat_id) {
+    //Seat j is rendered as "j S," which is 3 characters plus its digits.  Every seat before seat_id has one digit,
+    //plus one more for each power of ten it has reached
+    int offset = 4 * seat_id;
+    int digits = 1;
+    long power;
+    for(power = 10; power <= seat_id; power *= 10) {
+        offset += seat_id - power;
+        digits++;
+    }
+    //Then come this seat's digits and the space
+    return offset + digits + 1;
+}
+
+static void RenderSeats() {
+    if(number_of_seats <= 0) {
+        seat_render = strdup("No seats not found\n\n");
+        seat_render_length = strlen(seat_render);
+        return;
+    }
+
+    //The last seat ends with a newline instead of a comma
+    seat_render_length = RenderOffset(number_of_seats - 1) + 2;
+    seat_render = malloc(seat_render_length + 1);
+    int index = 0;
+    int i;
+    for(i = 0; i < number_of_seats; i++) {
+        uint64_t word = atomic_load_explicit(&seat_list[i].word, memory_order_relaxed);
+        index += sprintf(seat_render + index, "%d %c,", i, seat_state_to_char(SeatState(word)));
+    }
+    seat_render[seat_render_length - 1] = '\n';
+    seat_render[seat_render_length] = '\0';
+}
+
+static inline int IsNewerSeat(uint64_t word, uint64_t than) {
+    //Generations wrap around, so compare them the way TCP compares sequence numbers
+    unsigned int difference = (SeatGeneration(word) - SeatGeneration(than)) & SEAT_GENERATION_MASK;
+    return difference != 0 && difference <= SEAT_GENERATION_MASK / 2;
+}
+
+static inline uint64_t LogTransition(int seat_id, uint64_t word) {
+    if(seat_log == NULL)
+        return 0;
+    return seat_log_append(seat_log, seat_id, word);
+}
+
+static void RecoverSeat(int seat_id, uint64_t word) {
+    //Nothing else is running yet, so plain loads and stores will do
+    if(IsNewerSeat(word, atomic_load_explicit(&seat_list[seat_id].word, memory_order_relaxed)))
+        atomic_store_explicit(&seat_list[seat_id].word, word, memory_order_relaxed);
+}
+
+static inline int CanMoveSeat(uint64_t word, int customer_id, seat_state_t state) {
+    if(SeatState(word) == PENDING && SeatCustomer(word) == customer_id)
+        return 1;
+    return state == PENDING && SeatState(word) == AVAILABLE;
+}
+
+static int MoveSeats(const int* seat_ids, int count, int customer_id, seat_state_t state, uint64_t* installed) {
+    uint64_t previous[SEATS_MAX_BATCH];
+    int i;
+    for(i = 0; i < count; i++) {
+        seat_t* seat = &seat_list[seat_ids[i]];
+        previous[i] = atomic_load_explicit(&seat->word, memory_order_acquire);
+        int moved = 0;
+        while(!moved && CanMoveSeat(previous[i], customer_id, state)) {
+            installed[i] = PackSeat(state, customer_id, SeatGeneration(previous[i]) + 1);
+            moved = UpdateSeat(seat, &previous[i], installed[i]);
+        }
+        if(!moved) {
+            installed[i] = previous[i];
+            break;
+        }
+    }
+    if(i == count) {
+        for(i = 0; i < count; i++) {
+            NoteTransition(seat_ids[i]);
+        }
+        return -1;
+    }
+
+    //Put back the seats that moved, exactly as they were.  The moves were never logged, timed or noted, so the log,
+    //the rendered list and subscribers never see them.  A request that reads one of the seats directly in the
+    //meantime (view_seat by another customer, say) can still find it moved and be turned away.  While a seat is
+    //moved, only this customer can change it (another request of theirs may have confirmed a seat this batch held),
+    //and then that change stands and notes itself
+    int failed = i;
+    while(--i >= 0) {
+        uint64_t expected = installed[i];
+        if(!atomic_compare_exchange_strong(&seat_list[seat_ids[i]].word, &expected, previous[i]))
+            continue;
+        //An earlier hold's timer may have fired while the seat was moved, and found nothing to release.  Give the
+        //hold a fresh expiry rather than let it last forever
+        if(SeatState(previous[i]) == PENDING)
+            ScheduleHold(seat_ids[i], previous[i]);
+    }
+    return failed;
+}
+
+static int PrepareBatch(int* seat_ids, int count) {
+    int i;
+    for(i = 0; i < count; i++) {
+        if(seat_ids[i] < 0 || seat_ids[i] >= number_of_seats)
+            return -1;
+    }
+
+    //Ascending order means one pass over the table, and makes a duplicate sit next to its twin
+    qsort(seat_ids, count, sizeof(int), &CompareSeatIds);
+    int distinct = 0;
+    for(i = 0; i < count; i++) {
+        if(distinct == 0 || seat_ids[i] != seat_ids[distinct - 1])
+            seat_ids[distinct++] = seat_ids[i];
+    }
+    return distinct;
+}
+
+static void FormatBatch(char* buf, int bufsize, const char* prefix, const int* seat_ids, int count,
+        const char* suffix) {
+    int index = snprintf(buf, bufsize, "%s", prefix);
+    int i;
+    for(i = 0; i < count && index < bufsize; i++) {
+        index += snprintf(buf + index, bufsize - index, " %d", seat_ids[i]);
     }
-    pthread_mutex_unlock(&seat->num_readers_lock);
+    if(index < bufsize)
+        snprintf(buf + index, bufsize - index, "%s", suffix);
 }
 
-static void StartWrite(seat_t* seat) {
-    //Wait for all readers to finish reading and the current writer to finish writing
-    sem_wait(&seat->writer_lock);
+static int CompareSeatIds(const void* a, const void* b) {
+    return *(const int*)a - *(const int*)b;
 }
 
-static void EndWrite(seat_t* seat) {
-    sem_post(&seat->writer_lock);
+static inline int UpdateSeat(seat_t* seat, uint64_t* observed, uint64_t desired) {
+    //A weak compare-and-swap may fail spuriously, but every caller retries anyway
+    return atomic_compare_exchange_weak_explicit(&seat->word, observed, desired, memory_order_acq_rel,
+            memory_order_acquire);
 }
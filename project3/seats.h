@@ -1,5 +1,5 @@
-#include <pthread.h>
-#include <semaphore.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 #ifndef _SEAT_OPERATIONS_H_
 #define _SEAT_OPERATIONS_H_
@@ -11,23 +11,46 @@ typedef enum
     OCCUPIED
 } seat_state_t;
 
+//A seat is a single word holding its state and customer_id, so that it can be read with one atomic load and moved
+//from one state to the next with one compare-and-swap.  seats.c packs and unpacks it
 typedef struct seat_struct
 {
-    int customer_id;
-    seat_state_t state;
-
-    pthread_mutex_t num_readers_lock;
-    int num_readers;
-    sem_t writer_lock;
+    _Atomic uint64_t word;
 } seat_t;
 
+//Most seats a single view_seats or confirm_seats request may name
+#define SEATS_MAX_BATCH 64
+
 
-void load_seats(int);
+//Allocates number_of_seats AVAILABLE seats
+//A seat held by view_seat and neither confirmed nor cancelled goes back to AVAILABLE after hold_timeout_seconds,
+//or never if hold_timeout_seconds is 0
+//If log_directory is not NULL, every transition is logged there and the seats start out as they were when the log
+//was last written.  Confirmations are only answered once they are durable
+void load_seats(int number_of_seats, int hold_timeout_seconds, const char* log_directory);
 void unload_seats();
 
-void list_seats(char* buf, int bufsize);
+//Returns the list of every seat and its state, and sets *length to its length
+//The list belongs to seats.c and is valid until unload_seats().  It is kept up to date in place, so a response that
+//is sent from it may show seats that change while it is sent in their new state, as a seat by seat listing could
+const char* list_seats(int* length);
+//Returns the current state of a seat
+seat_state_t seat_state(int seat_id);
+char seat_state_to_char(seat_state_t state);
+
+//Finds the first block of count adjacent AVAILABLE seats
+void find_seats(char* buf, int bufsize, int count);
 void view_seat(char* buf, int bufsize, int seat_num, int customer_num, int customer_priority);
-void confirm_seat(char* buf, int bufsize, int seat_num, int customer_num, int customer_priority);
+//Returns 0, or -1 if the confirmation could not be made durable (see load_seats).  The seat is then put back in
+//the customer's hold
+int confirm_seat(char* buf, int bufsize, int seat_num, int customer_num, int customer_priority);
 void cancel(char* buf, int bufsize, int seat_num, int customer_num, int customer_priority);
 
+//Group bookings: view_seat and confirm_seat for count seats at once.  Either every seat moves or none of them do
+//seat_ids is sorted in place and duplicates are dropped, and count may be larger than SEATS_MAX_BATCH only to be
+//turned away
+void view_seats(char* buf, int bufsize, int* seat_ids, int count, int customer_num, int customer_priority);
+//confirm_seats returns 0, or -1 as confirm_seat does
+int confirm_seats(char* buf, int bufsize, int* seat_ids, int count, int customer_num, int customer_priority);
+
 #endif
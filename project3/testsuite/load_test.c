@@ -0,0 +1,861 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+load_test replays the same trace files as http_test.py, from a few threads that each drive many connections with
+epoll, and reports latency percentiles.
+
+A trace file has a [configuration] section (threads: the number of simulated users, requests: how many times each
+user runs its trace, sleeptime: seconds a user thinks before each request) and one or more [trace] sections of
+paths, each optionally followed by the exact body expected back.  User i runs trace i modulo the number of traces,
+and a response counts as a success if its status is 200 and its body, without surrounding white space, is the one
+expected.
+
+By default the load is a closed loop, like http_test.py: each user sends a request, waits for the answer, thinks,
+and sends the next.  A closed loop only measures the requests it gets round to sending; while the server stalls,
+the users wait instead of sending the requests they would have sent, so the stall shows up as one slow request
+rather than many (coordinated omission).  When the users think, the closed loop's histogram is also reported
+corrected as HdrHistogram does: a response that took longer than the think time stands in for the requests that
+should have been sent meanwhile, with their latencies.
+
+With -r the load is an open loop at a fixed arrival rate: requests are due at evenly spaced times whatever the
+server does, wait for a free connection if every one is busy, and their latency is measured from when they were
+due rather than from when they were sent.  Stalls and queueing are then counted in full, without correction.
+
+Histograms are log-linear, like HdrHistogram: SUB_BUCKETS buckets for every power of two of microseconds, so every
+percentile is within 1/SUB_BUCKETS of the true value.
+*/
+
+//Sub-buckets per power of two, and the largest latency recorded, as a power of two of microseconds (about 19 hours)
+#define SUB_BUCKET_BITS 7
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define MAX_BITS 36
+#define BUCKETS (SUB_BUCKETS * (MAX_BITS - SUB_BUCKET_BITS + 1))
+
+//Longest line in a trace file
+#define LINE_SIZE 1024
+
+//Bytes read from a socket at a time
+#define READ_CHUNK 16384
+
+//epoll events handled per call
+#define MAX_EVENTS 256
+
+#define DEFAULT_THREADS 2
+
+typedef struct {
+    char* path;
+    char* expected; //Body the response must have, or NULL if any body will do
+} request_t;
+
+typedef struct {
+    request_t* requests;
+    int count;
+} trace_t;
+
+typedef struct {
+    uint64_t counts[BUCKETS];
+    uint64_t total;
+    uint64_t max;
+    double sum;
+} histogram_t;
+
+typedef enum {
+    CLIENT_IDLE,            //No request in flight.  The socket, if open, is kept alive for the next one
+    CLIENT_CONNECTING,
+    CLIENT_SENDING,
+    CLIENT_RECEIVING
+} client_state_t;
+
+struct worker_t;
+
+//One connection to the server, and the request it is carrying
+typedef struct client_t {
+    struct worker_t* worker;
+    int index; //Position in the worker's clients
+    int fd; //-1 when closed
+    unsigned int generation; //Counts the sockets the client has opened, so events for a closed one are ignored
+    client_state_t state;
+
+    //In a closed loop, the user the client belongs to, and how far through its trace the user is
+    const trace_t* trace;
+    long sent;
+    long limit; //Requests the user makes in all
+    long ready_at; //Time the user has finished thinking
+
+    const request_t* request;
+    long due; //Time latency is measured from: when the request was sent (closed loop) or due (open loop)
+
+    char out[LINE_SIZE + 256];
+    int out_length;
+    int out_sent;
+
+    char* in;
+    int in_length;
+    int in_capacity;
+    int head_length; //Length of the response head including the blank line, 0 until it has all arrived
+    long content_length; //-1 if the response has no Content-Length and ends when the server closes
+
+    struct client_t* next; //Next in the worker's queue of users thinking or connections free
+} client_t;
+
+typedef struct worker_t {
+    pthread_t thread;
+    int epoll_fd;
+
+    client_t* clients;
+    int client_count;
+
+    //Clients with nothing in flight, oldest first.  In a closed loop they are users thinking, in ready_at order
+    //because every user thinks for the same time; in an open loop they are free connections
+    client_t* queue_head;
+    client_t* queue_tail;
+
+    //Open loop.  The worker's requests in the order they are due, one every interval microseconds from start
+    const request_t** schedule;
+    double interval;
+    long scheduled; //Requests in the schedule that have been started
+
+    long total; //Requests the worker makes
+    long completed; //Requests answered or failed
+    long successes;
+    long failures;
+    long errors; //Failures for which no response was received at all, which are not in the histograms
+    histogram_t latency;
+    histogram_t corrected;
+} worker_t;
+
+//Settings shared by every worker
+static struct addrinfo* server;
+static const char* host_header;
+static long start;
+static long think; //Microseconds each user thinks before a request
+static int open_loop;
+static int keep_alive;
+
+//Parses a trace file into its configuration and its traces
+//Returns 0 on success, -1 if the file could not be read
+static int ReadTrace(const char* fileName, int* users, int* requests, double* sleeptime, char* type, trace_t** traces,
+        int* traceCount);
+
+//Removes white space from both ends of a string, in place
+static char* Strip(char* text);
+
+//Runs one worker until all its requests have been answered
+static void* RunWorker(void* workerArg);
+
+//Starts the requests that are due and returns how many milliseconds until the next one is, -1 if none is pending
+static int StartDueRequests(worker_t* worker);
+
+//Sends a request on a client, opening a new connection if it has none
+static void StartRequest(client_t* client, const request_t* request, long due);
+
+//Moves a client's request along as far as its socket allows
+static void Progress(client_t* client, int events);
+
+//Receives what is available of a response
+//Returns 1 once the response is complete, 0 if more is to come, -1 if the connection failed
+static int Receive(client_t* client);
+
+//Accounts for a client's request and frees the client for its next one.  response is false if the request failed
+//before a response arrived
+static void FinishRequest(client_t* client, int response);
+
+//Closes a client's socket
+static void CloseClient(client_t* client);
+
+//Adds a client to the tail of its worker's queue
+static void Enqueue(worker_t* worker, client_t* client);
+
+//Records a latency in microseconds
+static void Record(histogram_t* histogram, long value);
+
+//Adds every count of one histogram to another
+static void Merge(histogram_t* into, const histogram_t* from);
+
+//Prints a histogram's mean, percentiles and maximum
+static void PrintHistogram(const histogram_t* histogram);
+
+//Returns the bucket a value goes in, and the largest value that goes in a bucket
+static inline int BucketIndex(uint64_t value);
+static inline uint64_t BucketValue(int index);
+
+//Returns the current time in microseconds from a clock that never jumps
+static long Now();
+
+void usage(char* program)
+{
+    fprintf(stderr, "usage: %s [-t threads] [-r rate [-c connections]] [-n requests] [-k] host port trace_file\n"\
+            "  -t  threads driving the connections (default %d)\n"\
+            "  -r  open loop at rate requests a second, instead of a closed loop\n"\
+            "  -c  connections the open loop may use (default: the trace's number of users)\n"\
+            "  -n  times each user runs its trace, instead of the trace's requests\n"\
+            "  -k  keep connections alive between requests instead of opening one per request\n",
+            program, DEFAULT_THREADS);
+    exit(1);
+}
+
+int main(int argc, char* argv[])
+{
+    int threads = DEFAULT_THREADS;
+    double rate = 0;
+    int connections = 0;
+    int repeat = 0;
+
+    int option;
+    while ((option = getopt(argc, argv, "t:r:c:n:k")) != -1)
+    {
+        switch (option)
+        {
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'r':
+                rate = atof(optarg);
+                open_loop = 1;
+                break;
+            case 'c':
+                connections = atoi(optarg);
+                break;
+            case 'n':
+                repeat = atoi(optarg);
+                break;
+            case 'k':
+                keep_alive = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 3 || threads <= 0 || (open_loop && rate <= 0) || connections < 0 || repeat < 0)
+    {
+        usage(argv[0]);
+    }
+    const char* hostName = argv[optind];
+    const char* port = argv[optind + 1];
+    const char* fileName = argv[optind + 2];
+
+    int users, requests, traceCount;
+    double sleeptime;
+    char type[LINE_SIZE];
+    trace_t* traces;
+    if (ReadTrace(fileName, &users, &requests, &sleeptime, type, &traces, &traceCount) < 0)
+    {
+        fprintf(stderr, "Could not read trace %s\n", fileName);
+        exit(1);
+    }
+    if (repeat > 0)
+    {
+        requests = repeat;
+    }
+    if (users <= 0 || requests <= 0 || traceCount == 0)
+    {
+        fprintf(stderr, "Trace %s has no users, requests or traces\n", fileName);
+        exit(1);
+    }
+    think = sleeptime * 1000000;
+    if (connections == 0)
+    {
+        connections = users;
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int result = getaddrinfo(hostName, port, &hints, &server);
+    if (result != 0)
+    {
+        fprintf(stderr, "Could not resolve %s:%s: %s\n", hostName, port, gai_strerror(result));
+        exit(1);
+    }
+    char hostHeader[LINE_SIZE];
+    snprintf(hostHeader, sizeof(hostHeader), "%s:%s", hostName, port);
+    host_header = hostHeader;
+
+    //Every connection is a file descriptor, so allow as many as the hard limit does
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    if (threads > users)
+    {
+        threads = users;
+    }
+    long total = 0;
+    worker_t* workers = (worker_t*)calloc(threads, sizeof(worker_t));
+    int i, j;
+    for (i = 0; i < threads; i++)
+    {
+        //Users are dealt out to the workers round-robin
+        worker_t* worker = &workers[i];
+        int workerUsers = users / threads + (i < users % threads);
+        for (j = 0; j < workerUsers; j++)
+        {
+            worker->total += (long)requests * traces[(i + j * threads) % traceCount].count;
+        }
+        total += worker->total;
+    }
+
+    for (i = 0; i < threads; i++)
+    {
+        worker_t* worker = &workers[i];
+        int workerUsers = users / threads + (i < users % threads);
+        worker->epoll_fd = epoll_create1(0);
+        if (!open_loop)
+        {
+            //A client for each user, which starts out ready
+            worker->client_count = workerUsers;
+            worker->clients = (client_t*)calloc(workerUsers, sizeof(client_t));
+            for (j = 0; j < workerUsers; j++)
+            {
+                worker->clients[j].trace = &traces[(i + j * threads) % traceCount];
+                worker->clients[j].limit = (long)requests * worker->clients[j].trace->count;
+            }
+        }
+        else
+        {
+            //The users' requests are interleaved, each user keeping to the order of its own trace.  The worker's
+            //share of the rate matches its share of the requests, so every worker finishes at the same time
+            worker->schedule = (const request_t**)malloc(worker->total * sizeof(request_t*));
+            long scheduled = 0;
+            long position;
+            for (position = 0; scheduled < worker->total; position++)
+            {
+                for (j = 0; j < workerUsers; j++)
+                {
+                    const trace_t* trace = &traces[(i + j * threads) % traceCount];
+                    if (position < (long)requests * trace->count)
+                    {
+                        worker->schedule[scheduled++] = &trace->requests[position % trace->count];
+                    }
+                }
+            }
+            worker->interval = 1000000.0 * total / rate / worker->total;
+            worker->client_count = connections / threads + (i < connections % threads);
+            if (worker->client_count == 0)
+            {
+                worker->client_count = 1;
+            }
+            worker->clients = (client_t*)calloc(worker->client_count, sizeof(client_t));
+        }
+        for (j = 0; j < worker->client_count; j++)
+        {
+            client_t* client = &worker->clients[j];
+            client->worker = worker;
+            client->index = j;
+            client->fd = -1;
+            client->state = CLIENT_IDLE;
+            Enqueue(worker, client);
+        }
+    }
+
+    printf("Running Trace: %s (%s, %d users x %d runs, %s)\n", fileName, type, users, requests,
+            keep_alive ? "keep-alive" : "a connection per request");
+    if (open_loop)
+    {
+        printf("Open loop: %.1f requests/s over %d connections, %d threads\n", rate, connections, threads);
+    }
+    else
+    {
+        printf("Closed loop: %.3f s think time, %d threads\n", sleeptime, threads);
+    }
+    fflush(stdout);
+
+    start = Now();
+    for (i = 0; i < threads; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, &RunWorker, &workers[i]) != 0)
+        {
+            fprintf(stderr, "Could not start worker thread\n");
+            exit(1);
+        }
+    }
+
+    histogram_t* latency = (histogram_t*)calloc(1, sizeof(histogram_t));
+    histogram_t* corrected = (histogram_t*)calloc(1, sizeof(histogram_t));
+    long successes = 0, failures = 0, errors = 0;
+    for (i = 0; i < threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        successes += workers[i].successes;
+        failures += workers[i].failures;
+        errors += workers[i].errors;
+        Merge(latency, &workers[i].latency);
+        Merge(corrected, &workers[i].corrected);
+    }
+    double seconds = (Now() - start) / 1000000.0;
+
+    printf("Total: %ld Success: %ld Fail: %ld\n", total, successes, failures);
+    if (errors > 0)
+    {
+        printf("%ld failed without a response, and are left out of the latencies\n", errors);
+    }
+    printf("Total Time = %.3f seconds, %.1f requests/s\n", seconds, total / seconds);
+    if (open_loop)
+    {
+        printf("Latency from when each request was due:\n");
+        PrintHistogram(latency);
+    }
+    else
+    {
+        printf("Latency:\n");
+        PrintHistogram(latency);
+        if (think > 0)
+        {
+            printf("Latency corrected for coordinated omission (expected interval %ld us):\n", think);
+            PrintHistogram(corrected);
+        }
+    }
+
+    freeaddrinfo(server);
+    return failures > 0;
+}
+
+static int ReadTrace(const char* fileName, int* users, int* requests, double* sleeptime, char* type, trace_t** traces,
+        int* traceCount) {
+    FILE* file = fopen(fileName, "r");
+    if(file == NULL) {
+        return -1;
+    }
+    *users = 0;
+    *requests = 0;
+    *sleeptime = 0;
+    strcpy(type, "performance");
+    *traces = NULL;
+    *traceCount = 0;
+
+    //The same rules as http_test.py: blank lines and lines starting with % are skipped, [configuration] holds
+    //key=value pairs, and every section whose name starts with "trace" is a trace
+    char line[LINE_SIZE];
+    char section[LINE_SIZE] = "";
+    while(fgets(line, sizeof(line), file) != NULL) {
+        char* text = Strip(line);
+        int length = strlen(text);
+        if(length == 0 || text[0] == '%') {
+            continue;
+        }
+        if(text[0] == '[' && text[length - 1] == ']') {
+            text[length - 1] = '\0';
+            strcpy(section, text + 1);
+            if(strncmp(section, "trace", 5) == 0) {
+                *traces = (trace_t*)realloc(*traces, (*traceCount + 1) * sizeof(trace_t));
+                (*traces)[*traceCount].requests = NULL;
+                (*traces)[*traceCount].count = 0;
+                (*traceCount)++;
+            }
+            continue;
+        }
+
+        if(strcmp(section, "configuration") == 0) {
+            char* value = strchr(text, '=');
+            if(value == NULL) {
+                continue;
+            }
+            *value++ = '\0';
+            if(strcmp(text, "threads") == 0) {
+                *users = atoi(value);
+            } else if(strcmp(text, "requests") == 0) {
+                *requests = atoi(value);
+            } else if(strcmp(text, "sleeptime") == 0) {
+                *sleeptime = atof(value);
+            } else if(strcmp(text, "type") == 0) {
+                strcpy(type, value);
+            }
+        } else if(strncmp(section, "trace", 5) == 0) {
+            trace_t* trace = &(*traces)[*traceCount - 1];
+            trace->requests = (request_t*)realloc(trace->requests, (trace->count + 1) * sizeof(request_t));
+            request_t* request = &trace->requests[trace->count++];
+            char* expected = strchr(text, ' ');
+            if(expected != NULL) {
+                *expected++ = '\0';
+                request->expected = strdup(expected);
+            } else {
+                request->expected = NULL;
+            }
+            request->path = strdup(text);
+        }
+    }
+    fclose(file);
+
+    //A trace section with no requests in it adds nothing, as in http_test.py
+    int i, count = 0;
+    for(i = 0; i < *traceCount; i++) {
+        if((*traces)[i].count > 0) {
+            (*traces)[count++] = (*traces)[i];
+        }
+    }
+    *traceCount = count;
+    return 0;
+}
+
+static char* Strip(char* text) {
+    while(isspace((unsigned char)*text)) {
+        text++;
+    }
+    int length = strlen(text);
+    while(length > 0 && isspace((unsigned char)text[length - 1])) {
+        text[--length] = '\0';
+    }
+    return text;
+}
+
+static void* RunWorker(void* workerArg) {
+    worker_t* worker = (worker_t*)workerArg;
+    struct epoll_event events[MAX_EVENTS];
+
+    while(worker->completed < worker->total) {
+        int timeout = StartDueRequests(worker);
+        int count = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout);
+        int i;
+        for(i = 0; i < count; i++) {
+            //The low half of the data is the client, the high half the generation of the socket the event is for
+            client_t* client = &worker->clients[(uint32_t)events[i].data.u64];
+            if(client->fd != -1 && client->generation == (unsigned int)(events[i].data.u64 >> 32)) {
+                Progress(client, events[i].events);
+            }
+        }
+    }
+
+    int i;
+    for(i = 0; i < worker->client_count; i++) {
+        CloseClient(&worker->clients[i]);
+        free(worker->clients[i].in);
+    }
+    close(worker->epoll_fd);
+    return NULL;
+}
+
+static int StartDueRequests(worker_t* worker) {
+    long now = Now();
+    if(!open_loop) {
+        //Users wake up in the order they went to sleep, so only the head of the queue needs checking
+        while(worker->queue_head != NULL && worker->queue_head->ready_at <= now) {
+            client_t* client = worker->queue_head;
+            worker->queue_head = client->next;
+            long position = client->sent++;
+            StartRequest(client, &client->trace->requests[position % client->trace->count], now);
+        }
+        if(worker->queue_head == NULL) {
+            return -1;
+        }
+        return (worker->queue_head->ready_at - now + 999) / 1000;
+    }
+
+    //Requests that are due but find every connection busy wait for one.  Their latency counts from when they
+    //were due, so the wait is measured too
+    while(worker->scheduled < worker->total && worker->queue_head != NULL) {
+        long due = start + (long)(worker->scheduled * worker->interval);
+        if(due > now) {
+            return (due - now + 999) / 1000;
+        }
+        client_t* client = worker->queue_head;
+        worker->queue_head = client->next;
+        StartRequest(client, worker->schedule[worker->scheduled++], due);
+    }
+    return -1;
+}
+
+static void StartRequest(client_t* client, const request_t* request, long due) {
+    client->request = request;
+    client->due = due;
+    client->out_length = snprintf(client->out, sizeof(client->out),
+            "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n", request->path, host_header,
+            keep_alive ? "keep-alive" : "close");
+    client->out_sent = 0;
+    client->in_length = 0;
+    client->head_length = 0;
+    client->content_length = -1;
+
+    if(client->fd != -1) {
+        client->state = CLIENT_SENDING;
+        Progress(client, 0);
+        return;
+    }
+
+    client->fd = socket(server->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(client->fd < 0) {
+        client->fd = -1;
+        FinishRequest(client, 0);
+        return;
+    }
+    int one = 1;
+    setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    client->generation++;
+
+    //Edge-triggered for everything at once, so the socket is registered once and never re-armed
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.u64 = ((uint64_t)client->generation << 32) | (uint32_t)client->index;
+    epoll_ctl(client->worker->epoll_fd, EPOLL_CTL_ADD, client->fd, &event);
+
+    if(connect(client->fd, server->ai_addr, server->ai_addrlen) == 0) {
+        client->state = CLIENT_SENDING;
+        Progress(client, 0);
+    } else if(errno == EINPROGRESS) {
+        client->state = CLIENT_CONNECTING;
+    } else {
+        FinishRequest(client, 0);
+    }
+}
+
+static void Progress(client_t* client, int events) {
+    if(client->state == CLIENT_IDLE) {
+        //The server closed a kept-alive connection.  The next request opens a new one
+        if(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+            CloseClient(client);
+        }
+        return;
+    }
+
+    if(client->state == CLIENT_CONNECTING) {
+        if(!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            return;
+        }
+        int error = 0;
+        socklen_t length = sizeof(error);
+        if(getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0) {
+            FinishRequest(client, 0);
+            return;
+        }
+        client->state = CLIENT_SENDING;
+    }
+
+    if(client->state == CLIENT_SENDING) {
+        while(client->out_sent < client->out_length) {
+            int sent = send(client->fd, client->out + client->out_sent, client->out_length - client->out_sent,
+                    MSG_NOSIGNAL);
+            if(sent < 0) {
+                if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return;
+                }
+                if(errno == EINTR) {
+                    continue;
+                }
+                FinishRequest(client, 0);
+                return;
+            }
+            client->out_sent += sent;
+        }
+        client->state = CLIENT_RECEIVING;
+    }
+
+    //Read even without an event: the response to a request on a kept-alive connection may already be waiting
+    int result = Receive(client);
+    if(result != 0) {
+        FinishRequest(client, result > 0);
+    }
+}
+
+static int Receive(client_t* client) {
+    while(1) {
+        if(client->in_capacity - client->in_length < READ_CHUNK) {
+            int capacity = client->in_capacity == 0 ? READ_CHUNK * 2 : client->in_capacity * 2;
+            char* in = (char*)realloc(client->in, capacity + 1);
+            if(in == NULL) {
+                return -1;
+            }
+            client->in = in;
+            client->in_capacity = capacity;
+        }
+
+        int received = recv(client->fd, client->in + client->in_length, client->in_capacity - client->in_length, 0);
+        if(received < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if(received == 0) {
+            //The server closed the connection.  That ends a response without a length, and fails any other
+            return client->head_length > 0 && client->content_length < 0 ? 1 : -1;
+        }
+        client->in_length += received;
+        client->in[client->in_length] = '\0';
+
+        if(client->head_length == 0) {
+            char* end = strstr(client->in, "\r\n\r\n");
+            if(end == NULL) {
+                continue;
+            }
+            client->head_length = end + 4 - client->in;
+            char* contentLength = strcasestr(client->in, "\r\nContent-Length:");
+            if(contentLength != NULL && contentLength < end) {
+                client->content_length = atol(contentLength + 17);
+            }
+        }
+        if(client->content_length >= 0 && client->in_length >= client->head_length + client->content_length) {
+            return 1;
+        }
+    }
+}
+
+static void FinishRequest(client_t* client, int response) {
+    worker_t* worker = client->worker;
+    long now = Now();
+    worker->completed++;
+
+    if(!response) {
+        worker->failures++;
+        worker->errors++;
+        CloseClient(client);
+    } else {
+        long latency = now - client->due;
+        Record(&worker->latency, latency);
+
+        //A user who would have sent a request every think microseconds was held up for latency, during which it
+        //would have sent the requests this one stands in for, each of them waiting for what was left of the stall
+        if(think > 0) {
+            Record(&worker->corrected, latency);
+            long missing;
+            for(missing = latency - think; missing >= think; missing -= think) {
+                Record(&worker->corrected, missing);
+            }
+        }
+
+        int success = 0;
+        int status;
+        if(sscanf(client->in, "HTTP/%*d.%*d %d", &status) == 1 && status == 200) {
+            success = 1;
+            if(client->request->expected != NULL) {
+                char* body = client->in + client->head_length;
+                body[client->content_length >= 0 ? client->content_length : client->in_length - client->head_length] =
+                        '\0';
+                success = strcmp(Strip(body), client->request->expected) == 0;
+            }
+        }
+        if(success) {
+            worker->successes++;
+        } else {
+            worker->failures++;
+        }
+
+        //Pipelining is never used, so anything else the server sent can only belong to this response
+        char* end = client->in + client->head_length;
+        *end = '\0';
+        if(!keep_alive || strcasestr(client->in, "\r\nConnection: close") != NULL) {
+            CloseClient(client);
+        }
+    }
+
+    client->state = CLIENT_IDLE;
+    if(!open_loop) {
+        //The user thinks, then runs the next request of its trace, unless it has run them all
+        if(client->sent == client->limit) {
+            CloseClient(client);
+            return;
+        }
+        client->ready_at = now + think;
+    }
+    Enqueue(worker, client);
+}
+
+static void CloseClient(client_t* client) {
+    if(client->fd != -1) {
+        close(client->fd);
+        client->fd = -1;
+    }
+}
+
+static void Enqueue(worker_t* worker, client_t* client) {
+    client->next = NULL;
+    if(worker->queue_head == NULL) {
+        worker->queue_head = client;
+    } else {
+        worker->queue_tail->next = client;
+    }
+    worker->queue_tail = client;
+}
+
+static void Record(histogram_t* histogram, long value) {
+    uint64_t micros = value > 0 ? value : 0;
+    histogram->counts[BucketIndex(micros)]++;
+    histogram->total++;
+    histogram->sum += micros;
+    if(micros > histogram->max) {
+        histogram->max = micros;
+    }
+}
+
+static void Merge(histogram_t* into, const histogram_t* from) {
+    int i;
+    for(i = 0; i < BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if(from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+static void PrintHistogram(const histogram_t* histogram) {
+    static const double percentiles[] = {50, 75, 90, 99, 99.9, 99.99, 99.999};
+    if(histogram->total == 0) {
+        printf("  no responses\n");
+        return;
+    }
+    printf("  mean %10.3f ms\n", histogram->sum / histogram->total / 1000.0);
+
+    int p, i = 0;
+    uint64_t seen = 0;
+    for(p = 0; p < sizeof(percentiles) / sizeof(percentiles[0]); p++) {
+        //The smallest value that at least this share of the responses did not exceed
+        uint64_t rank = (uint64_t)(percentiles[p] / 100 * histogram->total + 0.5);
+        if(rank == 0) {
+            rank = 1;
+        }
+        while(seen + histogram->counts[i] < rank) {
+            seen += histogram->counts[i++];
+        }
+        uint64_t value = BucketValue(i);
+        printf("  %7.3f%% %10.3f ms\n", percentiles[p], (value < histogram->max ? value : histogram->max) / 1000.0);
+    }
+    printf("  max      %10.3f ms  (%llu responses)\n", histogram->max / 1000.0,
+            (unsigned long long)histogram->total);
+}
+
+static inline int BucketIndex(uint64_t value) {
+    if(value < SUB_BUCKETS) {
+        return value;
+    }
+    if(value >> MAX_BITS) {
+        return BUCKETS - 1;
+    }
+    //The top SUB_BUCKET_BITS + 1 bits of the value pick the sub-bucket within its power of two
+    int magnitude = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+    int subBucket = (value >> magnitude) - SUB_BUCKETS;
+    return SUB_BUCKETS * (magnitude + 1) + subBucket;
+}
+
+static inline uint64_t BucketValue(int index) {
+    if(index < SUB_BUCKETS) {
+        return index;
+    }
+    int magnitude = index / SUB_BUCKETS - 1;
+    uint64_t subBucket = index % SUB_BUCKETS;
+    return ((SUB_BUCKETS + subBucket + 1) << magnitude) - 1;
+}
+
+static long Now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
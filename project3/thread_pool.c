@@ -2,8 +2,12 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
 
 #include "thread_pool.h"
+#include "mpmc_queue.h"
 
 /**
  *  @struct threadpool_task
@@ -23,11 +27,37 @@ similar to what was suggested in the thread.
 */
 
 typedef struct {
-    void (*function)(int);
-    int argument;
+    void (*function)(void*);
+    void* argument;
+    long enqueue_time; //Milliseconds on the monotonic clock when the task was queued (shared queue pools only)
 } threadpool_task_t;
 
+//A queued task gains one priority class for every THREADPOOL_AGING milliseconds it waits, so that a steady stream
+//of high priority tasks cannot starve the lower classes
+#define THREADPOOL_AGING 50
 
+//An elastic pool adds a thread when every thread is busy and either more than this many tasks per thread are
+//queued, or the oldest queued task has waited at least THREADPOOL_GROW_WAIT milliseconds
+#define THREADPOOL_GROW_DEPTH 2
+#define THREADPOOL_GROW_WAIT 10
+
+
+
+//Each worker's deque in a work stealing pool.  The owner takes tasks from the head (oldest first) and thieves take
+//them from the tail, both under the deque's own lock.  count mirrors the number of tasks so that other threads can
+//skip empty deques without taking their locks.  Aligned so that two deques never share a cache line
+typedef struct {
+    pthread_mutex_t lock;
+    threadpool_task_t* tasks;
+    int head;
+    atomic_int count;
+} __attribute__((aligned(64))) worker_deque_t;
+
+//Argument passed to each work stealing worker thread
+typedef struct {
+    threadpool_t* pool;
+    int index; //Index of the worker's own deque
+} threadpool_worker_t;
 
 //The task queue is implemented as a moving fixed size queue.
 //Both the head and the tail move as tasks are removed and added, respectively
@@ -42,12 +72,37 @@ struct threadpool_t {
   pthread_cond_t new_work; //Condition signaled when the queue becomes non-empty
   pthread_cond_t not_full; //Condition signaled when the queue becomes non-full
   int exit; //Set this to true to indicate that all threads should terminate.  Does not terminate threads instantly.
-  pthread_t *threads; //Array of thread ids
-  threadpool_task_t *task_queue; //The queue of tasks to work on
+  pthread_t *threads; //Array of thread ids (work stealing and lock-free pools)
+  threadpool_task_t *task_queue; //The queues of tasks to work on, one after the other, one per priority class
   int thread_count; //Number of threads
-  int task_queue_size; //Max size of the queue
-  int task_queue_head; //Moving head and tail of the queue
-  int task_queue_tail;
+  int task_queue_size; //Max size of the queue.  Each class has room for this many, but they share the limit
+  int task_queue_head[THREADPOOL_PRIORITIES]; //Moving head and tail of the queue of each class
+  int task_queue_tail[THREADPOOL_PRIORITIES];
+  int task_count; //Number of tasks in all of the queues
+
+  //Sizing of shared queue pools.  Their threads are detached, and come and go between min_threads and max_threads
+  //thread_count is the number of live threads.  All of these are protected by lock
+  int min_threads;
+  int max_threads;
+  int idle_timeout; //Milliseconds a thread above min_threads waits for work before it exits.  0 never retires
+  int idle_threads; //Threads waiting on new_work
+  pthread_cond_t all_exited; //Signaled when the last thread exits during threadpool_destroy
+  long peak_threads;
+  long grown_for_depth;
+  long grown_for_wait;
+  long retired;
+
+  //Work stealing pools (threadpool_create_stealing) use one deque per thread instead of task_queue.  lock, new_work
+  //and not_full are then only used to put idle workers and blocked submitters to sleep
+  worker_deque_t* deques; //NULL for a shared queue pool
+  threadpool_worker_t* workers;
+  int deque_size; //Capacity of each deque
+  atomic_uint next_deque; //Round-robin position of the next submitted task
+  atomic_int sleeping_workers; //Workers waiting on new_work
+  atomic_int waiting_submitters; //Submitters waiting on not_full
+
+  //Lock-free pools (threadpool_create_lockfree) queue their tasks here instead, and do not use the lock at all
+  mpmc_queue_t* ring; //NULL for the other kinds of pool
 };
 
 /**
@@ -59,48 +114,113 @@ struct threadpool_t {
 //"Main" function for thread pool threads.  Threads are passed the threadpool that they belong to
 static void* thread_do_work(void *threadPoolArg);
 
+//"Main" function for the threads of a work stealing pool.  Threads are passed their threadpool_worker_t
+static void* thread_do_stealing_work(void *workerArg);
+
+//"Main" function for the threads of a lock-free pool.  Threads are passed the threadpool that they belong to
+static void* thread_do_lockfree_work(void *threadPoolArg);
+
+//Starts one more detached thread for a shared queue pool.  Must be called with the lock held
+static void StartThread(threadpool_t* threadPool);
+
+//Starts a thread if the pool is elastic, every thread is busy and the queue is too deep or too old
+//Must be called with the lock held
+static void MaybeGrow(threadpool_t* threadPool);
+
+//Waits on new_work, for at most the idle timeout if the pool could shrink
+//Returns true if the wait timed out.  Must be called with the lock held
+static int WaitForWork(threadpool_t* threadPool);
+
+//Called by a shared queue thread, with the lock held, to exit.  Does not return
+static void ExitThread(threadpool_t* threadPool);
+
+//Returns the current time in milliseconds from a clock that never jumps
+static long NowMilliseconds();
+
+//Allocates a pool and initializes the fields shared by both kinds of pool.  Does not start any threads
+static threadpool_t* AllocateThreadPool(int thread_count);
+
+//Adds a task to one of the deques of a work stealing pool, blocking while every deque is full unless wait is false
+//Returns 0, or THREADPOOL_FULL if every deque is full and wait is false
+static int AddStealingTask(threadpool_t* threadPool, void (* function)(void*), void* argument, int wait);
+
+//Adds a task to the tail of a deque.  Returns true if the task was added, false if the deque is full
+static int PushToDeque(threadpool_t* threadPool, worker_deque_t* deque, void (* function)(void*), void* argument);
+
+//Removes the oldest task from a deque.  Returns true if a task was copied to destination, false if the deque is empty
+static int PopFromDeque(threadpool_t* threadPool, worker_deque_t* deque, threadpool_task_t* destination);
+
+//Removes the newest task from the deque of some worker other than thief
+//Returns true if a task was copied to destination, false if every other deque is empty
+static int StealTask(threadpool_t* threadPool, int thief, threadpool_task_t* destination);
+
+//Called after a task is taken from a deque, in case a submitter is waiting for room
+static void WakeSubmitter(threadpool_t* threadPool);
+
+//Returns true if any deque of a work stealing pool has a task in it
+static int HasQueuedTasks(threadpool_t* threadPool);
+
+//Returns true if every deque of a work stealing pool is full
+static int AllDequesFull(threadpool_t* threadPool);
+
 //Returns true if the task queue is empty, false otherwise.
 static inline int IsTaskQueueEmpty(threadpool_t* threadPool);
 
-//Adds a task to the tail end of the thread pool.  Returns true if the task was added, false if there wasn't room
+//Adds a task to the tail end of the queue of a priority class.  Returns true if the task was added, false if there
+//wasn't room
 //NOT THREAD SAFE.  Must be synchronized externally
-static inline int AddToTailOfQueue(threadpool_t* threadPool, void (* function)(int), int argument);
+static inline int AddToTailOfQueue(threadpool_t* threadPool, int priority, void (* function)(void*), void* argument);
 
-//Removes a task from the head end (lower numbered) of the thread pool.  DOES NOT CHECK IF THERE IS A TASK TO GET
-//Behavior is undefined if the queue is empty; call IsTaskQueueEmpty first to be sure
+//Removes a task from the head end (lower numbered) of the queue of a priority class.  DOES NOT CHECK IF THERE IS A
+//TASK TO GET.  Behavior is undefined if the queue is empty; call PickPriority first to be sure
 //Destination must be a valid, non-null threadpool_task_t
 //The task that is removed is copied to destination
 //NOT THREAD SAFE.  Must be synchronized externally
-static inline void RemoveFromHeadOfQueue(threadpool_t* threadPool, threadpool_task_t* destination);
+static inline void RemoveFromHeadOfQueue(threadpool_t* threadPool, int priority, threadpool_task_t* destination);
+
+//Returns the priority class whose oldest task should run next, or -1 if the queue is empty
+//A class's oldest task competes with its class plus one for every THREADPOOL_AGING milliseconds it has waited, and
+//ties go to the higher class.  NOT THREAD SAFE.  Must be synchronized externally
+static int PickPriority(threadpool_t* threadPool);
+
+//Returns the time the oldest queued task was added.  The queue must not be empty
+//NOT THREAD SAFE.  Must be synchronized externally
+static long OldestEnqueueTime(threadpool_t* threadPool);
 
 
 
 static inline int IsTaskQueueEmpty(threadpool_t* threadPool) {
-    //-1 indicates empty.  We can't just check if head == tail because that would be true for both full and empty
-    return threadPool->task_queue_head == -1;
+    return threadPool->task_count == 0;
 }
 
-static inline int AddToTailOfQueue(threadpool_t* threadPool, void (* function)(int), int argument) {
+static inline int AddToTailOfQueue(threadpool_t* threadPool, int priority, void (* function)(void*), void* argument) {
     int added = 0;
-
-    //Check if there's room
-    if(threadPool->task_queue_head != threadPool->task_queue_tail) {
+    threadpool_task_t* queue = &threadPool->task_queue[priority * threadPool->task_queue_size];
+    int* head = &threadPool->task_queue_head[priority];
+    int* tail = &threadPool->task_queue_tail[priority];
+
+    //Check if there's room.  Every class is limited by the total, not just by its own queue
+    //-1 indicates an empty class.  We can't just check if head == tail because that would be true for both full and
+    //empty
+    if(threadPool->task_count < threadPool->task_queue_size && *head != *tail) {
         //Get the location in the queue of the next task to be added
-        threadpool_task_t* newTask = &threadPool->task_queue[threadPool->task_queue_tail];
+        threadpool_task_t* newTask = &queue[*tail];
 
         //Copy the function and argument to the queue
         newTask->function = function;
         newTask->argument = argument;
+        newTask->enqueue_time = NowMilliseconds();
+        threadPool->task_count++;
 
         //If the queue was previously empty, mark that it is no longer empty
-        if(threadPool->task_queue_head == -1) {
-            threadPool->task_queue_head = threadPool->task_queue_tail;
+        if(*head == -1) {
+            *head = *tail;
         }
 
         //Increment the tail, and wrap around to 0 if we went past the right side
-        threadPool->task_queue_tail++;
-        if(threadPool->task_queue_tail >= threadPool->task_queue_size) {
-            threadPool->task_queue_tail = 0;
+        (*tail)++;
+        if(*tail >= threadPool->task_queue_size) {
+            *tail = 0;
         }
         added = 1;
     } //else queue is full
@@ -108,25 +228,65 @@ static inline int AddToTailOfQueue(threadpool_t* threadPool, void (* function)(i
     return added;
 }
 
-static inline void RemoveFromHeadOfQueue(threadpool_t* threadPool, threadpool_task_t* destination) {
+static inline void RemoveFromHeadOfQueue(threadpool_t* threadPool, int priority, threadpool_task_t* destination) {
+    int* head = &threadPool->task_queue_head[priority];
+    int* tail = &threadPool->task_queue_tail[priority];
 
     //Get the task at the head of the list
-    threadpool_task_t* headTask = &threadPool->task_queue[threadPool->task_queue_head];
+    threadpool_task_t* headTask = &threadPool->task_queue[priority * threadPool->task_queue_size + *head];
 
     //Copy the function and argument to the destination
     destination->function = headTask->function;
     destination->argument = headTask->argument;
+    destination->enqueue_time = headTask->enqueue_time;
+    threadPool->task_count--;
 
     //Increment the head pointer and wrap around to zero if we overflow the right end
-    threadPool->task_queue_head++;
-    if(threadPool->task_queue_head == threadPool->task_queue_size) {
-        threadPool->task_queue_head = 0;
+    (*head)++;
+    if(*head == threadPool->task_queue_size) {
+        *head = 0;
     }
 
     //If the queue is now empty, set head to -1
-    if(threadPool->task_queue_head == threadPool->task_queue_tail) {
-        threadPool->task_queue_head = -1;
+    if(*head == *tail) {
+        *head = -1;
+    }
+}
+
+static int PickPriority(threadpool_t* threadPool) {
+    long now = NowMilliseconds();
+    int best = -1;
+    long bestScore = 0;
+    int priority;
+    for(priority = THREADPOOL_PRIORITIES - 1; priority >= 0; priority--) {
+        int head = threadPool->task_queue_head[priority];
+        if(head == -1) {
+            continue;
+        }
+        threadpool_task_t* oldest = &threadPool->task_queue[priority * threadPool->task_queue_size + head];
+        long score = priority + (now - oldest->enqueue_time) / THREADPOOL_AGING;
+        if(best == -1 || score > bestScore) {
+            best = priority;
+            bestScore = score;
+        }
     }
+    return best;
+}
+
+static long OldestEnqueueTime(threadpool_t* threadPool) {
+    long oldest = 0;
+    int priority;
+    for(priority = 0; priority < THREADPOOL_PRIORITIES; priority++) {
+        int head = threadPool->task_queue_head[priority];
+        if(head == -1) {
+            continue;
+        }
+        long enqueueTime = threadPool->task_queue[priority * threadPool->task_queue_size + head].enqueue_time;
+        if(oldest == 0 || enqueueTime < oldest) {
+            oldest = enqueueTime;
+        }
+    }
+    return oldest;
 }
 
 /*
@@ -134,20 +294,118 @@ static inline void RemoveFromHeadOfQueue(threadpool_t* threadPool, threadpool_ta
  *
  */
 threadpool_t *threadpool_create(int thread_count, int queue_size) {
+    //A fixed size pool is an elastic pool that can neither grow nor shrink
+    return threadpool_create_elastic(thread_count, thread_count, queue_size, 0);
+}
+
+/*
+ * Create a shared queue threadpool that starts with min_threads threads
+ *
+ */
+threadpool_t *threadpool_create_elastic(int min_threads, int max_threads, int queue_size, int idle_timeout) {
+    threadpool_t* threadPool = AllocateThreadPool(0);
+
+    //Allocate space for the task queue, and initialize it to be empty
+    threadPool->task_queue = (threadpool_task_t*)malloc(sizeof(threadpool_task_t) * queue_size * THREADPOOL_PRIORITIES);
+    threadPool->task_queue_size = queue_size;
+
+    threadPool->min_threads = min_threads;
+    threadPool->max_threads = max_threads > min_threads ? max_threads : min_threads;
+    threadPool->idle_timeout = idle_timeout;
+
+    //Start the minimum number of threads
+    pthread_mutex_lock(&threadPool->lock);
+    while(threadPool->thread_count < min_threads) {
+        StartThread(threadPool);
+    }
+    pthread_mutex_unlock(&threadPool->lock);
+
+    return threadPool;
+}
+
+/*
+ * Create a work stealing threadpool: one deque and one worker argument per thread
+ *
+ */
+threadpool_t *threadpool_create_stealing(int thread_count, int queue_size) {
+    threadpool_t* threadPool = AllocateThreadPool(thread_count);
+
+    //Split the queue between the workers, giving each room for at least one task
+    threadPool->deque_size = queue_size / thread_count > 0 ? queue_size / thread_count : 1;
+    threadPool->deques = (worker_deque_t*)aligned_alloc(64, sizeof(worker_deque_t) * thread_count);
+    threadPool->workers = (threadpool_worker_t*)malloc(sizeof(threadpool_worker_t) * thread_count);
+
+    int threadNumber;
+    for(threadNumber = 0; threadNumber < thread_count; threadNumber++) {
+        worker_deque_t* deque = &threadPool->deques[threadNumber];
+        pthread_mutex_init(&deque->lock, NULL);
+        deque->tasks = (threadpool_task_t*)malloc(sizeof(threadpool_task_t) * threadPool->deque_size);
+        deque->head = 0;
+        atomic_init(&deque->count, 0);
+
+        threadPool->workers[threadNumber].pool = threadPool;
+        threadPool->workers[threadNumber].index = threadNumber;
+    }
+
+    //Start the threads once every deque exists, since they steal from each other straight away
+    for(threadNumber = 0; threadNumber < thread_count; threadNumber++) {
+        pthread_create(&threadPool->threads[threadNumber], NULL, &thread_do_stealing_work,
+                (void*)&threadPool->workers[threadNumber]);
+    }
+
+    return threadPool;
+}
+
+/*
+ * Create a lock-free threadpool: the tasks go through an mpmc_queue
+ *
+ */
+threadpool_t *threadpool_create_lockfree(int thread_count, int queue_size) {
+    threadpool_t* threadPool = AllocateThreadPool(thread_count);
+    threadPool->ring = mpmc_queue_create(queue_size, sizeof(threadpool_task_t));
+
+    int threadNumber;
+    for(threadNumber = 0; threadNumber < thread_count; threadNumber++) {
+        pthread_create(&threadPool->threads[threadNumber], NULL, &thread_do_lockfree_work, (void*)threadPool);
+    }
+
+    return threadPool;
+}
+
+static threadpool_t* AllocateThreadPool(int thread_count) {
     threadpool_t* threadPool = (threadpool_t*)malloc(sizeof(threadpool_t));
 
     //Don't exit yet (we just started)
     threadPool->exit = 0;
 
     //Allocate space to store the thread ID of each thread
-    threadPool->threads = (pthread_t*)malloc(sizeof(pthread_t) * thread_count);
-
-    //Allocate space for the task queue, and initialize it to be empty
-    threadPool->task_queue = (threadpool_task_t*)malloc(sizeof(threadpool_task_t) * queue_size);
+    threadPool->threads = (pthread_t*)malloc(sizeof(pthread_t) * (thread_count > 0 ? thread_count : 1));
     threadPool->thread_count = thread_count;
-    threadPool->task_queue_size = queue_size;
-    threadPool->task_queue_head = -1;
-    threadPool->task_queue_tail = 0;
+
+    //No queue yet; the caller sets up either the shared queue or the deques
+    threadPool->task_queue = NULL;
+    threadPool->task_queue_size = 0;
+    int priority;
+    for(priority = 0; priority < THREADPOOL_PRIORITIES; priority++) {
+        threadPool->task_queue_head[priority] = -1;
+        threadPool->task_queue_tail[priority] = 0;
+    }
+    threadPool->task_count = 0;
+    threadPool->min_threads = thread_count;
+    threadPool->max_threads = thread_count;
+    threadPool->idle_timeout = 0;
+    threadPool->idle_threads = 0;
+    threadPool->peak_threads = thread_count;
+    threadPool->grown_for_depth = 0;
+    threadPool->grown_for_wait = 0;
+    threadPool->retired = 0;
+    threadPool->deques = NULL;
+    threadPool->workers = NULL;
+    threadPool->deque_size = 0;
+    threadPool->ring = NULL;
+    atomic_init(&threadPool->next_deque, 0);
+    atomic_init(&threadPool->sleeping_workers, 0);
+    atomic_init(&threadPool->waiting_submitters, 0);
 
     //Initialize the queue lock
     pthread_mutexattr_t mutexAttributes;
@@ -156,24 +414,17 @@ threadpool_t *threadpool_create(int thread_count, int queue_size) {
     pthread_mutexattr_destroy(&mutexAttributes);
 
     //Initialize the empty and full conditions (producer-consumer problem)
+    //Idle threads wait on new_work with a timeout, which should not be affected by changes to the system time
     pthread_condattr_t conditionAttributes;
     pthread_condattr_init(&conditionAttributes);
+    pthread_condattr_setclock(&conditionAttributes, CLOCK_MONOTONIC);
     pthread_cond_init(&threadPool->new_work, &conditionAttributes);
 
     pthread_cond_init(&threadPool->not_full, &conditionAttributes);
+    pthread_cond_init(&threadPool->all_exited, &conditionAttributes);
 
     pthread_condattr_destroy(&conditionAttributes);
 
-    //Start each thread
-    int threadNumber;
-    for(threadNumber = 0; threadNumber < thread_count; threadNumber++) {
-        pthread_attr_t threadAttributes;
-        pthread_attr_init(&threadAttributes);
-        pthread_create(&threadPool->threads[threadNumber], &threadAttributes, &thread_do_work, (void*)threadPool);
-
-        pthread_attr_destroy(&threadAttributes);
-    }
-
     return threadPool;
 }
 
@@ -182,18 +433,44 @@ threadpool_t *threadpool_create(int thread_count, int queue_size) {
  * Add a task to the threadpool
  *
  */
-int threadpool_add_task(threadpool_t *threadPool, void (* function)(int), int argument)
+int threadpool_add_task(threadpool_t *threadPool, void (* function)(void*), void* argument)
+{
+    return threadpool_add_task_priority(threadPool, function, argument, 0);
+}
+
+/*
+ * Add a task to the threadpool in a priority class
+ *
+ */
+int threadpool_add_task_priority(threadpool_t *threadPool, void (* function)(void*), void* argument, int priority)
 {
     int err = 0;
 
+    if(threadPool->deques != NULL) {
+        return AddStealingTask(threadPool, function, argument, 1);
+    } else if(threadPool->ring != NULL) {
+        threadpool_task_t task = {function, argument};
+        return mpmc_queue_push(threadPool->ring, &task) ? 0 : -1;
+    }
+
+    /* Out of range priorities go to the nearest class */
+    if(priority < 0) {
+        priority = 0;
+    } else if(priority >= THREADPOOL_PRIORITIES) {
+        priority = THREADPOOL_PRIORITIES - 1;
+    }
+
     /* Get the lock */
     pthread_mutex_lock(&threadPool->lock);
 
     /* Add task to queue */
-    while(!AddToTailOfQueue(threadPool, function, argument)) {
+    while(!AddToTailOfQueue(threadPool, priority, function, argument)) {
         pthread_cond_wait(&threadPool->not_full, &threadPool->lock);
     }
 
+    /* Add a thread if the ones we have are falling behind */
+    MaybeGrow(threadPool);
+
     /* pthread_cond_broadcast and unlock */
     pthread_mutex_unlock(&threadPool->lock);
 
@@ -204,6 +481,40 @@ int threadpool_add_task(threadpool_t *threadPool, void (* function)(int), int ar
 
 
 
+/*
+ * Add a task to the threadpool if there is room, without blocking
+ *
+ */
+int threadpool_try_add(threadpool_t *threadPool, void (* function)(void*), void* argument, int priority)
+{
+    if(threadPool->deques != NULL) {
+        return AddStealingTask(threadPool, function, argument, 0);
+    } else if(threadPool->ring != NULL) {
+        threadpool_task_t task = {function, argument};
+        return mpmc_queue_try_push(threadPool->ring, &task) ? 0 : THREADPOOL_FULL;
+    }
+
+    if(priority < 0) {
+        priority = 0;
+    } else if(priority >= THREADPOOL_PRIORITIES) {
+        priority = THREADPOOL_PRIORITIES - 1;
+    }
+
+    pthread_mutex_lock(&threadPool->lock);
+    if(!AddToTailOfQueue(threadPool, priority, function, argument)) {
+        pthread_mutex_unlock(&threadPool->lock);
+        return THREADPOOL_FULL;
+    }
+    MaybeGrow(threadPool);
+    pthread_mutex_unlock(&threadPool->lock);
+
+    pthread_cond_signal(&threadPool->new_work);
+
+    return 0;
+}
+
+
+
 /*
  * Destroy the threadpool, free all memory, destroy treads, etc
  * Blocks until all threads finish whatever job they were already working on and terminate
@@ -212,17 +523,32 @@ int threadpool_destroy(threadpool_t *threadPool)
 {
     int err = 0;
 
+    /* Set exit under the lock so that a work stealing worker cannot miss it between checking and sleeping */
+    pthread_mutex_lock(&threadPool->lock);
     threadPool->exit = 1;
+    pthread_mutex_unlock(&threadPool->lock);
 
     /* Wake up all worker threads */
     pthread_cond_broadcast(&threadPool->new_work);
+    if(threadPool->ring != NULL) {
+        mpmc_queue_close(threadPool->ring);
+    }
 
     /* Join all worker thread */
     int threadNumber;
-    for(threadNumber = 0; threadNumber < threadPool->thread_count; threadNumber++) {
-        void* retval;
-        //Wait for all threads to finish (will not interrupt running jobs, waits for all jobs to finish)
-        pthread_join(threadPool->threads[threadNumber], &retval);
+    if(threadPool->task_queue != NULL) {
+        //Shared queue threads are detached, so wait for the last one to say it is done
+        pthread_mutex_lock(&threadPool->lock);
+        while(threadPool->thread_count > 0) {
+            pthread_cond_wait(&threadPool->all_exited, &threadPool->lock);
+        }
+        pthread_mutex_unlock(&threadPool->lock);
+    } else {
+        for(threadNumber = 0; threadNumber < threadPool->thread_count; threadNumber++) {
+            void* retval;
+            //Wait for all threads to finish (will not interrupt running jobs, waits for all jobs to finish)
+            pthread_join(threadPool->threads[threadNumber], &retval);
+        }
     }
 
     /* Only if everything went well do we deallocate the pool */
@@ -230,6 +556,20 @@ int threadpool_destroy(threadpool_t *threadPool)
     pthread_mutex_destroy(&threadPool->lock);
     pthread_cond_destroy(&threadPool->new_work);
     pthread_cond_destroy(&threadPool->not_full);
+    pthread_cond_destroy(&threadPool->all_exited);
+
+    if(threadPool->deques != NULL) {
+        for(threadNumber = 0; threadNumber < threadPool->thread_count; threadNumber++) {
+            pthread_mutex_destroy(&threadPool->deques[threadNumber].lock);
+            free(threadPool->deques[threadNumber].tasks);
+        }
+        free(threadPool->deques);
+        free(threadPool->workers);
+    }
+
+    if(threadPool->ring != NULL) {
+        mpmc_queue_destroy(threadPool->ring);
+    }
 
     free(threadPool->threads);
     free(threadPool->task_queue);
@@ -257,16 +597,23 @@ static void *thread_do_work(void *threadPoolArg)
         while(IsTaskQueueEmpty(threadPool)) {
             //Exit here if we're shutting down the server (this ensures that all jobs finish, but no new work is done)
             if(threadPool->exit) {
-                pthread_mutex_unlock(&threadPool->lock);
-                pthread_exit(NULL);
-            } else {
-                //Wait for work if the task queue is empty
-                pthread_cond_wait(&threadPool->new_work, &threadPool->lock);
+                ExitThread(threadPool);
+            }
+
+            //Wait for work if the task queue is empty.  A thread above the minimum that sees no work for a whole
+            //idle timeout is no longer needed
+            if(WaitForWork(threadPool) && IsTaskQueueEmpty(threadPool) &&
+                    threadPool->thread_count > threadPool->min_threads) {
+                threadPool->retired++;
+                ExitThread(threadPool);
             }
         }
 
-        //Get the next task from the queue
-        RemoveFromHeadOfQueue(threadPool, &currentTask);
+        //Get the next task from the queue, from whichever class is most urgent once waiting time is counted
+        RemoveFromHeadOfQueue(threadPool, PickPriority(threadPool), &currentTask);
+
+        //The tasks behind this one may have been waiting too long as well
+        MaybeGrow(threadPool);
 
         //We're done modifying the queue, so release the lock
         pthread_mutex_unlock(&threadPool->lock);
@@ -281,3 +628,278 @@ static void *thread_do_work(void *threadPoolArg)
     //This is an undefined state (the thread exits in the while loop), but we don't want the compiler to complain
     return NULL;
 }
+
+
+
+/*
+ * Work loop for the threads of a work stealing pool.
+ *
+ */
+static void *thread_do_stealing_work(void *workerArg)
+{
+    threadpool_worker_t* worker = (threadpool_worker_t*)workerArg;
+    threadpool_t* threadPool = worker->pool;
+    worker_deque_t* ownDeque = &threadPool->deques[worker->index];
+
+    threadpool_task_t currentTask;
+
+    while(1) {
+        //Run our own tasks first, and only look at the other deques when ours is empty
+        if(PopFromDeque(threadPool, ownDeque, &currentTask) || StealTask(threadPool, worker->index, &currentTask)) {
+            currentTask.function(currentTask.argument);
+            continue;
+        }
+
+        //There is nothing to do anywhere, so sleep until a task is added.  sleeping_workers is raised before the
+        //deques are checked again, and a submitter adds its task before reading sleeping_workers, so either we see
+        //the task here or the submitter sees us and signals new_work (which it can only do once we are waiting)
+        pthread_mutex_lock(&threadPool->lock);
+        atomic_fetch_add(&threadPool->sleeping_workers, 1);
+        while(!HasQueuedTasks(threadPool) && !threadPool->exit) {
+            pthread_cond_wait(&threadPool->new_work, &threadPool->lock);
+        }
+        atomic_fetch_sub(&threadPool->sleeping_workers, 1);
+
+        //Exit once shutting down, but only after every queued task has been run
+        if(threadPool->exit && !HasQueuedTasks(threadPool)) {
+            pthread_mutex_unlock(&threadPool->lock);
+            pthread_exit(NULL);
+        }
+        pthread_mutex_unlock(&threadPool->lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Work loop for the threads of a lock-free pool.
+ *
+ */
+static void *thread_do_lockfree_work(void *threadPoolArg)
+{
+    threadpool_t* threadPool = (threadpool_t*)threadPoolArg;
+
+    threadpool_task_t currentTask;
+
+    //mpmc_queue_pop sleeps while the queue is empty, and fails once the pool is destroyed and the queue drained
+    while(mpmc_queue_pop(threadPool->ring, &currentTask)) {
+        currentTask.function(currentTask.argument);
+    }
+
+    return NULL;
+}
+
+static int AddStealingTask(threadpool_t* threadPool, void (* function)(void*), void* argument, int wait) {
+    int start = atomic_fetch_add(&threadPool->next_deque, 1) % threadPool->thread_count;
+
+    while(1) {
+        //Start with the next deque in round-robin order, and move on to the others if it is full
+        int i;
+        for(i = 0; i < threadPool->thread_count; i++) {
+            worker_deque_t* deque = &threadPool->deques[(start + i) % threadPool->thread_count];
+            if(PushToDeque(threadPool, deque, function, argument)) {
+                //Any sleeping worker will do, since whoever wakes up steals the task if it is not in its own deque
+                if(atomic_load(&threadPool->sleeping_workers) > 0) {
+                    pthread_mutex_lock(&threadPool->lock);
+                    pthread_cond_signal(&threadPool->new_work);
+                    pthread_mutex_unlock(&threadPool->lock);
+                }
+                return 0;
+            }
+        }
+
+        if(!wait) {
+            return THREADPOOL_FULL;
+        }
+
+        //Every deque is full, so wait for a worker to take a task.  This is the same handshake as a sleeping worker
+        pthread_mutex_lock(&threadPool->lock);
+        atomic_fetch_add(&threadPool->waiting_submitters, 1);
+        while(AllDequesFull(threadPool)) {
+            pthread_cond_wait(&threadPool->not_full, &threadPool->lock);
+        }
+        atomic_fetch_sub(&threadPool->waiting_submitters, 1);
+        pthread_mutex_unlock(&threadPool->lock);
+    }
+}
+
+static int PushToDeque(threadpool_t* threadPool, worker_deque_t* deque, void (* function)(void*), void* argument) {
+    pthread_mutex_lock(&deque->lock);
+    int count = atomic_load_explicit(&deque->count, memory_order_relaxed);
+    if(count == threadPool->deque_size) {
+        pthread_mutex_unlock(&deque->lock);
+        return 0;
+    }
+
+    threadpool_task_t* newTask = &deque->tasks[(deque->head + count) % threadPool->deque_size];
+    newTask->function = function;
+    newTask->argument = argument;
+    atomic_store(&deque->count, count + 1);
+
+    pthread_mutex_unlock(&deque->lock);
+    return 1;
+}
+
+static int PopFromDeque(threadpool_t* threadPool, worker_deque_t* deque, threadpool_task_t* destination) {
+    //Skip the lock entirely when the deque is empty, which is the common case for the deques of other workers
+    if(atomic_load_explicit(&deque->count, memory_order_relaxed) == 0) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&deque->lock);
+    int count = atomic_load_explicit(&deque->count, memory_order_relaxed);
+    if(count == 0) {
+        pthread_mutex_unlock(&deque->lock);
+        return 0;
+    }
+
+    *destination = deque->tasks[deque->head];
+    deque->head = (deque->head + 1) % threadPool->deque_size;
+    atomic_store(&deque->count, count - 1);
+    pthread_mutex_unlock(&deque->lock);
+
+    WakeSubmitter(threadPool);
+    return 1;
+}
+
+static int StealTask(threadpool_t* threadPool, int thief, threadpool_task_t* destination) {
+    int i;
+    for(i = 1; i < threadPool->thread_count; i++) {
+        worker_deque_t* deque = &threadPool->deques[(thief + i) % threadPool->thread_count];
+        if(atomic_load_explicit(&deque->count, memory_order_relaxed) == 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&deque->lock);
+        int count = atomic_load_explicit(&deque->count, memory_order_relaxed);
+        if(count == 0) {
+            //The owner or another thief got there first
+            pthread_mutex_unlock(&deque->lock);
+            continue;
+        }
+
+        //Take the newest task, which is the one the owner would have reached last
+        *destination = deque->tasks[(deque->head + count - 1) % threadPool->deque_size];
+        atomic_store(&deque->count, count - 1);
+        pthread_mutex_unlock(&deque->lock);
+
+        WakeSubmitter(threadPool);
+        return 1;
+    }
+    return 0;
+}
+
+static void WakeSubmitter(threadpool_t* threadPool) {
+    if(atomic_load(&threadPool->waiting_submitters) > 0) {
+        pthread_mutex_lock(&threadPool->lock);
+        pthread_cond_signal(&threadPool->not_full);
+        pthread_mutex_unlock(&threadPool->lock);
+    }
+}
+
+static int HasQueuedTasks(threadpool_t* threadPool) {
+    int i;
+    for(i = 0; i < threadPool->thread_count; i++) {
+        if(atomic_load(&threadPool->deques[i].count) > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int AllDequesFull(threadpool_t* threadPool) {
+    int i;
+    for(i = 0; i < threadPool->thread_count; i++) {
+        if(atomic_load(&threadPool->deques[i].count) < threadPool->deque_size) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int threadpool_get_stats(threadpool_t *threadPool, threadpool_stats_t *stats)
+{
+    pthread_mutex_lock(&threadPool->lock);
+    stats->threads = threadPool->thread_count;
+    stats->idle_threads = threadPool->idle_threads;
+    stats->min_threads = threadPool->min_threads;
+    stats->max_threads = threadPool->max_threads;
+    stats->queued = threadPool->task_count;
+    stats->oldest_wait = IsTaskQueueEmpty(threadPool) ? 0 :
+            NowMilliseconds() - OldestEnqueueTime(threadPool);
+    stats->peak_threads = threadPool->peak_threads;
+    stats->grown_for_depth = threadPool->grown_for_depth;
+    stats->grown_for_wait = threadPool->grown_for_wait;
+    stats->retired = threadPool->retired;
+    pthread_mutex_unlock(&threadPool->lock);
+    return 0;
+}
+
+static void StartThread(threadpool_t* threadPool) {
+    pthread_t thread;
+    pthread_attr_t threadAttributes;
+    pthread_attr_init(&threadAttributes);
+    pthread_attr_setdetachstate(&threadAttributes, PTHREAD_CREATE_DETACHED);
+    if(pthread_create(&thread, &threadAttributes, &thread_do_work, (void*)threadPool) == 0) {
+        threadPool->thread_count++;
+        if(threadPool->thread_count > threadPool->peak_threads) {
+            threadPool->peak_threads = threadPool->thread_count;
+        }
+    } else {
+        perror("pthread_create");
+    }
+    pthread_attr_destroy(&threadAttributes);
+}
+
+static void MaybeGrow(threadpool_t* threadPool) {
+    //A waiting thread will pick up the work, and a fixed size pool never grows
+    if(threadPool->idle_threads > 0 || threadPool->thread_count >= threadPool->max_threads ||
+            IsTaskQueueEmpty(threadPool)) {
+        return;
+    }
+
+    long waited = NowMilliseconds() - OldestEnqueueTime(threadPool);
+    if(threadPool->task_count > threadPool->thread_count * THREADPOOL_GROW_DEPTH) {
+        threadPool->grown_for_depth++;
+    } else if(waited >= THREADPOOL_GROW_WAIT) {
+        threadPool->grown_for_wait++;
+    } else {
+        return;
+    }
+    StartThread(threadPool);
+}
+
+static int WaitForWork(threadpool_t* threadPool) {
+    int result;
+    threadPool->idle_threads++;
+    if(threadPool->idle_timeout > 0 && threadPool->thread_count > threadPool->min_threads) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += threadPool->idle_timeout / 1000;
+        deadline.tv_nsec += (threadPool->idle_timeout % 1000) * 1000000L;
+        if(deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        result = pthread_cond_timedwait(&threadPool->new_work, &threadPool->lock, &deadline);
+    } else {
+        result = pthread_cond_wait(&threadPool->new_work, &threadPool->lock);
+    }
+    threadPool->idle_threads--;
+    return result == ETIMEDOUT;
+}
+
+static void ExitThread(threadpool_t* threadPool) {
+    threadPool->thread_count--;
+    if(threadPool->thread_count == 0) {
+        pthread_cond_signal(&threadPool->all_exited);
+    }
+    pthread_mutex_unlock(&threadPool->lock);
+    pthread_exit(NULL);
+}
+
+static long NowMilliseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
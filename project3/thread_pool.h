@@ -3,6 +3,31 @@
 
 typedef struct threadpool_t threadpool_t;
 
+//Number of priority classes.  Priorities run from 0 (the default) to THREADPOOL_PRIORITIES - 1 (most urgent)
+#define THREADPOOL_PRIORITIES 4
+
+//Returned by threadpool_try_add when there is no room for the task
+#define THREADPOOL_FULL -1
+
+/**
+ * @struct threadpool_stats_t
+ * @brief A snapshot of how a pool is sized, filled in by threadpool_get_stats.
+ *
+ * The counters of the sizing decisions only move for elastic pools.
+ */
+typedef struct {
+    int threads;          //Live worker threads
+    int idle_threads;     //Threads waiting for work
+    int min_threads;
+    int max_threads;
+    int queued;           //Tasks waiting in the queue
+    long oldest_wait;     //Milliseconds the oldest queued task has waited
+    long peak_threads;    //Most threads alive at once
+    long grown_for_depth; //Threads started because too many tasks were queued
+    long grown_for_wait;  //Threads started because the oldest task waited too long
+    long retired;         //Threads that exited after an idle timeout
+} threadpool_stats_t;
+
 /**
  * @function threadpool_create
  * @brief Creates a threadpool_t object.
@@ -12,6 +37,52 @@ typedef struct threadpool_t threadpool_t;
  */
 threadpool_t *threadpool_create(int thread_count, int queue_size);
 
+/**
+ * @function threadpool_create_elastic
+ * @brief Creates a thread pool that grows and shrinks with its load.
+ * @param min_threads  Threads started straight away and always kept.
+ * @param max_threads  Most threads the pool will run.
+ * @param queue_size   Size of the queue.
+ * @param idle_timeout Milliseconds a thread above min_threads waits for
+ *                     work before it exits, or 0 to keep every thread.
+ * @return a newly created thread pool or NULL
+ *
+ * When every thread is busy, a thread is added if the queue holds more
+ * than a couple of tasks per thread, or if its oldest task has been
+ * waiting for more than a few milliseconds.  How often each reason
+ * applied, and how many threads have retired, is counted in
+ * threadpool_get_stats and reported at /metrics.
+ */
+threadpool_t *threadpool_create_elastic(int min_threads, int max_threads, int queue_size, int idle_timeout);
+
+/**
+ * @function threadpool_create_stealing
+ * @brief Creates a thread pool that schedules tasks by work stealing.
+ * @param thread_count Number of worker threads.
+ * @param queue_size   Total size of the queues, split evenly between the workers.
+ * @return a newly created thread pool or NULL
+ *
+ * Each worker has its own deque with its own lock.  threadpool_add_task hands
+ * tasks to the deques round-robin, a worker runs the oldest task in its own
+ * deque, and a worker whose deque is empty steals the newest task from
+ * another one before going to sleep.  Submitters and workers therefore
+ * contend on a shared lock only when a worker has to be woken up.
+ */
+threadpool_t *threadpool_create_stealing(int thread_count, int queue_size);
+
+/**
+ * @function threadpool_create_lockfree
+ * @brief Creates a thread pool whose queue does not use locks.
+ * @param thread_count Number of worker threads.
+ * @param queue_size   Size of the queue, rounded up to a power of two.
+ * @return a newly created thread pool or NULL
+ *
+ * Tasks go through an mpmc_queue.  Adding and taking a task costs a few
+ * atomic operations, and a worker is only woken with a system call when it
+ * is actually asleep.
+ */
+threadpool_t *threadpool_create_lockfree(int thread_count, int queue_size);
+
 /**
  * @function threadpool_add
  * @brief add a new task in the queue of a thread pool
@@ -20,7 +91,45 @@ threadpool_t *threadpool_create(int thread_count, int queue_size);
  * @param argument Argument to be passed to the function.
  * @return 0 if all goes well, negative values in case of error
  */
-int threadpool_add_task(threadpool_t *pool, void (*routine)(int), int argument);
+int threadpool_add_task(threadpool_t *pool, void (*routine)(void*), void* argument);
+
+/**
+ * @function threadpool_add_task_priority
+ * @brief add a new task in the queue of a thread pool, in a priority class
+ * @param pool     Threadpool to use.
+ * @param function Pointer to the function that will perform the task.
+ * @param argument Argument to be passed to the function.
+ * @param priority Priority class, clamped to 0..THREADPOOL_PRIORITIES - 1.
+ * @return 0 if all goes well, negative values in case of error
+ *
+ * Shared queue pools run the oldest task of the most urgent class first,
+ * but a task that has waited gains a class every THREADPOOL_AGING ms, so
+ * the lower classes are never starved.  Work stealing and lock-free pools
+ * ignore the priority and run tasks in the order they were added.
+ */
+int threadpool_add_task_priority(threadpool_t *pool, void (*routine)(void*), void* argument, int priority);
+
+/**
+ * @function threadpool_get_stats
+ * @brief Fills in a snapshot of the size and load of a pool.
+ * @param pool  Thread pool to look at.
+ * @param stats Where to store the snapshot.
+ * @return 0
+ *
+ * Only the thread count is filled in for work stealing and lock-free pools.
+ */
+int threadpool_get_stats(threadpool_t *pool, threadpool_stats_t *stats);
+
+/**
+ * @function threadpool_try_add
+ * @brief add a new task to a thread pool without waiting for room
+ * @param pool     Threadpool to use.
+ * @param function Pointer to the function that will perform the task.
+ * @param argument Argument to be passed to the function.
+ * @param priority Priority class, as for threadpool_add_task_priority.
+ * @return 0 if the task was added, THREADPOOL_FULL if the queue is full
+ */
+int threadpool_try_add(threadpool_t *pool, void (*routine)(void*), void* argument, int priority);
 
 /**
  * @function threadpool_destroy
@@ -0,0 +1,206 @@
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+//Longest delay the wheel can hold, in ticks
+#define MAX_DELAY ((1UL << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOT_BITS)) - 1)
+
+struct timer_wheel_t {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    atomic_int stopping;
+    int tick; //Milliseconds per tick
+    long start; //Milliseconds at which tick 0 began
+    unsigned long now; //Next tick to be processed.  Every tick before it has expired its timers
+
+    //Each slot is a circular list headed by a sentinel timer
+    wheel_timer_t slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+//Links a timer into the slot for its expiry tick, relative to the wheel's current tick
+static void AddTimer(timer_wheel_t* wheel, wheel_timer_t* timer);
+
+//Unlinks a scheduled timer from its slot
+static void RemoveTimer(wheel_timer_t* timer);
+
+//Moves every timer in a slot of a higher level down to where it belongs now
+//Returns the slot index, so the caller knows whether the next level up has wrapped around too
+static int Cascade(timer_wheel_t* wheel, int level);
+
+//Processes the wheel's current tick: cascades higher levels that have come round, then expires the due slot
+static void AdvanceTick(timer_wheel_t* wheel);
+
+//The wheel's thread.  Wakes up every tick and processes the ticks that have passed
+static void* RunWheel(void* wheelArg);
+
+//Returns the current time in milliseconds from a clock that never jumps
+static long NowMilliseconds();
+
+void wheel_timer_init(wheel_timer_t* timer, void (*expire)(wheel_timer_t*)) {
+    timer->expire = expire;
+    timer->data = 0;
+    timer->prev = NULL;
+    timer->next = NULL;
+    timer->expires = 0;
+}
+
+timer_wheel_t* timer_wheel_create(int tickMilliseconds) {
+    timer_wheel_t* wheel = (timer_wheel_t*)malloc(sizeof(timer_wheel_t));
+    pthread_mutex_init(&wheel->lock, NULL);
+    atomic_init(&wheel->stopping, 0);
+    wheel->tick = tickMilliseconds;
+    wheel->start = NowMilliseconds();
+    wheel->now = 0;
+
+    int level, slot;
+    for(level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for(slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+            wheel->slots[level][slot].next = &wheel->slots[level][slot];
+        }
+    }
+
+    //The thread inherits a mask that blocks every signal, so that signal handlers (which may well destroy the wheel)
+    //always run on the application's own threads
+    sigset_t allSignals, oldMask;
+    sigfillset(&allSignals);
+    pthread_sigmask(SIG_SETMASK, &allSignals, &oldMask);
+    int result = pthread_create(&wheel->thread, NULL, &RunWheel, wheel);
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+    if(result != 0) {
+        pthread_mutex_destroy(&wheel->lock);
+        free(wheel);
+        return NULL;
+    }
+    return wheel;
+}
+
+void timer_wheel_destroy(timer_wheel_t* wheel) {
+    atomic_store(&wheel->stopping, 1);
+    pthread_join(wheel->thread, NULL);
+    pthread_mutex_destroy(&wheel->lock);
+    free(wheel);
+}
+
+void timer_wheel_schedule(timer_wheel_t* wheel, wheel_timer_t* timer, long delayMilliseconds, uint64_t data) {
+    timer_wheel_schedule_if(wheel, timer, delayMilliseconds, data, NULL);
+}
+
+int timer_wheel_schedule_if(timer_wheel_t* wheel, wheel_timer_t* timer, long delayMilliseconds, uint64_t data,
+        int (*current)(wheel_timer_t* timer, uint64_t data)) {
+    unsigned long delay = (delayMilliseconds + wheel->tick - 1) / wheel->tick;
+    if(delay > MAX_DELAY) {
+        delay = MAX_DELAY;
+    }
+
+    pthread_mutex_lock(&wheel->lock);
+    if(current != NULL && !current(timer, data)) {
+        pthread_mutex_unlock(&wheel->lock);
+        return 0;
+    }
+    if(timer->next != NULL) {
+        RemoveTimer(timer);
+    }
+    timer->data = data;
+    timer->expires = wheel->now + delay;
+    AddTimer(wheel, timer);
+    pthread_mutex_unlock(&wheel->lock);
+    return 1;
+}
+
+void timer_wheel_cancel(timer_wheel_t* wheel, wheel_timer_t* timer) {
+    pthread_mutex_lock(&wheel->lock);
+    if(timer->next != NULL) {
+        RemoveTimer(timer);
+    }
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+static void AddTimer(timer_wheel_t* wheel, wheel_timer_t* timer) {
+    //Find the lowest level whose span covers the delay.  The slot is picked by the bits of the expiry tick that the
+    //level counts in, so the timer is cascaded down exactly when the level below reaches its range
+    unsigned long delay = timer->expires - wheel->now;
+    int level = 0;
+    while(level < TIMER_WHEEL_LEVELS - 1 && delay >= (1UL << ((level + 1) * TIMER_WHEEL_SLOT_BITS))) {
+        level++;
+    }
+    wheel_timer_t* head = &wheel->slots[level][(timer->expires >> (level * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK];
+
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void RemoveTimer(wheel_timer_t* timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+static int Cascade(timer_wheel_t* wheel, int level) {
+    int index = (wheel->now >> (level * TIMER_WHEEL_SLOT_BITS)) & SLOT_MASK;
+    wheel_timer_t* head = &wheel->slots[level][index];
+    while(head->next != head) {
+        wheel_timer_t* timer = head->next;
+        RemoveTimer(timer);
+        AddTimer(wheel, timer);
+    }
+    return index;
+}
+
+static void AdvanceTick(timer_wheel_t* wheel) {
+    //Each time a level wraps around, the next slot of the level above is due to be spread over it
+    int level = 1;
+    if((wheel->now & SLOT_MASK) == 0) {
+        while(level < TIMER_WHEEL_LEVELS && Cascade(wheel, level) == 0) {
+            level++;
+        }
+    }
+
+    wheel_timer_t* head = &wheel->slots[0][wheel->now & SLOT_MASK];
+    while(head->next != head) {
+        wheel_timer_t* timer = head->next;
+        RemoveTimer(timer);
+        timer->expire(timer);
+    }
+    wheel->now++;
+}
+
+static void* RunWheel(void* wheelArg) {
+    timer_wheel_t* wheel = (timer_wheel_t*)wheelArg;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while(!atomic_load(&wheel->stopping)) {
+        //Sleep to an absolute time, so that the time spent expiring timers does not make the wheel drift
+        next.tv_nsec += wheel->tick * 1000000L;
+        while(next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        //Catch up on every tick that has passed, in case the thread was not scheduled in time
+        unsigned long current = (NowMilliseconds() - wheel->start) / wheel->tick;
+        pthread_mutex_lock(&wheel->lock);
+        while(wheel->now <= current) {
+            AdvanceTick(wheel);
+        }
+        pthread_mutex_unlock(&wheel->lock);
+    }
+    return NULL;
+}
+
+static long NowMilliseconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
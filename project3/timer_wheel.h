@@ -0,0 +1,58 @@
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <stdint.h>
+
+/*
+timer_wheel is a hierarchical timing wheel driven by its own thread.  Time is counted in ticks, and the wheel has
+TIMER_WHEEL_LEVELS levels of TIMER_WHEEL_SLOTS slots each.  A timer due within TIMER_WHEEL_SLOTS ticks goes in the
+slot of the lowest level for its exact tick; one due later goes in a coarser slot of a higher level, and is moved
+down a level (cascaded) when the lower level wraps around to it.  Scheduling and cancelling are O(1): a timer is
+linked into or out of a doubly linked slot list.  Each tick, the thread only looks at the one slot that is due, plus
+the occasional cascade.
+
+Timers are intrusive: the caller owns the wheel_timer_t, typically embedded in the object it times, so the wheel
+never allocates.  The expire callback runs on the wheel's thread with the wheel locked, so it must be short and must
+not call back into the wheel.
+*/
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+typedef struct timer_wheel_t timer_wheel_t;
+
+typedef struct wheel_timer_t {
+    void (*expire)(struct wheel_timer_t* timer); //Set by the owner before the timer is first scheduled
+    uint64_t data; //Set by timer_wheel_schedule, for the expire callback to read
+
+    //Managed by the wheel
+    struct wheel_timer_t* prev;
+    struct wheel_timer_t* next; //NULL if the timer is not scheduled
+    unsigned long expires; //Tick at which the timer is due
+} wheel_timer_t;
+
+//Prepares a timer that is not scheduled
+void wheel_timer_init(wheel_timer_t* timer, void (*expire)(wheel_timer_t*));
+
+//Creates a wheel that advances every tickMilliseconds and starts its thread
+timer_wheel_t* timer_wheel_create(int tickMilliseconds);
+
+//Stops the wheel's thread and frees the wheel.  Timers that are still scheduled never expire
+void timer_wheel_destroy(timer_wheel_t* wheel);
+
+//Schedules a timer to expire after delayMilliseconds (rounded up to whole ticks), replacing any earlier schedule of
+//the same timer.  data is stored in the timer with the wheel locked, so the callback sees the data passed with the
+//schedule that fired.  Delays longer than the wheel can represent are cut short to the longest it can
+void timer_wheel_schedule(timer_wheel_t* wheel, wheel_timer_t* timer, long delayMilliseconds, uint64_t data);
+
+//Same as timer_wheel_schedule, but only if current(timer, data) returns true.  current is called with the wheel
+//locked, which orders it against the expire callback and any other schedule of the timer: a caller whose data was
+//overtaken before it got the lock leaves the newer schedule alone.  Returns true if the timer was scheduled
+int timer_wheel_schedule_if(timer_wheel_t* wheel, wheel_timer_t* timer, long delayMilliseconds, uint64_t data,
+        int (*current)(wheel_timer_t* timer, uint64_t data));
+
+//Unschedules a timer.  Does nothing if it is not scheduled
+void timer_wheel_cancel(timer_wheel_t* wheel, wheel_timer_t* timer);
+
+#endif
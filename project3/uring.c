@@ -0,0 +1,270 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+//The part of a ring shared with the kernel.  The kernel writes the consumer head of the submission queue and the
+//producer tail of the completion queue; everything else is written by this process
+struct uring_t {
+    int fd;
+    unsigned int features;
+
+    //Submission queue.  sqe_tail runs ahead of the shared tail by the entries filled in but not yet submitted
+    atomic_uint* sq_head;
+    atomic_uint* sq_tail;
+    unsigned int sq_mask;
+    unsigned int sq_entries;
+    unsigned int sqe_tail;
+    struct io_uring_sqe* sqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    size_t sqes_size;
+
+    //Completion queue
+    atomic_uint* cq_head;
+    atomic_uint* cq_tail;
+    unsigned int cq_mask;
+    struct io_uring_cqe* cqes;
+    void* cq_ring; //Same as sq_ring if the kernel maps both rings at once
+    size_t cq_ring_size;
+
+    //Provided buffers.  The ring of buffer descriptors is shared with the kernel, which consumes from its head
+    struct io_uring_buf_ring* buffer_ring;
+    size_t buffer_ring_size;
+    unsigned int buffer_mask;
+    unsigned short buffer_tail;
+    char* buffers;
+    int buffer_size;
+    int buffer_count;
+    int buffer_group;
+};
+
+//Adds a provided buffer to the tail of the buffer ring.  The new tail is published by the caller
+static void AddBuffer(uring_t* ring, int id);
+
+uring_t* uring_create(unsigned int entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(SYS_io_uring_setup, entries, &params);
+    if(fd < 0) {
+        return NULL;
+    }
+
+    uring_t* ring = (uring_t*)calloc(1, sizeof(uring_t));
+    ring->fd = fd;
+    ring->features = params.features;
+
+    //Map the rings.  Newer kernels let one mapping cover both queues
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(ring->features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+            IORING_OFF_SQ_RING);
+    if(ring->sq_ring == MAP_FAILED) {
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+    if(ring->features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                IORING_OFF_CQ_RING);
+        if(ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+            close(fd);
+            free(ring);
+            return NULL;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        if(ring->cq_ring != ring->sq_ring) {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        munmap(ring->sq_ring, ring->sq_ring_size);
+        close(fd);
+        free(ring);
+        return NULL;
+    }
+
+    char* sq = (char*)ring->sq_ring;
+    ring->sq_head = (atomic_uint*)(sq + params.sq_off.head);
+    ring->sq_tail = (atomic_uint*)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned int*)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = *(unsigned int*)(sq + params.sq_off.ring_entries);
+    ring->sqe_tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+
+    //Submission queue entries are always used in ring order, so the indirection array never changes
+    unsigned int* array = (unsigned int*)(sq + params.sq_off.array);
+    unsigned int i;
+    for(i = 0; i < ring->sq_entries; i++) {
+        array[i] = i;
+    }
+
+    char* cq = (char*)ring->cq_ring;
+    ring->cq_head = (atomic_uint*)(cq + params.cq_off.head);
+    ring->cq_tail = (atomic_uint*)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned int*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    ring->buffer_ring = NULL;
+    return ring;
+}
+
+void uring_destroy(uring_t* ring) {
+    //Closing the ring unregisters the buffers and cancels anything in flight
+    close(ring->fd);
+    if(ring->buffer_ring != NULL) {
+        munmap(ring->buffer_ring, ring->buffer_ring_size);
+        free(ring->buffers);
+    }
+    munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    free(ring);
+}
+
+struct io_uring_sqe* uring_get_sqe(uring_t* ring) {
+    while(ring->sqe_tail - atomic_load_explicit(ring->sq_head, memory_order_acquire) >= ring->sq_entries) {
+        //The kernel consumes submitted entries during io_uring_enter, so submitting always makes room
+        if(uring_submit(ring) < 0) {
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe* sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sqe_tail++;
+    return sqe;
+}
+
+unsigned int uring_sq_space(uring_t* ring) {
+    return ring->sq_entries - (ring->sqe_tail - atomic_load_explicit(ring->sq_head, memory_order_acquire));
+}
+
+int uring_submit(uring_t* ring) {
+    //Publish the filled entries before telling the kernel about them
+    atomic_store_explicit(ring->sq_tail, ring->sqe_tail, memory_order_release);
+    while(1) {
+        unsigned int pending = ring->sqe_tail - atomic_load_explicit(ring->sq_head, memory_order_acquire);
+        if(pending == 0) {
+            return 0;
+        }
+        int result = syscall(SYS_io_uring_enter, ring->fd, pending, 0, 0, NULL, 0);
+        if(result < 0 && errno != EINTR) {
+            //EBUSY means the completion queue is backed up, and retrying cannot help until completions are
+            //reaped, which may be this very thread's job.  The entries stay published, and uring_wait hands them
+            //over once the reaper gets to them
+            return -errno;
+        }
+    }
+}
+
+int uring_wait(uring_t* ring) {
+    if(uring_peek_cqe(ring) != NULL) {
+        return 0;
+    }
+
+    //Hand over whatever a submitter published but could not submit.  Only the shared tail is read, which covers
+    //complete entries only, and the kernel serializes submissions itself
+    unsigned int pending = atomic_load_explicit(ring->sq_tail, memory_order_acquire) -
+            atomic_load_explicit(ring->sq_head, memory_order_acquire);
+    if(syscall(SYS_io_uring_enter, ring->fd, pending, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+        if(pending == 0 || (errno != EBUSY && errno != EAGAIN)) {
+            return -errno;
+        }
+        //The completions have to be reaped before anything more can be submitted, so just wait for them
+        if(syscall(SYS_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring) {
+    unsigned int head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    if(head == atomic_load_explicit(ring->cq_tail, memory_order_acquire)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+void uring_cqe_seen(uring_t* ring) {
+    //The kernel may reuse the slot as soon as it sees the new head, so the completion must have been read by now
+    atomic_store_explicit(ring->cq_head, atomic_load_explicit(ring->cq_head, memory_order_relaxed) + 1,
+            memory_order_release);
+}
+
+int uring_register_buffers(uring_t* ring, int group, int count, int size) {
+    //The kernel wants a power of two number of descriptors, in page aligned memory
+    unsigned int entries = 1;
+    while(entries < count) {
+        entries *= 2;
+    }
+    ring->buffer_ring_size = entries * sizeof(struct io_uring_buf);
+    ring->buffer_ring = (struct io_uring_buf_ring*)mmap(NULL, ring->buffer_ring_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(ring->buffer_ring == MAP_FAILED) {
+        ring->buffer_ring = NULL;
+        return -ENOMEM;
+    }
+
+    struct io_uring_buf_reg registration;
+    memset(&registration, 0, sizeof(registration));
+    registration.ring_addr = (unsigned long)ring->buffer_ring;
+    registration.ring_entries = entries;
+    registration.bgid = group;
+    if(syscall(SYS_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &registration, 1) < 0) {
+        int error = errno;
+        munmap(ring->buffer_ring, ring->buffer_ring_size);
+        ring->buffer_ring = NULL;
+        return -error;
+    }
+
+    ring->buffer_mask = entries - 1;
+    ring->buffer_tail = 0;
+    ring->buffer_size = size;
+    ring->buffer_count = count;
+    ring->buffer_group = group;
+    ring->buffers = (char*)malloc((size_t)count * size);
+
+    int i;
+    for(i = 0; i < count; i++) {
+        AddBuffer(ring, i);
+    }
+    atomic_store_explicit((_Atomic unsigned short*)&ring->buffer_ring->tail, ring->buffer_tail, memory_order_release);
+    return 0;
+}
+
+char* uring_buffer(uring_t* ring, int id) {
+    return ring->buffers + (size_t)id * ring->buffer_size;
+}
+
+void uring_recycle_buffer(uring_t* ring, int id) {
+    AddBuffer(ring, id);
+    atomic_store_explicit((_Atomic unsigned short*)&ring->buffer_ring->tail, ring->buffer_tail, memory_order_release);
+}
+
+static void AddBuffer(uring_t* ring, int id) {
+    //The first descriptor's last field doubles as the ring's tail, so only fill in the fields before it
+    struct io_uring_buf* buffer = &ring->buffer_ring->bufs[ring->buffer_tail & ring->buffer_mask];
+    buffer->addr = (unsigned long)uring_buffer(ring, id);
+    buffer->len = ring->buffer_size;
+    buffer->bid = id;
+    ring->buffer_tail++;
+}
@@ -0,0 +1,61 @@
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <linux/io_uring.h>
+
+/*
+uring is a thin wrapper around the io_uring system calls, which the C library does not provide.  It sets up the
+submission and completion rings shared with the kernel, and a ring of provided buffers that receive operations can
+pick a buffer from when data actually arrives, so that idle sockets do not each hold a buffer of their own.
+
+A submission queue entry is claimed with uring_get_sqe, filled in, and handed to the kernel with uring_submit.
+Submissions are NOT threadsafe; threads that share a ring must serialize from uring_get_sqe to uring_submit
+themselves.  Completions are reaped with uring_wait, uring_peek_cqe and uring_cqe_seen, and must only be reaped by
+one thread, which is also the only thread that may recycle provided buffers.
+*/
+
+typedef struct uring_t uring_t;
+
+//Sets up a ring with room for entries submissions (rounded up to a power of two by the kernel)
+//Returns NULL if the kernel does not support io_uring or it has been disabled
+uring_t* uring_create(unsigned int entries);
+
+//Unregisters everything and closes the ring.  Operations still in flight are cancelled by the kernel
+void uring_destroy(uring_t* ring);
+
+//Returns a zeroed submission queue entry to fill in.  If the submission queue is full, the entries already in it are
+//submitted first to make room
+struct io_uring_sqe* uring_get_sqe(uring_t* ring);
+
+//Returns the number of entries uring_get_sqe can hand out before it has to submit.  Linked entries must all be
+//submitted together, so a chain should only be started when there is room for all of it
+unsigned int uring_sq_space(uring_t* ring);
+
+//Hands the entries filled in since the last call to the kernel
+//Returns 0 on success or a negative errno.  On -EBUSY or -EAGAIN the completion queue has to be reaped before the
+//kernel takes more; the entries stay queued and are handed over by the next uring_submit or uring_wait
+int uring_submit(uring_t* ring);
+
+//Sleeps until at least one completion is waiting, first handing over any entries uring_submit could not
+//Returns 0, or a negative errno (-EINTR if a signal arrived)
+int uring_wait(uring_t* ring);
+
+//Returns the oldest completion, or NULL if there are none.  It stays in the ring until uring_cqe_seen is called
+struct io_uring_cqe* uring_peek_cqe(uring_t* ring);
+
+//Frees the completion returned by the last uring_peek_cqe
+void uring_cqe_seen(uring_t* ring);
+
+//Registers count provided buffers of size bytes each as buffer group group
+//A receive submitted with IOSQE_BUFFER_SELECT and this buf_group is given one of them; the completion's flags hold
+//IORING_CQE_F_BUFFER and the buffer id (flags >> IORING_CQE_BUFFER_SHIFT)
+//Returns 0 on success or a negative errno.  Only one group may be registered per ring
+int uring_register_buffers(uring_t* ring, int group, int count, int size);
+
+//Returns the memory of a provided buffer
+char* uring_buffer(uring_t* ring, int id);
+
+//Gives a provided buffer back to the kernel once its contents have been consumed
+void uring_recycle_buffer(uring_t* ring, int id);
+
+#endif
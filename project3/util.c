@@ -15,18 +15,24 @@
 
 #include "seats.h"
 #include "file_cache.h"
+#include "connection.h"
+#include "seat_events.h"
+#include "metrics.h"
 
 #define BUFSIZE 1024
 
+//Seconds an overloaded client is asked to wait before retrying
+#define RETRY_AFTER 1
 
-int writenbytes(int,char *,int);
-int readnbytes(int,char *,int);
-int get_line(int, char*,int);
 
-int parse_int_arg(char* filename, char* arg);
+void append_headers(connection_t* connection, const char* status, const char* contentType, long contentLength);
+void append_not_modified(connection_t* connection, const char* etag);
 
-void handle_connection(int connfd)
+void handle_connection(void* connectionArg)
 {
+    connection_t* connection = (connection_t*)connectionArg;
+    const http_request_t* request = &connection->request;
+
     /*long initialTime;
     long finalTime;
     struct timespec time;
@@ -34,306 +40,221 @@ void handle_connection(int connfd)
     clock_gettime(CLOCK_REALTIME, &time);
     initialTime = time.tv_nsec;*/
 
-    int fd;
+    int fd = -1;
     char buf[BUFSIZE+1];
-    char instr[20];
     char file[100];
-    char type[20];
-
-    int i=0;
-    int j=0;
-
-    char *ok_response = "HTTP/1.0 200 OK\r\n"\
-                           "Content-type: text/html\r\n\r\n";
 
-    char *notok_response = "HTTP/1.0 404 FILE NOT FOUND\r\n"\
-                            "Content-type: text/html\r\n\r\n"\
-                            "<html><body bgColor=white text=black>\n"\
-                            "<h2>404 FILE NOT FOUND</h2>\n"\
-                            "</body></html>\n";
+    char *ok_status = "200 OK";
 
-    char *bad_request = "HTTP/1.0 400 BAD REQUEST\r\n"\
-                              "Content-type: text/html\r\n\r\n"\
-                              "<html><body><h2>BAD REQUEST</h2>"\
-                              "</body></html>\n";
+    char *server_error_status = "500 INTERNAL SERVER ERROR";
 
+    char *notok_status = "404 FILE NOT FOUND";
+    char *notok_body = "<html><body bgColor=white text=black>\n"\
+                       "<h2>404 FILE NOT FOUND</h2>\n"\
+                       "</body></html>\n";
 
-    // first read loop -- get request and headers
+    char *bad_request_status = "400 BAD REQUEST";
+    char *bad_request_body = "<html><body><h2>BAD REQUEST</h2>"\
+                             "</body></html>\n";
 
-    // parse request to get file name
-    // Assumption: this is a GET request and filename contains no spaces
-    // parse request
-    // get headers
+    // The event loop has already read and parsed the request line and headers
+    connection->keep_alive = request->keep_alive;
+    // pages without a route of their own are timed together
+    connection->route = METRICS_OTHER;
 
-    //Expection Format: 'GET filenane.txt HTTP/1.X'
-
-    get_line(connfd, buf, BUFSIZE);
-    //printf("line:%s\n", buf);
-    //parse out instruction
-    while( !isspace(buf[j]) && (i < sizeof(instr) - 1))
-    {
-        instr[i] = buf[i];
-        i++;
-        j++;
-    }
-    j+=2;
-    instr[i] = '\0';
-
-
-    //Only accept GET requests
-    if (strncmp(instr, "GET", 3) != 0) {
-        writenbytes(connfd, bad_request, strlen(bad_request));
-        close(connfd);
+    //Only accept GET requests.  A malformed request leaves no way to find the next one, so close the connection
+    if (connection->request_error || !http_slice_equals(request, request->method, "GET")) {
+        connection->keep_alive = 0;
+        append_headers(connection, bad_request_status, "text/html", strlen(bad_request_body));
+        connection_append(connection, bad_request_body, strlen(bad_request_body));
         return;
     }
 
-    //parse out filename
-    i=0;
-    while (!isspace(buf[j]) && (i < sizeof(file) - 1))
-    {
-        file[i] = buf[j];
-        i++;
-        j++;
-    }
-    j++;
-    file[i] = '\0';
+    int seat_id = http_request_arg_int(request, "seat", 0);
+    int user_id = http_request_arg_int(request, "user", 0);
+    int customer_priority = http_request_arg_int(request, "priority", 0);
 
-    //parse out type
-    i=0;
-    while (!isspace(buf[j]) && (buf[j] != '\0') && (i < sizeof(type) - 1))
+    // Check if the request is for one of our operations
+    if (http_slice_equals(request, request->path, "list_seats"))
     {
-        type[i] = buf[j];
-        i++;
-        j++;
+        connection->route = METRICS_LIST_SEATS;
+        int length;
+        const char* list = list_seats(&length);
+        // send headers
+        append_headers(connection, ok_status, "text/html", length);
+        // send the list straight from seats.c's rendering, however many seats there are
+        connection_set_body(connection, list, length, NULL, NULL);
     }
-    type[i] = '\0';
-
-    while (get_line(connfd, buf, BUFSIZE) > 0)
+    else if(http_slice_equals(request, request->path, "find_seats"))
     {
-        //ignore headers -> (for now)
-    }
-
-    //Parse the url string
-    char* resource = strtok(file, "?");
-    char* arg1Name = strtok(NULL, "=");
-    char* arg1Value = strtok(NULL, "&?");
-    char* arg2Name = strtok(NULL, "=");
-    char* arg2Value = strtok(NULL, "&?");
-
-    int seat_id = 0;
-    int user_id = 0;
-    int customer_priority = 0;
-
-    if(arg1Name != NULL) {
-        if(strcmp(arg1Name, "seat") == 0) {
-            seat_id = atoi(arg1Value);
-        } else if(strcmp(arg1Name, "user") == 0) {
-            user_id = atoi(arg1Value);
-        }
-    }
-    if(arg2Name != NULL) {
-        if(strcmp(arg2Name, "seat") == 0) {
-            seat_id = atoi(arg2Value);
-        } else if(strcmp(arg2Name, "user") == 0) {
-            user_id = atoi(arg2Value);
-        }
+        find_seats(buf, BUFSIZE, http_request_arg_int(request, "count", 0));
+        // send headers
+        append_headers(connection, ok_status, "text/html", strlen(buf));
+        // send data
+        connection_append(connection, buf, strlen(buf));
     }
-
-
-/*
-    int length;
-    for(i = 0; i < strlen(file); i++)
+    else if(http_slice_equals(request, request->path, "seat_events"))
     {
-        if(file[i] == '?')
-            break;
-    }
-    length = i;
-
-    char resource[length+1];
-
-    if (length > strlen(file)) {
-      length = strlen(file);
+        // the event loop keeps the connection and streams transitions to it once the head is sent
+        seat_events_subscribe(connection);
     }
-
-    strncpy(resource, file, length);
-    resource[length] = 0;
-
-*/
-
-    // Check if the request is for one of our operations
-    if (strcmp(resource, "list_seats") == 0)
+    else if(http_slice_equals(request, request->path, "view_seat"))
     {
-        list_seats(buf, BUFSIZE);
+        connection->route = METRICS_VIEW_SEAT;
+        view_seat(buf, BUFSIZE, seat_id, user_id, customer_priority);
         // send headers
-        writenbytes(connfd, ok_response, strlen(ok_response));
+        append_headers(connection, ok_status, "text/html", strlen(buf));
         // send data
-        writenbytes(connfd, buf, strlen(buf));
+        connection_append(connection, buf, strlen(buf));
     }
-    else if(strcmp(resource, "view_seat") == 0)
+    else if(http_slice_equals(request, request->path, "confirm"))
     {
-        view_seat(buf, BUFSIZE, seat_id, user_id, customer_priority);
-        // send headers
-        writenbytes(connfd, ok_response, strlen(ok_response));
+        connection->route = METRICS_CONFIRM;
+        int result = confirm_seat(buf, BUFSIZE, seat_id, user_id, customer_priority);
+        // send headers; a confirmation that did not reach the disk is a server error
+        append_headers(connection, result < 0 ? server_error_status : ok_status, "text/html", strlen(buf));
         // send data
-        writenbytes(connfd, buf, strlen(buf));
+        connection_append(connection, buf, strlen(buf));
     }
-    else if(strcmp(resource, "confirm") == 0)
+    else if(http_slice_equals(request, request->path, "view_seats"))
     {
-        confirm_seat(buf, BUFSIZE, seat_id, user_id, customer_priority);
+        int seat_ids[SEATS_MAX_BATCH];
+        int count = http_request_arg_int_list(request, "seats", seat_ids, SEATS_MAX_BATCH);
+        view_seats(buf, BUFSIZE, seat_ids, count, user_id, customer_priority);
         // send headers
-        writenbytes(connfd, ok_response, strlen(ok_response));
+        append_headers(connection, ok_status, "text/html", strlen(buf));
         // send data
-        writenbytes(connfd, buf, strlen(buf));
+        connection_append(connection, buf, strlen(buf));
     }
-    else if(strcmp(resource, "cancel") == 0)
+    else if(http_slice_equals(request, request->path, "confirm_seats"))
     {
+        int seat_ids[SEATS_MAX_BATCH];
+        int count = http_request_arg_int_list(request, "seats", seat_ids, SEATS_MAX_BATCH);
+        int result = confirm_seats(buf, BUFSIZE, seat_ids, count, user_id, customer_priority);
+        // send headers; a confirmation that did not reach the disk is a server error
+        append_headers(connection, result < 0 ? server_error_status : ok_status, "text/html", strlen(buf));
+        // send data
+        connection_append(connection, buf, strlen(buf));
+    }
+    else if(http_slice_equals(request, request->path, "cancel"))
+    {
+        connection->route = METRICS_CANCEL;
         cancel(buf, BUFSIZE, seat_id, user_id, customer_priority);
         // send headers
-        writenbytes(connfd, ok_response, strlen(ok_response));
+        append_headers(connection, ok_status, "text/html", strlen(buf));
         // send data
-        writenbytes(connfd, buf, strlen(buf));
+        connection_append(connection, buf, strlen(buf));
+    }
+    else if(http_slice_equals(request, request->path, "metrics"))
+    {
+        int length;
+        char* report = metrics_report(&length);
+        if (report == NULL)
+        {
+            connection->keep_alive = 0;
+            append_headers(connection, server_error_status, "text/plain", 0);
+        }
+        else
+        {
+            // send headers
+            append_headers(connection, ok_status, "text/plain; version=0.0.4", length);
+            // send the report as it is; the connection frees it once it is sent
+            connection_set_body(connection, report, length, &free, report);
+        }
     }
     else
     {
+        connection->route = METRICS_STATIC;
         // try to open the file
-        if ((fd = open(resource, O_RDONLY)) == -1)
+        // look in the cache first; a hit needs no system calls at all
+        http_slice_copy(request, request->path, file, sizeof(file));
+        unsigned int fileHash = FileCacheHash(file);
+        FileCache* cacheEntry = GetCacheEntry(file, fileHash);
+
+        // only regular files are served; directories and devices have no length to send
+        struct stat fileStat;
+        if (cacheEntry == NULL &&
+                ((fd = open(file, O_RDONLY)) == -1 || fstat(fd, &fileStat) == -1 || !S_ISREG(fileStat.st_mode)))
         {
-            writenbytes(connfd, notok_response, strlen(notok_response));
+            if (fd != -1)
+                close(fd);
+            append_headers(connection, notok_status, "text/html", strlen(notok_body));
+            connection_append(connection, notok_body, strlen(notok_body));
         }
         else
         {
-            FileCache* cacheEntry = GetCacheEntry(resource);
-
-            if(cacheEntry != NULL) {
-                writenbytes(connfd, ok_response, strlen(ok_response));
-                writenbytes(connfd, cacheEntry->buffer, cacheEntry->size);
-            } else {
-
-                // send headers
-                writenbytes(connfd, ok_response, strlen(ok_response));
-                // send file
-                int ret;
-                while ( (ret = read(fd, buf, BUFSIZE)) > 0) {
-                    writenbytes(connfd, buf, ret);
+            if(cacheEntry == NULL) {
+                // first request for this file: add it to the cache if it fits
+                cacheEntry = AddFileCacheEntry(fd, file, fileHash);
+                if(cacheEntry != NULL) {
+                    close(fd);
                 }
             }
 
-
-            // close file and free space
-            close(fd);
+            const http_slice_t* ifNoneMatch = http_request_header(request, "If-None-Match");
+            if(cacheEntry != NULL && ifNoneMatch != NULL && http_slice_equals(request, *ifNoneMatch, cacheEntry->etag)) {
+                // the client already has this version of the file
+                append_not_modified(connection, cacheEntry->etag);
+                ReleaseCacheEntry(cacheEntry);
+            } else if(cacheEntry != NULL) {
+                // send the pre-built header and the cached copy together; the connection releases the entry once
+                // it is sent
+                connection_append(connection, cacheEntry->header[connection->keep_alive],
+                        cacheEntry->header_length[connection->keep_alive]);
+                connection_set_body(connection, cacheEntry->buffer, cacheEntry->size, &ReleaseCacheEntry, cacheEntry);
+            } else {
+                // too large for the cache: send the file with sendfile(); the connection closes it once it has been sent
+                append_headers(connection, ok_status, ContentTypeForPath(file), fileStat.st_size);
+                connection_set_file(connection, fd, fileStat.st_size);
+            }
         }
     }
 
-    close(connfd);
-
     /*clock_gettime(CLOCK_REALTIME, &time);
     finalTime = time.tv_nsec;
     printf("Request %s time %li us\n", file, (finalTime - initialTime)/100);*/
 }
 
-int get_line(int fd, char *buf, int size)
+//Appends the status line and headers of a response with a body of contentLength bytes
+//The body length is always sent so that the connection can be reused for the next request
+void append_headers(connection_t* connection, const char* status, const char* contentType, long contentLength)
 {
-
-    int i=0;
-    char c = '\0';
-    int n;
-
-    while((i < size-1) && (c != '\n'))
-    {
-        n = readnbytes(fd, &c, 1);
-        if (n > 0)
-        {
-            if (c == '\r')
-            {
-                n = readnbytes(fd, &c, 1);
-
-                if ((n > 0) && (c == '\n'))
-                {
-                    //this is an \r\n endline for request
-                    //we want to then return the line
-                    //readnbytes(fd, &c, 1);
-                    continue;
-                }
-                else
-                {
-                    c = '\n';
-                }
-            }
-            buf[i] = c;
-            i++;
-        }
-        else
-        {
-            c = '\n';
-        }
-    }
-    buf[i] = '\0';
-    return i;
+    char headers[256];
+    int length = snprintf(headers, sizeof(headers),
+            "HTTP/1.1 %s\r\n"\
+            "Content-type: %s\r\n"\
+            "Content-Length: %ld\r\n"\
+            "Connection: %s\r\n\r\n",
+            status, contentType, contentLength, connection->keep_alive ? "keep-alive" : "close");
+    connection_append(connection, headers, length);
 }
 
-int readnbytes(int fd,char *buf,int size)
+void handle_overload(void* connectionArg)
 {
-    int rc = 0;
-    int totalread = 0;
-    while ((rc = read(fd,buf+totalread,size-totalread)) > 0) {
-        totalread += rc;
-    }
-
-
-    if (rc < 0)
-    {
-        return -1;
-    }
-    else
-        return totalread;
+    connection_t* connection = (connection_t*)connectionArg;
+    char *busy_body = "<html><body><h2>503 SERVICE UNAVAILABLE</h2>"\
+                      "The server is too busy to handle your request.  Please try again shortly.</body></html>\n";
+
+    char headers[256];
+    int length = snprintf(headers, sizeof(headers),
+            "HTTP/1.1 503 Service Unavailable\r\n"\
+            "Content-type: text/html\r\n"\
+            "Content-Length: %d\r\n"\
+            "Retry-After: %d\r\n"\
+            "Connection: close\r\n\r\n",
+            (int)strlen(busy_body), RETRY_AFTER);
+    connection_append(connection, headers, length);
+    connection_append(connection, busy_body, strlen(busy_body));
 }
 
-int writenbytes(int fd,char *str,int size)
+//Appends a complete 304 response, sent when the client's cached copy matches etag
+void append_not_modified(connection_t* connection, const char* etag)
 {
-    int rc = 0;
-    int totalwritten =0;
-    while ((rc = write(fd,str+totalwritten,size-totalwritten)) > 0)
-        totalwritten += rc;
-
-    if (rc < 0)
-        return -1;
-    else
-        return totalwritten;
-}
-
-int parse_int_arg(char* filename, char* arg)
-{
-    int i;
-    bool found_value_start = false;
-    bool found_arg_list_start = false;
-    int seatnum = 0;
-    for(i=0; i < strlen(filename); i++)
-    {
-        if (!found_arg_list_start)
-        {
-            if (filename[i] == '?')
-            {
-                found_arg_list_start = true;
-            }
-            continue;
-        }
-        if (!found_value_start && strncmp(&filename[i], arg, strlen(arg)) == 0)
-        {
-            found_value_start = true;
-            i += strlen(arg);
-        }
-        if (found_value_start)
-        {
-            if(isdigit(filename[i]))
-            {
-                seatnum = seatnum * 10 + (int) filename[i] - (int) '0';
-                continue;
-            }
-            else
-            {
-                break;
-            }
-        }
-    }
-    return seatnum;
+    char headers[256];
+    int length = snprintf(headers, sizeof(headers),
+            "HTTP/1.1 304 Not Modified\r\n"\
+            "ETag: %s\r\n"\
+            "Connection: %s\r\n\r\n",
+            etag, connection->keep_alive ? "keep-alive" : "close");
+    connection_append(connection, headers, length);
 }
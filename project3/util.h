@@ -1,7 +1,10 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
-void handle_connection(int connfd);
+void handle_connection(void* connection);
+
+//Places a "503 Service Unavailable" response in the connection, asking the client to retry shortly
+void handle_overload(void* connection);
 
 
 